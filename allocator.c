@@ -1,61 +1,142 @@
 #include "allocator.h"
 
-// A very simple stack-based allocator
-// Probably should replace this with an region-based allocator, but for now just doing this
+// A region allocator: memory is bump allocated out of big chunks and all freed at once.
+// Nothing the compiler allocates is freed before the compiler is, so there's no need to track
+// individual allocations.
 
-struct Stack;
-struct Stack {
-    void *memory;
-    struct Stack *next;
+#define CHUNK_SIZE_INIT (16 * 1024)
+#define CHUNK_SIZE_MAX (1024 * 1024)
+#define ALIGNMENT _Alignof(max_align_t)
+
+struct Chunk;
+struct Chunk {
+    struct Chunk *next;
+    size_t size;
+    max_align_t memory[];
 };
 
 struct Alloc {
-    struct Stack *global_allocator;
+    struct Chunk *chunks;
+    char *next; // Free memory in the first chunk
+    char *end;
+    size_t chunk_size; // Size of the next chunk, doubled each time up to CHUNK_SIZE_MAX
     size_t global_total_mem_usage;
     size_t global_allocator_usage;
 };
 
-
 Allocator allocator_new(void)
 {
     struct Alloc *a = malloc(sizeof(*a));
-    a->global_allocator = NULL;
+    a->chunks = NULL;
+    a->next = NULL;
+    a->end = NULL;
+    a->chunk_size = CHUNK_SIZE_INIT;
     a->global_total_mem_usage = 0;
     a->global_allocator_usage = 0;
     return (Allocator)a;
 }
 
+// Chunks come from calloc, and memory is never reused, so everything handed out is already
+// zeroed
+static struct Chunk *new_chunk(struct Alloc *allocator, size_t size)
+{
+    struct Chunk *chunk = calloc(1, sizeof(*chunk) + size);
+    if (chunk == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    chunk->size = size;
+    allocator->global_allocator_usage += sizeof(*chunk) + size;
+    return chunk;
+}
+
+static void *allocate_large(struct Alloc *allocator, size_t size)
+{
+    struct Chunk *chunk = new_chunk(allocator, size);
+    // Put it behind the current chunk, so that the current chunk's free memory isn't lost
+    if (allocator->chunks == NULL) {
+        chunk->next = NULL;
+        allocator->chunks = chunk;
+    } else {
+        chunk->next = allocator->chunks->next;
+        allocator->chunks->next = chunk;
+    }
+    return chunk->memory;
+}
+
 void *allocator_malloc(Allocator a, size_t size)
 {
     struct Alloc *allocator = (struct Alloc *)a;
     allocator->global_total_mem_usage += size;
-    // printf("allocating %lu bytes\n", size);
-    allocator->global_allocator_usage += sizeof(struct Stack);
-    void *memory = malloc(size);
-    memset(memory, 0, size);
-    struct Stack *stack = malloc(sizeof(*stack));
-    stack->memory = memory;
-    stack->next = allocator->global_allocator;
-    allocator->global_allocator = stack;
-    return memory;
+    // Like malloc, zero bytes still gets a pointer of its own, whether or not there's a chunk yet
+    size = size == 0 ? ALIGNMENT : (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    if ((size_t) (allocator->end - allocator->next) >= size) {
+        void *memory = allocator->next;
+        allocator->next += size;
+        return memory;
+    }
+    // Anything bigger than a quarter of a chunk gets a chunk to itself, so that it doesn't waste
+    // the rest of the current one
+    if (size > allocator->chunk_size / 4) {
+        return allocate_large(allocator, size);
+    }
+    struct Chunk *chunk = new_chunk(allocator, allocator->chunk_size);
+    chunk->next = allocator->chunks;
+    allocator->chunks = chunk;
+    allocator->next = (char *) chunk->memory + size;
+    allocator->end = (char *) chunk->memory + chunk->size;
+    if (allocator->chunk_size < CHUNK_SIZE_MAX) {
+        allocator->chunk_size *= 2;
+    }
+    return chunk->memory;
 }
 
 void allocator_freeall(Allocator a)
 {
     struct Alloc *allocator = (struct Alloc *)a;
-    struct Stack *next = NULL;
-    for (struct Stack *current = allocator->global_allocator; current != NULL; current = next) {
+    struct Chunk *next = NULL;
+    for (struct Chunk *current = allocator->chunks; current != NULL; current = next) {
         next = current->next;
-        free(current->memory);
         free(current);
     }
     free(allocator);
 }
 
+/* Takes over everything from was used for, and frees from. Compiler threads each allocate out
+ * of their own allocator, and hand what they built over to the main one when they're done. */
+void allocator_merge(Allocator a, Allocator from)
+{
+    struct Alloc *allocator = (struct Alloc *)a;
+    struct Alloc *other = (struct Alloc *)from;
+    struct Chunk *last = other->chunks;
+    if (last != NULL) {
+        while (last->next != NULL) {
+            last = last->next;
+        }
+        // Behind the current chunk, like a large allocation
+        if (allocator->chunks == NULL) {
+            allocator->chunks = other->chunks;
+        } else {
+            last->next = allocator->chunks->next;
+            allocator->chunks->next = other->chunks;
+        }
+    }
+    allocator->global_total_mem_usage += other->global_total_mem_usage;
+    allocator->global_allocator_usage += other->global_allocator_usage;
+    free(other);
+}
+
+/* Bytes the allocator has taken from malloc, whether or not they've been handed out yet */
+size_t allocator_usage(Allocator a)
+{
+    struct Alloc *allocator = (struct Alloc *)a;
+    return allocator->global_allocator_usage;
+}
+
 void print_memory_usage(Allocator a)
 {
     struct Alloc *allocator = (struct Alloc *)a;
     printf("%lu bytes of heap-allocated memory\n", allocator->global_total_mem_usage);
-    printf("%lu bytes of allocator overhead\n", allocator->global_allocator_usage);
+    printf("%lu bytes of allocator overhead\n",
+            allocator->global_allocator_usage - allocator->global_total_mem_usage);
 }
-
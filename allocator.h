@@ -11,7 +11,9 @@ typedef uintptr_t Allocator;
 Allocator allocator_new(void);
 void *allocator_malloc(Allocator a, size_t size);
 void allocator_freeall(Allocator a);
+void allocator_merge(Allocator a, Allocator from);
 void print_memory_usage(Allocator a);
+size_t allocator_usage(Allocator a);
 
 #define DEL_MALLOC(size) allocator_malloc(globals->allocator, size)
 
@@ -15,12 +15,14 @@ static struct TopLevelDecl *new_tld(struct Globals *globals, enum TLDType tld_ty
 }
 
 struct TopLevelDecl *new_class(struct Globals *globals, Symbol symbol,
-        Definitions *definitions, TopLevelDecls *methods)
+        Definitions *definitions, TopLevelDecls *methods, bool is_struct)
 {
     globals->class_count++;
     struct TopLevelDecl *tld = new_tld(globals, TLD_TYPE_CLASS);
     tld->cls = allocator_malloc(globals->allocator, sizeof(struct Class));
     tld->cls->name = symbol;
+    tld->cls->is_struct = is_struct;
+    tld->cls->slot_count = 0;
     tld->cls->definitions = definitions;
     tld->cls->methods = methods;
     return tld;
@@ -99,6 +101,8 @@ struct TopLevelDecl *new_tld_fundef(struct Globals *globals, Symbol symbol, Type
     fundef->is_foreign = false;
     fundef->rettype = rettype;
     fundef->num_locals = 0;
+    fundef->max_varcount = 0;
+    fundef->max_objcount = 0;
     fundef->args = args;
     fundef->stmts = stmts;
     tld->fundef = fundef;
@@ -115,6 +119,8 @@ struct TopLevelDecl *new_tld_foreign_fundef(struct Globals *globals, Symbol symb
     fundef->is_foreign = true;
     fundef->rettype = rettype;
     fundef->num_locals = 0;
+    fundef->max_varcount = 0;
+    fundef->max_objcount = 0;
     fundef->types = types; 
     fundef->ffb = ffb;
     tld->fundef = fundef;
@@ -217,6 +223,7 @@ struct Definition *new_define(struct Globals *globals, Symbol name, Type type)
     def->name = name;
     def->type = type;
     def->scope_offset = 0;
+    def->field_offsets = NULL;
     return def;
 }
 
@@ -342,6 +349,8 @@ struct Value *new_constructor(struct Globals *globals, struct Accessor *access,
     val->constructor = allocator_malloc(globals->allocator, sizeof(struct Constructor));
     val->constructor->types = types;
     val->constructor->funcall = new_funcall(globals, access, args);
+    val->constructor->in_frame = false;
+    val->constructor->frame_offset = 0;
     return val;
 }
 
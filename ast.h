@@ -63,6 +63,10 @@ enum TLDType {
 
 struct Class {
     Symbol name; // Name is same as type
+    // Structs are stored inline instead of on the heap: as one local per field, or as one slot
+    // per field of whatever object they're a field of
+    bool is_struct;
+    size_t slot_count; // Slots taken up by the fields, once any struct fields are flattened
     Definitions *definitions;
     TopLevelDecls *methods;
 };
@@ -72,6 +76,10 @@ struct FunDef {
     bool is_foreign;
     Type rettype;
     uint64_t num_locals; // I don't know if I have a purpose for this
+    // Most primitive / object locals in scope at once. Locals at or past these offsets are free
+    // for the compiler to use.
+    size_t max_varcount;
+    size_t max_objcount;
     union {
         Definitions *args;
         Types *types;
@@ -98,6 +106,9 @@ struct FunCall {
 struct Constructor {
     Types *types;
     struct FunCall *funcall;
+    // Set by escape analysis if the object can live in its function's frame instead of the heap
+    bool in_frame;
+    size_t frame_offset;
 };
 
 struct Expr {
@@ -121,9 +132,12 @@ struct LValue {
 };
 
 struct Definition {
+    // Offset of a local in its frame, or of a field in its object (see struct Class)
     size_t scope_offset;
     Symbol name;
     Type type;
+    // Set if escape analysis replaced the object in this local with a local per field
+    size_t *field_offsets;
 };
 
 struct Accessor {
@@ -243,7 +257,7 @@ struct Accessor *new_accessor(struct Globals *globals, Symbol symbol, LValues *l
 
 /* TLD constructors */
 struct TopLevelDecl *new_class(struct Globals *globals, Symbol symbol, Definitions *definitions,
-        TopLevelDecls *methods);
+        TopLevelDecls *methods, bool is_struct);
 struct TopLevelDecl *new_tld_fundef(struct Globals *globals, Symbol symbol, Type rettype,
         Definitions *args, Statements *stmts);
 struct TopLevelDecl *new_tld_foreign_fundef(struct Globals *globals, Symbol symbol, Type rettype,
@@ -0,0 +1,190 @@
+// Compiler throughput benchmark. Generates a del program of the given size and times each
+// phase of compiling it.
+//
+// Usage: ./bench_compile [-f functions] [-c classes] [-d depth] [-s strings] [-r runs]
+//                        [-o file]
+//   -f  number of functions (default 2000), each calling the one before it
+//   -c  number of classes (default 200), each function builds one of them
+//   -d  how deeply each function nests its if / while blocks (default 6)
+//   -s  number of distinct string literals, spread over the functions (default 2000)
+//   -r  number of times to compile the program, keeping the fastest run of each phase
+//   -o  write the generated program to a file instead of compiling it
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "del.h"
+
+struct Buffer {
+    size_t length;
+    size_t capacity;
+    char *text;
+};
+
+static void append(struct Buffer *buffer, const char *format, ...)
+{
+    va_list args;
+    while (1) {
+        va_start(args, format);
+        size_t room = buffer->capacity - buffer->length;
+        int written = vsnprintf(buffer->text + buffer->length, room, format, args);
+        va_end(args);
+        if ((size_t) written < room) {
+            buffer->length += written;
+            return;
+        }
+        buffer->capacity = 2 * buffer->capacity + written;
+        buffer->text = realloc(buffer->text, buffer->capacity);
+    }
+}
+
+static void indent(struct Buffer *buffer, int level)
+{
+    append(buffer, "%*s", 4 * level, "");
+}
+
+static char *generate(int functions, int classes, int depth, int strings, size_t *lines)
+{
+    struct Buffer buffer = { 0, 1 << 16, malloc(1 << 16) };
+    buffer.text[0] = '\0';
+    for (int i = 0; i < classes; i++) {
+        append(&buffer, "class Class%d {\n", i);
+        append(&buffer, "    count: int;\n");
+        append(&buffer, "    scale: float;\n");
+        append(&buffer, "    label: string;\n");
+        append(&buffer, "    next: Class%d;\n", i);
+        append(&buffer, "}\n\n");
+    }
+    int strings_per_function = functions == 0 ? 0 : (strings + functions - 1) / functions;
+    int string_id = 0;
+    for (int i = 0; i < functions; i++) {
+        int cls = i % classes;
+        append(&buffer, "function function%d(x: int): int {\n", i);
+        append(&buffer, "    let object = new Class%d(x, 1.5, \"class %d\", null);\n", cls, cls);
+        append(&buffer, "    let total = object.count + %d;\n", i);
+        for (int j = 0; j < strings_per_function && string_id < strings; j++, string_id++) {
+            append(&buffer, "    let text%d = \"string literal number %d\";\n", j, string_id);
+        }
+        for (int d = 0; d < depth; d++) {
+            indent(&buffer, d + 1);
+            if (d % 2 == 0) {
+                append(&buffer, "if total > %d {\n", d);
+            } else {
+                append(&buffer, "while total < %d {\n", 10 * d);
+            }
+            indent(&buffer, d + 2);
+            append(&buffer, "let local%d = total * %d;\n", d, d + 1);
+            indent(&buffer, d + 2);
+            append(&buffer, "total = total + local%d %% 7 + 1;\n", d);
+        }
+        for (int d = depth; d-- > 0;) {
+            indent(&buffer, d + 1);
+            append(&buffer, "}\n");
+        }
+        if (i > 0) {
+            append(&buffer, "    if x > 0 {\n");
+            append(&buffer, "        return function%d(x - 1) + total;\n", i - 1);
+            append(&buffer, "    }\n");
+        }
+        append(&buffer, "    return total;\n");
+        append(&buffer, "}\n\n");
+    }
+    append(&buffer, "function main() {\n");
+    if (functions > 0) {
+        append(&buffer, "    println(function%d(3));\n", functions - 1);
+    }
+    append(&buffer, "}\n");
+    *lines = 0;
+    for (size_t i = 0; i < buffer.length; i++) {
+        *lines += buffer.text[i] == '\n';
+    }
+    return buffer.text;
+}
+
+static const char *phase_names[DEL_COMPILE_PHASES] = {
+    "lex", "parse", "typecheck", "escape", "codegen"
+};
+
+int main(int argc, char *argv[])
+{
+    int functions = 2000;
+    int classes = 200;
+    int depth = 6;
+    int strings = 2000;
+    int runs = 3;
+    char *output = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+            continue;
+        } else if (argv[i][0] != '-' || argv[i][1] == '\0' || argv[i][2] != '\0' || i + 1 >= argc) {
+            fprintf(stderr, "Error: unexpected argument '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        int value = atoi(argv[++i]);
+        switch (argv[i - 1][1]) {
+            case 'f': functions = value; break;
+            case 'c': classes = value > 0 ? value : 1; break;
+            case 'd': depth = value; break;
+            case 's': strings = value; break;
+            case 'r': runs = value > 0 ? value : 1; break;
+            default:
+                fprintf(stderr, "Error: unknown option '%s'\n", argv[i - 1]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    size_t lines = 0;
+    char *program_text = generate(functions, classes, depth, strings, &lines);
+    if (output != NULL) {
+        FILE *fp = fopen(output, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "Error: could not open '%s'\n", output);
+            return EXIT_FAILURE;
+        }
+        fputs(program_text, fp);
+        fclose(fp);
+        free(program_text);
+        return EXIT_SUCCESS;
+    }
+
+    struct DelCompileStats best;
+    for (int run = 0; run < runs; run++) {
+        DelCompiler compiler;
+        del_compiler_init(&compiler, stderr);
+        DelProgram program = del_compile_text(compiler, program_text);
+        if (!program) {
+            del_compiler_free(compiler);
+            free(program_text);
+            return EXIT_FAILURE;
+        }
+        struct DelCompileStats stats;
+        del_compiler_stats(compiler, &stats);
+        del_compiler_free(compiler);
+        del_program_free(program);
+        for (int phase = 0; phase < DEL_COMPILE_PHASES; phase++) {
+            if (run == 0 || stats.phase_ns[phase] < best.phase_ns[phase]) {
+                best.phase_ns[phase] = stats.phase_ns[phase];
+            }
+            best.phase_bytes[phase] = stats.phase_bytes[phase];
+            best.phase_max_rss[phase] = stats.phase_max_rss[phase];
+        }
+    }
+
+    printf("%d functions, %d classes, depth %d, %d strings: %zu lines, %zu bytes\n",
+            functions, classes, depth, strings, lines, strlen(program_text));
+    printf("%-10s %12s %14s %14s\n", "phase", "time (ms)", "memory (KB)", "peak rss (KB)");
+    uint64_t total_ns = 0;
+    for (int phase = 0; phase < DEL_COMPILE_PHASES; phase++) {
+        total_ns += best.phase_ns[phase];
+        printf("%-10s %12.3f %14" PRIu64 " %14" PRIu64 "\n", phase_names[phase],
+                best.phase_ns[phase] / 1e6, best.phase_bytes[phase] / 1024,
+                best.phase_max_rss[phase] / 1024);
+    }
+    printf("%-10s %12.3f\n", "total", total_ns / 1e6);
+    printf("%.0f lines per second\n", total_ns == 0 ? 0.0 : lines / (total_ns / 1e9));
+    free(program_text);
+    return EXIT_SUCCESS;
+}
@@ -5,8 +5,10 @@ enum Code {
     PUSH_OBJ,
     DUP,
     DUP_OBJ,
-    PUSH_HEAP,
+    NEW,
+    NEW_IN_FRAME,
     PUSH_ARRAY,
+    NEW_ARRAY_FROM_CONST,
     LEN_ARRAY,
     AND,
     OR,
@@ -40,6 +42,7 @@ enum Code {
     JNE,
     JMP,
     RET,
+    RET_STRUCT,
     POP,
     POP_OBJ,
     EXIT,
@@ -54,19 +57,35 @@ enum Code {
     GET_HEAP_OBJ,
     SET_HEAP,
     SET_HEAP_OBJ,
+    INIT_FIELD,
+    INIT_FIELD_OBJ,
     GET_ARRAY,
     GET_ARRAY_OBJ,
     SET_ARRAY,
     SET_ARRAY_OBJ,
+    GET_ARRAY_BYTE,
+    SET_ARRAY_BYTE,
+    GET_ARRAY_BOOL,
+    SET_ARRAY_BOOL,
+    GET_ARRAY_INT32,
+    SET_ARRAY_INT32,
+    GET_ARRAY_FLOAT32,
+    SET_ARRAY_FLOAT32,
+    GET_ARRAY_STRUCT,
+    SET_ARRAY_STRUCT,
+    GET_ARRAY_SOA,
+    SET_ARRAY_SOA,
     CAST_INT,
     CAST_FLOAT,
     CAST_BYTE_ARRAY,
     CALL,
+    COMPILE,
     SWAP,
     SWAP_OBJ,
     PUSH_SCOPE,
     POP_SCOPE,
     PRINT,
+    PRINT_STRUCT,
     READ
 };
 
@@ -1,22 +1,81 @@
 #include "common.h"
 #include "allocator.h"
-#include "linkedlist.h"
 
 
-static void add_sym_helper(struct Globals *globals, char *sym, size_t size)
+#define SYMBOL_BUCKETS_INIT 256
+
+// FNV-1a
+uint64_t hash_string(const char *str, size_t len)
+{
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) str[i];
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+static void insert_bucket(struct SymbolTable *table, Symbol symbol)
+{
+    size_t mask = table->bucket_capacity - 1;
+    size_t i = hash_string(table->names[symbol], table->lengths[symbol]) & mask;
+    while (table->buckets[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    table->buckets[i] = symbol + 1;
+}
+
+static void grow_buckets(struct SymbolTable *table)
 {
-    char *symbol = allocator_malloc(globals->allocator, size);
-    strcpy(symbol, sym);
-    if (globals->symbol_table == NULL) {
-        globals->symbol_table = linkedlist_new(globals->allocator);
+    free(table->buckets);
+    table->bucket_capacity *= 2;
+    table->buckets = calloc(table->bucket_capacity, sizeof(*(table->buckets)));
+    for (Symbol symbol = 0; symbol < table->length; symbol++) {
+        insert_bucket(table, symbol);
     }
-    linkedlist_append(globals->symbol_table, symbol);
+}
+
+/* Stores a copy of the string as the next symbol */
+static Symbol new_symbol(struct Globals *globals, const char *str, size_t len)
+{
+    struct SymbolTable *table = globals->symbol_table;
+    if (table->length == table->capacity) {
+        table->capacity *= 2;
+        table->names = realloc(table->names, table->capacity * sizeof(*(table->names)));
+        table->lengths = realloc(table->lengths, table->capacity * sizeof(*(table->lengths)));
+    }
+    char *name = allocator_malloc(globals->allocator, len + 1);
+    memcpy(name, str, len);
+    name[len] = '\0';
+    Symbol symbol = table->length++;
+    table->names[symbol] = name;
+    table->lengths[symbol] = len;
+    if (2 * table->length > table->bucket_capacity) {
+        grow_buckets(table);
+    } else {
+        insert_bucket(table, symbol);
+    }
+    return symbol;
+}
+
+static void add_sym_helper(struct Globals *globals, char *sym, size_t size)
+{
+    new_symbol(globals, sym, size - 1);
 }
 
 #define add_sym(sym) add_sym_helper(globals, sym, sizeof(sym))
 
 void init_symbol_table(struct Globals *globals)
 {
+    struct SymbolTable *table = malloc(sizeof(*table));
+    table->length = 0;
+    table->capacity = SYMBOL_BUCKETS_INIT / 2;
+    table->names = malloc(table->capacity * sizeof(*(table->names)));
+    table->lengths = malloc(table->capacity * sizeof(*(table->lengths)));
+    table->bucket_capacity = SYMBOL_BUCKETS_INIT;
+    table->buckets = calloc(table->bucket_capacity, sizeof(*(table->buckets)));
+    globals->symbol_table = table;
+
     /* Add types to symbol table
      * Important Note: the order of these must be the same as the order in which they are
      * declared in the header if we want their symbol to correspond to the same number
@@ -44,51 +103,59 @@ void init_symbol_table(struct Globals *globals)
 
     // Reserved variable names
     add_sym("self");
+
+    // Array element types
+    add_sym("int32");
+    add_sym("float32");
 }
 #undef add_symbol
 
+void free_symbol_table(struct Globals *globals)
+{
+    struct SymbolTable *table = globals->symbol_table;
+    free(table->names);
+    free(table->lengths);
+    free(table->buckets);
+    free(table);
+    globals->symbol_table = NULL;
+}
+
+/* Returns the symbol for the first str_len characters of str, adding it if it's new. str
+ * doesn't need to be null terminated. */
 Symbol add_symbol(struct Globals *globals, char *str, int str_len)
 {
-    /* Adds symbols to symbol table */
-    struct LinkedListNode *symbol_table = globals->symbol_table->head;
-    uint64_t cnt = 0;
-    char *symbol;
+    struct SymbolTable *table = globals->symbol_table;
+    size_t len = str_len;
+    size_t mask = table->bucket_capacity - 1;
+    size_t i = hash_string(str, len) & mask;
+    Symbol symbol;
     while (1) {
-        if (strcmp(symbol_table->value, str) == 0) {
-            goto addsymbol;
+        if (table->buckets[i] == 0) {
+            symbol = new_symbol(globals, str, len);
+            break;
         }
-        cnt++;
-        if (symbol_table->next == NULL) {
+        symbol = table->buckets[i] - 1;
+        if (table->lengths[symbol] == len && memcmp(table->names[symbol], str, len) == 0) {
             break;
-        } else {
-            symbol_table = symbol_table->next;
         }
+        i = (i + 1) & mask;
     }
-    symbol = allocator_malloc(globals->allocator, (str_len + 1) * sizeof(char));
-    strcpy(symbol, str);
-    // symbol_table->next = new_list(symbol);
-    linkedlist_append(globals->symbol_table, symbol);
-addsymbol:
-    if (strcmp(str, "main") == 0) {
-        globals->entrypoint = cnt;
+    if (len == 4 && memcmp(str, "main", 4) == 0) {
+        globals->entrypoint = symbol;
     }
-    return cnt;
+    return symbol;
 }
 
-
 char *lookup_symbol(struct Globals *globals, uint64_t symbol)
 {
     if (symbol >= TYPE_ARRAY) {
         return "Array";
     }
-    uint64_t cnt = 0;
-    linkedlist_foreach(lnode, globals->symbol_table->head) {
-        if (cnt == symbol) {
-            return lnode->value;
-        }
-        cnt++;
+    symbol &= ~TYPE_STRUCT;
+    if (symbol >= globals->symbol_table->length) {
+        return NULL;
     }
-    return NULL;
+    return globals->symbol_table->names[symbol];
 }
 
 bool is_builtin(uint64_t symbol)
@@ -21,6 +21,42 @@
 /* Symbol is used to represent any variable, function, or type name */
 typedef uint64_t Symbol;
 
+/* Symbols are numbered in the order they're first seen. names maps a symbol back to its string,
+ * and an open addressed hash table maps a string to its symbol. */
+struct SymbolTable {
+    size_t length;
+    size_t capacity;
+    char **names;
+    size_t *lengths;
+    size_t bucket_capacity; // A power of two, and at least twice length
+    Symbol *buckets;        // Symbol + 1, or 0 for an empty bucket
+};
+
+/* Phases of compilation, in the order they run */
+enum CompilePhase {
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_TYPECHECK,
+    PHASE_ESCAPE,
+    PHASE_CODEGEN,
+    COMPILE_PHASES
+};
+
+/* How much of a program is compiled before it runs. Lazily compiled functions are compiled the
+ * first time they're called, see compile_lazily. */
+enum CompileMode {
+    COMPILE_EAGER,
+    COMPILE_LAZY,
+    COMPILE_LAZY_TYPECHECK // Function bodies are typechecked the first time they're called too
+};
+
+/* Filled in by parse_and_compile as each phase finishes */
+struct CompileStats {
+    uint64_t ns[COMPILE_PHASES];
+    uint64_t bytes[COMPILE_PHASES];         // Held by the compiler at the end of the phase
+    uint64_t max_rss_bytes[COMPILE_PHASES]; // Process peak resident set size, as of the same
+};
+
 struct Globals {
     // Stores compile-time error message
     char error[ERROR_MESSAGE_MAX];
@@ -31,9 +67,13 @@ struct Globals {
     struct FileContext *file;
     struct Lexer *lexer;
     struct LinkedList *foreign_function_table;
-    struct LinkedListNode *parser;
+    // Foreign functions by symbol, in an open addressed table that's at most half full
+    size_t foreign_function_bucket_capacity;
+    struct ForeignFunction **foreign_function_buckets;
+    // The next token to parse, or NULL once they've all been parsed
+    struct Token *parser;
     // Used to store strings for each symbol
-    struct LinkedList *symbol_table; 
+    struct SymbolTable *symbol_table;
     // Keep track of number of functions, classes, and strings parsed
     uint64_t string_count;
     uint64_t class_count;
@@ -44,19 +84,38 @@ struct Globals {
     struct LinkedList *ast;
     // Stores compiler context
     struct CompilerContext *cc;
+    struct CompileStats compile_stats;
+    enum CompileMode compile_mode;
 };
 
 struct Program {
     struct Vector *instructions;
     size_t string_count;
-    char **string_pool;
+    struct PooledString *string_pool;
+    size_t class_count;
+    struct ClassLayout *layouts;
+    size_t const_array_count;
+    struct ConstArray *const_arrays; // Read only: the vm copies these, never writes to them
+    size_t function_count;
+    struct FunctionLocation *functions;
+    size_t foreign_function_count;
+    struct ProgramForeignFunction *foreign_functions;
+    size_t foreign_call_count;
+    struct ForeignCall *foreign_calls;
+    // A program loaded from a .delc file points into a private mapping of the file for its
+    // instructions, strings and constants, rather than owning them
+    void *mapping;
+    size_t mapping_length;
+    // The compiler a lazily compiled program compiles the rest of its functions with as they're
+    // called, or NULL if the program has been compiled in full
+    struct Globals *compiler;
 };
 
 /* Array type modifies other types */
-#define TYPE_ARRAY (UINT64_C(1) << 15)
+#define TYPE_ARRAY (UINT64_C(1) << 31)
 
 /* Primitive that objects can have */
-typedef uint16_t Type;
+typedef uint32_t Type;
 #define TYPE_UNDEFINED UINT64_C(0)
 #define TYPE_NULL UINT64_C(1)
 #define TYPE_BOOL UINT64_C(2)
@@ -84,14 +143,39 @@ typedef uint16_t Type;
 #define BUILTIN_FIRST BUILTIN_PRINT
 #define BUILTIN_LAST BUILTIN_SELF
 
+/* Narrow types that are only allowed as array elements. They are widened when read */
+#define TYPE_INT32 UINT64_C(15)
+#define TYPE_FLOAT32 UINT64_C(16)
+
+/* Any symbol above this is user defined */
+#define SYMBOL_RESERVED_LAST TYPE_FLOAT32
+
 static inline bool is_array(Type type)
 {
     return (TYPE_ARRAY & type) > 0;
 }
 
+/* Struct types are the struct's symbol with this bit set. Structs are values rather than
+ * objects: each field is stored inline wherever the struct is */
+#define TYPE_STRUCT (UINT64_C(1) << 30)
+
+/* An array of structs stores its elements one after another unless it's declared as
+ * Array<soa T>, which stores each field in a column of its own (a structure of arrays) */
+#define TYPE_SOA (UINT64_C(1) << 29)
+
+static inline bool is_struct(Type type)
+{
+    return !is_array(type) && (TYPE_STRUCT & type) > 0;
+}
+
+static inline bool is_soa(Type type)
+{
+    return is_array(type) && (TYPE_SOA & type) > 0;
+}
+
 static inline bool is_object(Type type)
 {
-    return type > BUILTIN_LAST || is_array(type);
+    return (type > SYMBOL_RESERVED_LAST && !is_struct(type)) || is_array(type);
 }
 
 static inline bool is_object_or_null(Type type)
@@ -99,9 +183,25 @@ static inline bool is_object_or_null(Type type)
     return is_object(type) || type == TYPE_NULL;
 }
 
+static inline bool is_array_only_type(Type type)
+{
+    return type == TYPE_INT32 || type == TYPE_FLOAT32;
+}
+
+/* The type of a value read out of an array element of the given type */
+static inline Type widen_type(Type type)
+{
+    if (type == TYPE_INT32) {
+        return TYPE_INT;
+    } else if (type == TYPE_FLOAT32) {
+        return TYPE_FLOAT;
+    }
+    return type;
+}
+
 static inline Type type_of_array(Type type)
 {
-    return ~TYPE_ARRAY & type;
+    return ~(TYPE_ARRAY | TYPE_SOA) & type;
 }
 
 static inline Type array_of(Type type)
@@ -111,6 +211,8 @@ static inline Type array_of(Type type)
 
 /* List functions */
 void init_symbol_table(struct Globals *globals);
+void free_symbol_table(struct Globals *globals);
+uint64_t hash_string(const char *str, size_t len);
 // struct List *new_list(void *value);
 // struct List *append(struct List *list, void *value);
 // struct List *seek_end(struct List *list);
@@ -3,13 +3,17 @@
 #include "ast.h"
 #include "ffi.h"
 #include "typecheck.h"
+#include "escape.h"
 #include "printers.h"
 #include "compiler.h"
 #include "vector.h"
+#include "heap_ptr.h"
+#include "parallel.h"
 
 static void compile_value(struct Globals *globals, struct Value *val);
 static void compile_expr(struct Globals *globals, struct Expr *expr);
 static void compile_array_literal(struct Globals *globals, Type type, Values *vals);
+static void compile_xet_index(struct Globals *globals, struct GetProperty *get, bool is_increment);
 static void compile_statement(struct Globals *globals, struct Statement *stmt);
 static void compile_statements(struct Globals *globals, Statements *stmts);
 
@@ -82,15 +86,6 @@ static inline void load_pointer(struct Globals *globals, void *pointer)
     vector_append(&(globals->cc->instructions), value);
 }
 
-static void compile_heap(struct Globals *globals, size_t metadata, size_t count)
-{
-    load_opcode(globals, PUSH_HEAP);
-    // Load count
-    load_offset(globals, count);
-    // Load metadata
-    load_offset(globals, metadata);
-}
-
 static inline void compile_int(struct Globals *globals, int64_t integer)
 {
     push(globals);
@@ -151,15 +146,45 @@ static void compile_xet_local(struct Globals *globals, struct Definition *def, e
     load_offset(globals, def->scope_offset);
 }
 
+/* Make room for a local in the current frame. The offset is part of the instruction so that a
+ * definition inside of a loop doesn't grow the frame on every iteration */
+static void compile_define(struct Globals *globals, struct Definition *def)
+{
+    // A struct is a local per field, defining the last one makes room for all of them
+    size_t slots = type_slots(globals->cc->class_table, def->type);
+    load_opcode(globals, is_object(def->type) ? DEFINE_OBJ: DEFINE);
+    load_offset(globals, def->scope_offset + slots - 1);
+}
+
+/* Fields of a struct are pushed in order, and so have to be popped in reverse */
+static void compile_xet_struct_local(struct Globals *globals, struct Definition *def,
+        enum Code op)
+{
+    size_t slots = type_slots(globals->cc->class_table, def->type);
+    for (size_t i = 0; i < slots; i++) {
+        size_t field = op == GET_LOCAL ? i : slots - 1 - i;
+        load_opcode(globals, op);
+        load_offset(globals, def->scope_offset + field);
+    }
+}
+
 static void compile_get_local(struct Globals *globals, struct Definition *def)
 {
     enum Code op = is_object(def->type) ? GET_LOCAL_OBJ : GET_LOCAL;
+    if (is_struct(def->type)) {
+        compile_xet_struct_local(globals, def, op);
+        return;
+    }
     compile_xet_local(globals, def, op);
 }
 
 static void compile_set_local(struct Globals *globals, struct Definition *def)
 {
     enum Code op = is_object(def->type) ? SET_LOCAL_OBJ : SET_LOCAL;
+    if (is_struct(def->type)) {
+        compile_xet_struct_local(globals, def, op);
+        return;
+    }
     compile_xet_local(globals, def, op);
 }
 
@@ -186,28 +211,111 @@ static void compile_set_local(struct Globals *globals, struct Definition *def)
 //     compile_heap(globals, offset, i / 8 + (offset == 0 ? 0 : 1));
 // }
 
-static size_t add_to_pool(struct Globals *globals, char *string)
+/* Code that's compiled on its own, to be appended to other code later, doesn't know where it's
+ * going to end up, or what'll be in the string pool and constant section by then. So it notes
+ * down every operand that depends on those, to be fixed up once it's been appended. */
+static void relocate(struct Globals *globals, enum RelocationType type, size_t location)
+{
+    struct CompilerContext *cc = globals->cc;
+    if (!cc->is_chunk) {
+        return;
+    } else if (cc->relocation_count == cc->relocation_capacity) {
+        cc->relocation_capacity = cc->relocation_capacity == 0 ? 64 : 2 * cc->relocation_capacity;
+        cc->relocations = realloc(cc->relocations,
+                cc->relocation_capacity * sizeof(*(cc->relocations)));
+    }
+    struct Relocation *relocation = &(cc->relocations[cc->relocation_count++]);
+    relocation->type = type;
+    relocation->location = location;
+}
+
+/* Sets the operand at location to the address of an instruction */
+static inline void set_address(struct Globals *globals, size_t location, size_t address)
 {
-    size_t len = 0;
-    for (len = 0; string[len] != '\0'; len++) ;
-    len++; // null byte
-    char *str = calloc(len, sizeof(char));
-    memcpy(str, string, len);
-    globals->cc->string_pool[globals->cc->string_count] = str;
-    size_t old_count = globals->cc->string_count++;
-    return old_count;
+    globals->cc->instructions->values[location].offset = address;
+    relocate(globals, RELOCATE_ADDRESS, location);
 }
 
-static void compile_string(struct Globals *globals, char *string)
+static inline void load_address(struct Globals *globals, size_t address)
+{
+    relocate(globals, RELOCATE_ADDRESS, globals->cc->instructions->length);
+    load_offset(globals, address);
+}
+
+static void grow_string_buckets(struct CompilerContext *cc)
 {
-    for (size_t i = 0; i < globals->cc->string_count; i++) {
-        if (strcmp(string, globals->cc->string_pool[i]) == 0) {
-            compile_offset(globals, i);
-            return;
+    free(cc->string_buckets);
+    do {
+        cc->string_bucket_capacity *= 2;
+    } while (cc->string_bucket_capacity < 2 * (cc->string_count + 1));
+    cc->string_buckets = calloc(cc->string_bucket_capacity, sizeof(*(cc->string_buckets)));
+    size_t mask = cc->string_bucket_capacity - 1;
+    for (size_t index = 0; index < cc->string_count; index++) {
+        size_t i = cc->string_pool[index].hash & mask;
+        while (cc->string_buckets[i] != 0) {
+            i = (i + 1) & mask;
         }
+        cc->string_buckets[i] = index + 1;
     }
-    size_t index = add_to_pool(globals, string);
-    compile_offset(globals, index);
+}
+
+static size_t add_to_pool(struct CompilerContext *cc, char *string, size_t len, uint64_t hash,
+        bool is_owned)
+{
+    if (cc->string_count == cc->string_capacity) {
+        cc->string_capacity = cc->string_capacity == 0 ? 8 : 2 * cc->string_capacity;
+        cc->string_pool = realloc(cc->string_pool,
+                cc->string_capacity * sizeof(*(cc->string_pool)));
+    }
+    char *str = string;
+    if (!is_owned) {
+        str = calloc(len + 1, sizeof(char));
+        memcpy(str, string, len + 1);
+    }
+    struct PooledString *pooled = &(cc->string_pool[cc->string_count]);
+    pooled->string = str;
+    pooled->length = len;
+    pooled->hash = hash;
+    return cc->string_count++;
+}
+
+/* The pool holds at most one copy of each string. There can't be more strings in the pool than
+ * there are string literals, so the main pool's hash table is made big enough up front to never
+ * fill up. Pools for code compiled on its own start small and grow.
+ *
+ * Strings that get added are copied, unless the pool is given ownership of them. */
+static size_t intern_string(struct CompilerContext *cc, char *string, size_t len, uint64_t hash,
+        bool is_owned)
+{
+    if (2 * (cc->string_count + 1) > cc->string_bucket_capacity) {
+        grow_string_buckets(cc);
+    }
+    size_t mask = cc->string_bucket_capacity - 1;
+    size_t i = hash & mask;
+    while (cc->string_buckets[i] != 0) {
+        struct PooledString *pooled = &(cc->string_pool[cc->string_buckets[i] - 1]);
+        if (pooled->hash == hash && pooled->length == len
+                && memcmp(pooled->string, string, len) == 0) {
+            return cc->string_buckets[i] - 1;
+        }
+        i = (i + 1) & mask;
+    }
+    size_t index = add_to_pool(cc, string, len, hash, is_owned);
+    cc->string_buckets[i] = index + 1;
+    return index;
+}
+
+static size_t string_index(struct Globals *globals, char *string)
+{
+    size_t len = strlen(string);
+    return intern_string(globals->cc, string, len, hash_string(string, len), false);
+}
+
+static void compile_string(struct Globals *globals, char *string)
+{
+    push(globals);
+    relocate(globals, RELOCATE_STRING, globals->cc->instructions->length);
+    load_offset(globals, string_index(globals, string));
 }
 
 static void compile_binary_op(struct Globals *globals, struct Value *val1, struct Value *val2,
@@ -227,10 +335,30 @@ static void compile_funargs(struct Globals *globals, Definitions *defs)
     linkedlist_foreach_reverse(lnode, defs->tail) {
         struct Definition *def = lnode->value;
         compile_set_local(globals, def);
-        load_opcode(globals, is_object(def->type) ? DEFINE_OBJ: DEFINE);
+        compile_define(globals, def);
     }
 }
 
+static struct FunctionLocation *new_function_location(struct CompilerContext *cc)
+{
+    if (cc->function_count == cc->function_capacity) {
+        cc->function_capacity = cc->function_capacity == 0 ? 8 : 2 * cc->function_capacity;
+        cc->functions = realloc(cc->functions, cc->function_capacity * sizeof(*(cc->functions)));
+    }
+    return &(cc->functions[cc->function_count++]);
+}
+
+static void add_function_location(struct Globals *globals, struct FunDef *fundef)
+{
+    struct CompilerContext *cc = globals->cc;
+    struct FunctionLocation *function = new_function_location(cc);
+    char *name = lookup_symbol(globals, fundef->name);
+    size_t len = strlen(name) + 1;
+    function->location = cc->instructions->length;
+    function->name = malloc(len);
+    memcpy(function->name, name, len);
+}
+
 /* Pop arguments from stack, use to define function args
  * - Enter new scope
  * - Execute statements
@@ -245,46 +373,69 @@ static void compile_fundef(struct Globals *globals, struct FunDef *fundef)
     } else {
         add_ft_node(globals, globals->cc->funcall_table, fundef->name,
                 globals->cc->instructions->length);
+        add_function_location(globals, fundef);
         compile_funargs(globals, fundef->args);
         compile_statements(globals, fundef->stmts);
     }
 }
 
-// v | v | t
-// Every i % 4 == 0 element stores types of the next 4 values
-// types | value | value | value | value | types | value ...
-// (But reverse order, since the heap pops them off in the opposite order)
-// TODO: Make this just allocate memory. Handle setting initial values in 
-// either user defined constructor, or create a compile time constructor
-// that doesn't require a separate opcode
-// TODO: This evaluates arguments right to left. If we just make constructors a regular 
-// function call, that should make it rtl
+// Arguments are pushed in reverse so that they come off of the stacks in field order
+static void compile_constructor_args(struct Globals *globals, struct Constructor *constructor)
+{
+    struct Value *value = NULL;
+    linkedlist_vforeach_reverse(value, constructor->funcall->args) {
+        compile_value(globals, value);
+    }
+}
+
+// NEW allocates the whole object up front, with every field zeroed (null), so each argument
+// can be stored straight into its field as soon as it's evaluated. The object sits on the
+// object stack the whole time, which keeps it alive if evaluating an argument allocates.
+// TODO: Handle setting initial values in a user defined constructor
+// TODO: This evaluates arguments right to left, same as function calls
 static void compile_constructor(struct Globals *globals, struct Constructor *constructor)
 {
-    uint16_t types[4] = {0};
-    size_t rem = constructor->funcall->args->length % 4;
-    size_t count = 0;
-    size_t i = 0;
-    // Push after rem, then push every 4th from the head
-    linkedlist_foreach_reverse(lnode, constructor->funcall->args->tail) {
-        struct Value *value = lnode->value;
+    struct Class *cls = lookup_class(globals->cc->class_table,
+            constructor->funcall->access->definition->name);
+    struct Value *value = NULL;
+    if (cls->is_struct) {
+        // Nothing to allocate, a struct is just its fields
+        linkedlist_vforeach(value, constructor->funcall->args) {
+            compile_value(globals, value);
+        }
+        return;
+    }
+    // The class id is just the class's slot in the class table
+    size_t id = cls - globals->cc->class_table->table;
+    if (constructor->in_frame) {
+        load_opcode(globals, NEW_IN_FRAME);
+        load_offset(globals, id);
+        load_offset(globals, constructor->frame_offset);
+    } else {
+        load_opcode(globals, NEW);
+        load_offset(globals, id);
+    }
+    if (constructor->funcall->args == NULL) {
+        return;
+    }
+    struct LinkedListNode *field = cls->definitions->tail;
+    linkedlist_vforeach_reverse(value, constructor->funcall->args) {
         compile_value(globals, value);
-        size_t index = count < rem ? rem - i - 1: 3 - i;
-        types[index] = (uint16_t)value->type;
-        if (index == 0) {
-            DelValue dvalue;
-            memcpy(dvalue.types, types, 8);
-            push(globals);
-            vector_append(&(globals->cc->instructions), dvalue);
-            memset(types, 0, 8);
-            i = 0;
-            count++;
-        } else {
-            i++;
+        struct Definition *def = field->value;
+        size_t slots = type_slots(globals->cc->class_table, def->type);
+        for (size_t i = slots; i > 0; i--) {
+            load_opcode(globals, is_object(def->type) ? INIT_FIELD_OBJ : INIT_FIELD);
+            load_offset(globals, OBJECT_HEADER_SLOTS + def->scope_offset + i - 1);
         }
-        count++;
+        field = field->prev;
     }
-    compile_heap(globals, 0, count);
+}
+
+/* Slot of a property in its object, not counting the header */
+static size_t property_slot(struct Globals *globals, Type type, Symbol property)
+{
+    struct Class *cls = lookup_class(globals->cc->class_table, type);
+    return lookup_property(cls, property)->scope_offset;
 }
 
 // Being a little too cheeky with the name of this?
@@ -296,19 +447,146 @@ static uint64_t compile_xet_property(struct Globals *globals, struct GetProperty
         assert(false); // fix this later
         load_opcode(globals, DUP);
     }
-    struct Class *cls = lookup_class(globals->cc->class_table, get->accessor->type);
-    uint64_t index = lookup_property_index(cls, get->property);
+    uint64_t index = property_slot(globals, get->accessor->type, get->property);
     load_opcode(globals, code);
-    load_offset(globals, 1 + 5 * index / 4);
+    load_offset(globals, OBJECT_HEADER_SLOTS + index);
     return index;
 }
 
+/* A struct field of an object takes up a slot per field of the struct. The object is only
+ * evaluated once, and duplicated for each slot but the last. */
+static void compile_xet_struct_property(struct Globals *globals, Type type,
+        struct GetProperty *get, enum Code code)
+{
+    size_t slots = type_slots(globals->cc->class_table, type);
+    size_t index = OBJECT_HEADER_SLOTS
+        + property_slot(globals, get->accessor->type, get->property);
+    compile_value(globals, get->accessor);
+    for (size_t i = 0; i < slots; i++) {
+        size_t field = code == GET_HEAP ? i : slots - 1 - i;
+        if (i != slots - 1) {
+            load_opcode(globals, DUP_OBJ);
+        }
+        load_opcode(globals, code);
+        load_offset(globals, index + field);
+    }
+}
+
+/* Gets or sets count fields of an element of an array of structs, starting from field first.
+ * Expects the array and the index to already be on the stack. */
+static void compile_xet_array_struct(struct Globals *globals, Type array_type, size_t first,
+        size_t count, bool is_get)
+{
+    enum Code code = is_get
+        ? (is_soa(array_type) ? GET_ARRAY_SOA : GET_ARRAY_STRUCT)
+        : (is_soa(array_type) ? SET_ARRAY_SOA : SET_ARRAY_STRUCT);
+    load_opcode(globals, code);
+    load_offset(globals, type_slots(globals->cc->class_table, type_of_array(array_type)));
+    load_offset(globals, first);
+    load_offset(globals, count);
+}
+
+/* Fields of a struct are stored in whatever the struct is stored in: a local per field, a slot
+ * per field of an object, or a slot per field of an array element. Returns false if the struct
+ * is a temporary value instead. */
+static bool compile_xet_struct_field(struct Globals *globals, struct GetProperty *get,
+        bool is_get)
+{
+    struct Value *accessor = get->accessor;
+    size_t index = property_slot(globals, accessor->type, get->property);
+    if (accessor->vtype == VTYPE_GET_LOCAL) {
+        struct Class *cls = lookup_class(globals->cc->class_table, accessor->type);
+        struct Definition field = *lookup_property(cls, get->property);
+        field.scope_offset = accessor->get_local->scope_offset + index;
+        if (is_get) {
+            compile_get_local(globals, &field);
+        } else {
+            compile_set_local(globals, &field);
+        }
+        return true;
+    } else if (accessor->vtype == VTYPE_GET_PROPERTY) {
+        struct GetProperty *outer = accessor->get_property;
+        compile_value(globals, outer->accessor);
+        load_opcode(globals, is_get ? GET_HEAP : SET_HEAP);
+        load_offset(globals, OBJECT_HEADER_SLOTS + index
+                + property_slot(globals, outer->accessor->type, outer->property));
+        return true;
+    } else if (accessor->vtype == VTYPE_INDEX) {
+        struct GetProperty *element = accessor->get_property;
+        compile_xet_index(globals, element, false);
+        compile_xet_array_struct(globals, element->accessor->type, index, 1, is_get);
+        return true;
+    }
+    return false;
+}
+
+/* Pushes every field of a temporary struct, then drops all but the one we want */
+static void compile_get_temporary_struct_field(struct Globals *globals, struct GetProperty *get)
+{
+    size_t slots = type_slots(globals->cc->class_table, get->accessor->type);
+    size_t index = property_slot(globals, get->accessor->type, get->property);
+    compile_value(globals, get->accessor);
+    for (size_t i = index + 1; i < slots; i++) {
+        load_opcode(globals, POP);
+    }
+    for (size_t i = 0; i < index; i++) {
+        load_opcode(globals, SWAP);
+        load_opcode(globals, POP);
+    }
+}
+
+/* Fills in the local that escape analysis replaced the property with. Returns false if the
+ * property is really on the heap */
+static bool scalar_replacement(struct Globals *globals, struct GetProperty *get,
+        struct Definition *field)
+{
+    if (get->accessor->vtype != VTYPE_GET_LOCAL || get->accessor->get_local->field_offsets == NULL) {
+        return false;
+    }
+    struct Definition *def = get->accessor->get_local;
+    struct Class *cls = lookup_class(globals->cc->class_table, def->type);
+    *field = *lookup_property(cls, get->property);
+    field->scope_offset = def->field_offsets[lookup_property_index(cls, get->property)];
+    return true;
+}
+
+/* Stores the arguments of a scalar replaced constructor in the locals for each field. All of
+ * the arguments are evaluated before any of them are stored, same as for a real object. */
+static void compile_scalar_constructor(struct Globals *globals, struct Definition *def,
+        struct Constructor *constructor)
+{
+    compile_constructor_args(globals, constructor);
+    struct Class *cls = lookup_class(globals->cc->class_table, def->type);
+    size_t i = 0;
+    linkedlist_foreach(lnode, cls->definitions->head) {
+        struct Definition field = *(struct Definition *)lnode->value;
+        field.scope_offset = def->field_offsets[i++];
+        compile_set_local(globals, &field);
+        compile_define(globals, &field);
+    }
+}
+
 static void compile_get_property(struct Globals *globals, Type type, struct GetProperty *get,
         bool is_increment)
 {
-    if (is_array(get->accessor->type) && get->property == BUILTIN_LENGTH) {
+    struct Definition field;
+    if (scalar_replacement(globals, get, &field)) {
+        compile_get_local(globals, &field);
+    } else if (is_array(get->accessor->type) && get->property == BUILTIN_LENGTH) {
         compile_value(globals, get->accessor);
         load_opcode(globals, LEN_ARRAY);
+        Type elem_type = type_of_array(get->accessor->type);
+        if (is_struct(elem_type)) {
+            // Each element of an array of structs takes up a slot per field
+            compile_int(globals, type_slots(globals->cc->class_table, elem_type));
+            load_opcode(globals, DIV);
+        }
+    } else if (is_struct(get->accessor->type)) {
+        if (!compile_xet_struct_field(globals, get, true)) {
+            compile_get_temporary_struct_field(globals, get);
+        }
+    } else if (is_struct(type)) {
+        compile_xet_struct_property(globals, type, get, GET_HEAP);
     } else {
         enum Code code = is_object(type) ? GET_HEAP_OBJ : GET_HEAP;
         compile_xet_property(globals, get, code, is_increment);
@@ -332,11 +610,39 @@ static void compile_xet_index(struct Globals *globals, struct GetProperty *get,
     }
 }
 
-static void compile_get_index(struct Globals *globals, Type type, struct GetProperty *get,
-        bool is_increment)
+// Arrays are stored differently depending on the width of their elements
+static enum Code get_array_opcode(Type type)
+{
+    switch (type) {
+        case TYPE_BOOL:    return GET_ARRAY_BOOL;
+        case TYPE_BYTE:    return GET_ARRAY_BYTE;
+        case TYPE_INT32:   return GET_ARRAY_INT32;
+        case TYPE_FLOAT32: return GET_ARRAY_FLOAT32;
+        default:           return is_object(type) ? GET_ARRAY_OBJ : GET_ARRAY;
+    }
+}
+
+static enum Code set_array_opcode(Type type)
+{
+    switch (type) {
+        case TYPE_BOOL:    return SET_ARRAY_BOOL;
+        case TYPE_BYTE:    return SET_ARRAY_BYTE;
+        case TYPE_INT32:   return SET_ARRAY_INT32;
+        case TYPE_FLOAT32: return SET_ARRAY_FLOAT32;
+        default:           return is_object_or_null(type) ? SET_ARRAY_OBJ : SET_ARRAY;
+    }
+}
+
+static void compile_get_index(struct Globals *globals, struct GetProperty *get, bool is_increment)
 {
     compile_xet_index(globals, get, is_increment);
-    load_opcode(globals, is_object(type) ? GET_ARRAY_OBJ : GET_ARRAY);
+    Type type = type_of_array(get->accessor->type);
+    if (is_struct(type)) {
+        size_t slots = type_slots(globals->cc->class_table, type);
+        compile_xet_array_struct(globals, get->accessor->type, 0, slots, true);
+        return;
+    }
+    load_opcode(globals, get_array_opcode(type));
 }
 
 static bool is_int(Type type)
@@ -366,6 +672,12 @@ static void compile_print(struct Globals *globals, Values *args)
     linkedlist_foreach(lnode, args->head) {
         struct Value *value = lnode->value;
         compile_value(globals, value);
+        if (is_struct(value->type)) {
+            struct Class *cls = lookup_class(globals->cc->class_table, value->type);
+            load_opcode(globals, PRINT_STRUCT);
+            load_offset(globals, cls - globals->cc->class_table->table);
+            continue;
+        }
         compile_type(globals, value->type);
         load_opcode(globals, PRINT);
     }
@@ -383,10 +695,18 @@ static void compile_builtin_funcall(struct Globals *globals, struct FunCall *fun
     }
 }
 
+/* Arrays of structs are allocated as arrays of 64 bit primitives, with a slot per field of each
+ * element. How the slots are laid out is up to the instructions that get and set elements. */
 static void compile_array(struct Globals *globals, Type type, struct Constructor *constructor)
 {
+    Type elem_type = type_of_array(type);
     compile_value(globals, constructor->funcall->args->head->value);
-    compile_type(globals, type_of_array(type));
+    if (is_struct(elem_type)) {
+        compile_int(globals, type_slots(globals->cc->class_table, elem_type));
+        load_opcode(globals, MUL);
+        elem_type = TYPE_INT;
+    }
+    compile_type(globals, elem_type);
     load_opcode(globals, PUSH_ARRAY);
 }
 
@@ -408,6 +728,18 @@ static void compile_funcall_args(struct Globals *globals, struct LinkedList *arg
     }
 }
 
+static void add_foreign_call(struct CompilerContext *cc, size_t location, size_t function)
+{
+    if (cc->foreign_call_count == cc->foreign_call_capacity) {
+        cc->foreign_call_capacity = cc->foreign_call_capacity == 0 ? 8 : 2 * cc->foreign_call_capacity;
+        cc->foreign_calls = realloc(cc->foreign_calls,
+                cc->foreign_call_capacity * sizeof(*(cc->foreign_calls)));
+    }
+    struct ForeignCall *call = &(cc->foreign_calls[cc->foreign_call_count++]);
+    call->location = location;
+    call->function = function;
+}
+
 static void compile_foreign_funcall(struct Globals *globals, struct FunCall *funcall, bool is_stmt)
 {
     Symbol funname = funcall->access->definition->name;
@@ -423,6 +755,7 @@ static void compile_foreign_funcall(struct Globals *globals, struct FunCall *fun
     }
     load_opcode(globals, CALL);
     load_offset(globals, num_args);
+    add_foreign_call(globals->cc, globals->cc->instructions->length, fundef->ffb->index);
     load_pointer(globals, fundef->ffb->context);
     load_pointer(globals, fundef->ffb->function);
     if (is_stmt) {
@@ -445,14 +778,23 @@ static void compile_del_funcall(struct Globals *globals, struct FunCall *funcall
     // push(globals);
     load_opcode(globals, JMP);
     struct FunctionCallTable *fct = globals->cc->funcall_table;
-    add_callsite(globals, fct, funname, next(globals));
-    globals->cc->instructions->values[bookmark].offset = globals->cc->instructions->length;
+    size_t callsite = next(globals);
+    add_callsite(globals, fct, funname, callsite);
+    if (globals->cc->lazy_functions != NULL) {
+        // Code compiled as the program runs can jump straight to the function, since by then
+        // every function has a location, if only its stub's
+        set_address(globals, callsite, lookup_ft_node(fct, funname)->location);
+    }
+    set_address(globals, bookmark, globals->cc->instructions->length);
     load_opcode(globals, POP_SCOPE);
     if (is_stmt && fundef->rettype != TYPE_UNDEFINED) {
         if (is_object(fundef->rettype)) {
             pop_obj(globals);
         } else {
-            pop(globals);
+            size_t slots = type_slots(globals->cc->class_table, fundef->rettype);
+            for (size_t i = 0; i < slots; i++) {
+                pop(globals);
+            }
         }
     }
 }
@@ -511,7 +853,7 @@ static void compile_value(struct Globals *globals, struct Value *val)
             compile_get_property(globals, val->type, val->get_property, false);
             break;
         case VTYPE_INDEX:
-            compile_get_index(globals, val->type, val->get_property, false);
+            compile_get_index(globals, val->get_property, false);
             break;
         case VTYPE_CAST:
             compile_cast(globals, val->cast);
@@ -636,14 +978,120 @@ static void compile_expr(struct Globals *globals, struct Expr *expr)
     }
 }
 
+static bool is_const_value(struct Value *val)
+{
+    switch (val->vtype) {
+        case VTYPE_STRING:
+        case VTYPE_BYTE:
+        case VTYPE_INT:
+        case VTYPE_FLOAT:
+        case VTYPE_BOOL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Packs element i of a constant array literal into its slots */
+static void pack_const_value(struct Globals *globals, struct ConstArray *const_array, size_t i,
+        struct Value *val)
+{
+    char *packed = (char *) const_array->values;
+    int32_t i32;
+    float f32;
+    switch (const_array->type) {
+        case TYPE_BOOL:
+            if (val->boolean) {
+                const_array->values[i / 64].offset |= UINT64_C(1) << (i % 64);
+            }
+            break;
+        case TYPE_BYTE:
+            packed[i] = val->byte;
+            break;
+        case TYPE_INT32:
+            i32 = (int32_t) val->integer;
+            memcpy(packed + i * sizeof(i32), &i32, sizeof(i32));
+            break;
+        case TYPE_FLOAT32:
+            f32 = (float) val->floating;
+            memcpy(packed + i * sizeof(f32), &f32, sizeof(f32));
+            break;
+        default:
+            // Same value compile_value would have pushed
+            if (val->vtype == VTYPE_STRING) {
+                const_array->values[i].offset = string_index(globals, val->string);
+            } else if (val->vtype == VTYPE_FLOAT) {
+                const_array->values[i].floating = val->floating;
+            } else if (val->vtype == VTYPE_BYTE) {
+                const_array->values[i].byte = val->byte;
+            } else {
+                const_array->values[i].integer = val->integer;
+            }
+            break;
+    }
+}
+
+/* Store a literal whose elements are all constants in the constant section, returning its index */
+static struct ConstArray *new_const_array(struct CompilerContext *cc)
+{
+    if (cc->const_array_count == cc->const_array_capacity) {
+        cc->const_array_capacity = cc->const_array_capacity == 0 ? 8 : 2 * cc->const_array_capacity;
+        cc->const_arrays = realloc(cc->const_arrays,
+                cc->const_array_capacity * sizeof(*(cc->const_arrays)));
+    }
+    return &(cc->const_arrays[cc->const_array_count++]);
+}
+
+static size_t add_const_array(struct Globals *globals, Type type, Values *vals)
+{
+    struct CompilerContext *cc = globals->cc;
+    size_t index = cc->const_array_count;
+    struct ConstArray *const_array = new_const_array(cc);
+    const_array->type = type;
+    const_array->count = vals->length;
+    const_array->slots = array_slots(vals->length, array_width(type));
+    const_array->values = calloc(const_array->slots, sizeof(*(const_array->values)));
+    struct Value *val = NULL;
+    size_t i = 0;
+    linkedlist_vforeach(val, vals) {
+        pack_const_value(globals, const_array, i++, val);
+    }
+    return index;
+}
+
 static void compile_array_literal(struct Globals *globals, Type type, Values *vals)
 {
+    // Lookup tables and the like don't need to be built up one element at a time
+    bool is_const = !is_object_or_null(type) && !is_struct(type);
+    struct Value *val = NULL;
+    linkedlist_vforeach(val, vals) {
+        is_const = is_const && is_const_value(val);
+    }
+    if (is_const) {
+        load_opcode(globals, NEW_ARRAY_FROM_CONST);
+        relocate(globals, RELOCATE_CONST_ARRAY, globals->cc->instructions->length);
+        load_offset(globals, add_const_array(globals, type, vals));
+        return;
+    } else if (is_struct(type)) {
+        size_t slots = type_slots(globals->cc->class_table, type);
+        compile_int(globals, vals->length * slots);
+        compile_type(globals, TYPE_INT);
+        load_opcode(globals, PUSH_ARRAY);
+        int64_t i = 0;
+        linkedlist_vforeach(val, vals) {
+            load_opcode(globals, DUP_OBJ);
+            compile_value(globals, val);
+            compile_int(globals, i++);
+            compile_xet_array_struct(globals, array_of(type), 0, slots, false);
+        }
+        return;
+    }
+
     compile_int(globals, vals->length);
     compile_type(globals, type);
     load_opcode(globals, PUSH_ARRAY);
 
-    enum Code code = is_object_or_null(type) ? SET_ARRAY_OBJ : SET_ARRAY;
-    struct Value *val = NULL;
+    enum Code code = set_array_opcode(type);
     int64_t i = 0;
     linkedlist_vforeach(val, vals) {
         load_opcode(globals, DUP_OBJ);
@@ -660,6 +1108,18 @@ static void compile_array_literal(struct Globals *globals, Type type, Values *va
 static void compile_set_property(struct Globals *globals, struct SetProperty *set)
 {
     compile_value(globals, set->expr);
+    struct Definition field;
+    if (scalar_replacement(globals, set->access, &field)) {
+        compile_set_local(globals, &field);
+        return;
+    } else if (is_struct(set->access->accessor->type)) {
+        // The typechecker doesn't allow setting a field of a temporary
+        compile_xet_struct_field(globals, set->access, false);
+        return;
+    } else if (is_struct(set->expr->type)) {
+        compile_xet_struct_property(globals, set->expr->type, set->access, SET_HEAP);
+        return;
+    }
     enum Code code = is_object(set->expr->type) ? SET_HEAP_OBJ : SET_HEAP;
     compile_xet_property(globals, set->access, code, false);
 }
@@ -668,7 +1128,13 @@ static void compile_set_index(struct Globals *globals, struct SetProperty *set)
 {
     compile_value(globals, set->expr);
     compile_xet_index(globals, set->access, false);
-    load_opcode(globals, is_object(set->expr->type) ? SET_ARRAY_OBJ : SET_ARRAY);
+    Type type = type_of_array(set->access->accessor->type);
+    if (is_struct(type)) {
+        size_t slots = type_slots(globals->cc->class_table, type);
+        compile_xet_array_struct(globals, set->access->accessor->type, 0, slots, false);
+        return;
+    }
+    load_opcode(globals, set_array_opcode(type));
 }
 
 static size_t *compile_exit(struct Globals *globals)
@@ -683,7 +1149,13 @@ static size_t *compile_exit(struct Globals *globals)
 
 static void compile_return(struct Globals *globals, struct Value *ret)
 {
-    if (ret != NULL) {
+    if (ret != NULL && is_struct(ret->type)) {
+        // The return address is under every field of the struct
+        compile_value(globals, ret);
+        load_opcode(globals, RET_STRUCT);
+        load_offset(globals, type_slots(globals->cc->class_table, ret->type));
+        return;
+    } else if (ret != NULL) {
         compile_value(globals, ret);
         if (!is_object(ret->type)) {
             load_opcode(globals, SWAP);
@@ -720,12 +1192,12 @@ static void compile_if(struct Globals *globals, struct IfStatement *stmt)
     }
 
     // set JNE jump to go to after if statement
-    globals->cc->instructions->values[if_offset].offset = globals->cc->instructions->length;
+    set_address(globals, if_offset, globals->cc->instructions->length);
 
     if (stmt->else_stmts) {
         compile_statements(globals, stmt->else_stmts);
         // set JMP jump to go to after else statement when if statement is true
-        globals->cc->instructions->values[else_offset].offset = globals->cc->instructions->length;
+        set_address(globals, else_offset, globals->cc->instructions->length);
     }
 }
 
@@ -749,19 +1221,19 @@ static void compile_loop(struct Globals *globals, struct Value *cond,
     if (increment != NULL) compile_statement(globals, increment);
     // compile_offset(globals, top_of_loop);
     load_opcode(globals, JMP);
-    load_offset(globals, top_of_loop);
+    load_address(globals, top_of_loop);
     // Set JNE to the loop exit
     size_t end_of_loop = globals->cc->instructions->length;
-    globals->cc->instructions->values[old_offset].offset = end_of_loop;
+    set_address(globals, old_offset, end_of_loop);
     // Set any break statements to exit the loop
     linkedlist_foreach(lnode, globals->cc->breaks->head) {
         size_t *loc = lnode->value;
-        globals->cc->instructions->values[*loc].offset = end_of_loop;
+        set_address(globals, *loc, end_of_loop);
     }
     // Set any continue statements to jump to increment/jump back to top
     linkedlist_foreach(lnode, globals->cc->continues->head) {
         size_t *loc = lnode->value;
-        globals->cc->instructions->values[*loc].offset = continue_loc;
+        set_address(globals, *loc, continue_loc);
     }
     // Restore outer loop break/continues
     globals->cc->breaks = breaks;
@@ -813,10 +1285,15 @@ static void compile_statement(struct Globals *globals, struct Statement *stmt)
 {
     switch (stmt->type) {
         case STMT_SET_LOCAL:
+            if (stmt->set_local->def->field_offsets != NULL) {
+                compile_scalar_constructor(globals, stmt->set_local->def,
+                        stmt->set_local->expr->constructor);
+                break;
+            }
             compile_value(globals, stmt->set_local->expr);
             compile_set_local(globals, stmt->set_local->def);
             if (stmt->set_local->is_define) {
-                load_opcode(globals, is_object(stmt->set_local->def->type) ? DEFINE_OBJ: DEFINE);
+                compile_define(globals, stmt->set_local->def);
             }
             break;
         case STMT_SET_PROPERTY:
@@ -852,7 +1329,7 @@ static void compile_statement(struct Globals *globals, struct Statement *stmt)
         case STMT_LET:
             linkedlist_foreach(lnode, stmt->let->head) {
                 struct Definition *def = lnode->value;
-                load_opcode(globals, is_object(def->type) ? DEFINE_OBJ: DEFINE);
+                compile_define(globals, def);
             }
             break;
         case STMT_DEC:
@@ -904,10 +1381,206 @@ static void compile_tld(struct Globals *globals, struct TopLevelDecl *tld)
     }
 }
 
+static void init_compiler_context(struct Globals *globals, size_t string_capacity)
+{
+    struct CompilerContext *cc = globals->cc;
+    cc->instructions  = vector_new(128, INSTRUCTIONS_MAX);
+    cc->comments      = linkedlist_new(globals->allocator);
+    cc->breaks        = linkedlist_new(globals->allocator);
+    cc->continues     = linkedlist_new(globals->allocator);
+    cc->funcall_table = new_ft(globals);
+    cc->string_count = 0;
+    cc->string_capacity = string_capacity;
+    cc->string_bucket_capacity = 1;
+    while (cc->string_bucket_capacity < 2 * string_capacity) {
+        cc->string_bucket_capacity *= 2;
+    }
+    cc->string_buckets = calloc(cc->string_bucket_capacity, sizeof(*(cc->string_buckets)));
+    if (string_capacity > 0) {
+        cc->string_pool = calloc(string_capacity, sizeof(*(cc->string_pool)));
+    } else {
+        cc->string_pool = NULL;
+    }
+    cc->const_array_count = 0;
+    cc->const_array_capacity = 0;
+    cc->const_arrays = NULL;
+    cc->function_count = 0;
+    cc->function_capacity = 0;
+    cc->functions = NULL;
+    cc->foreign_call_count = 0;
+    cc->foreign_call_capacity = 0;
+    cc->foreign_calls = NULL;
+    cc->is_chunk = false;
+    cc->relocation_count = 0;
+    cc->relocation_capacity = 0;
+    cc->relocations = NULL;
+    cc->lazy_count = 0;
+    cc->lazy_functions = NULL;
+}
+
+/* Function bodies are compiled in chunks on several threads, each chunk into its own
+ * instructions, string pool and constant section, and with its own allocator per thread. The
+ * chunks are then appended in order, which gives exactly the code that compiling the functions
+ * one at a time would have. */
+struct CompileJob {
+    struct Globals *globals;
+    size_t tld_count;
+    struct TopLevelDecl **tlds;
+    size_t chunk_count;
+    struct CompilerContext *chunks;
+    Allocator *allocators; // One per worker
+};
+
+static bool compile_chunk(void *data, size_t worker, size_t chunk_index)
+{
+    struct CompileJob *job = data;
+    struct Globals globals = *(job->globals);
+    struct CompilerContext *cc = &(job->chunks[chunk_index]);
+    // Shares the class and function tables and the class layouts
+    *cc = *(job->globals->cc);
+    globals.allocator = job->allocators[worker];
+    globals.cc = cc;
+    init_compiler_context(&globals, 0);
+    cc->is_chunk = true;
+    size_t end = chunk_start(chunk_index + 1, job->chunk_count, job->tld_count);
+    for (size_t i = chunk_start(chunk_index, job->chunk_count, job->tld_count); i < end; i++) {
+        compile_tld(&globals, job->tlds[i]);
+    }
+    return true;
+}
+
+static void append_chunk(struct Globals *globals, struct CompilerContext *chunk)
+{
+    struct CompilerContext *cc = globals->cc;
+    size_t start = cc->instructions->length;
+    // The main pool takes over the chunk's copy of each string it didn't already have
+    size_t *strings = malloc((chunk->string_count + 1) * sizeof(*strings));
+    for (size_t i = 0; i < chunk->string_count; i++) {
+        struct PooledString *pooled = &(chunk->string_pool[i]);
+        strings[i] = intern_string(cc, pooled->string, pooled->length, pooled->hash, true);
+        if (cc->string_pool[strings[i]].string != pooled->string) {
+            free(pooled->string);
+        }
+    }
+    size_t const_array_start = cc->const_array_count;
+    for (size_t i = 0; i < chunk->const_array_count; i++) {
+        struct ConstArray *const_array = new_const_array(cc);
+        *const_array = chunk->const_arrays[i];
+        if (const_array->type == TYPE_STRING) {
+            for (size_t j = 0; j < const_array->count; j++) {
+                const_array->values[j].offset = strings[const_array->values[j].offset];
+            }
+        }
+    }
+    assert("offset is out of bounds\n" &&
+            start + chunk->instructions->length < INSTRUCTIONS_MAX - 1);
+    vector_grow(&(cc->instructions), chunk->instructions->length);
+    DelValue *values = cc->instructions->values + start;
+    memcpy(values, chunk->instructions->values, chunk->instructions->length * sizeof(*values));
+    for (size_t i = 0; i < chunk->relocation_count; i++) {
+        DelValue *value = &(values[chunk->relocations[i].location]);
+        switch (chunk->relocations[i].type) {
+            case RELOCATE_ADDRESS:
+                value->offset += start;
+                break;
+            case RELOCATE_STRING:
+                value->offset = strings[value->offset];
+                break;
+            case RELOCATE_CONST_ARRAY:
+                value->offset += const_array_start;
+                break;
+        }
+    }
+    linkedlist_foreach(lnode, chunk->comments->head) {
+        struct Comment *c = lnode->value;
+        c->location += start;
+        linkedlist_append(cc->comments, c);
+    }
+    for (size_t i = 0; i < chunk->function_count; i++) {
+        struct FunctionLocation *function = new_function_location(cc);
+        function->location = chunk->functions[i].location + start;
+        function->name = chunk->functions[i].name;
+    }
+    for (size_t i = 0; i < chunk->foreign_call_count; i++) {
+        add_foreign_call(cc, chunk->foreign_calls[i].location + start,
+                chunk->foreign_calls[i].function);
+    }
+    merge_ft(globals, cc->funcall_table, chunk->funcall_table, start);
+    vector_free(chunk->instructions);
+    free(chunk->string_pool);
+    free(chunk->string_buckets);
+    free(chunk->const_arrays);
+    free(chunk->functions);
+    free(chunk->foreign_calls);
+    free(chunk->relocations);
+    free(strings);
+}
+
+static void compile_tlds_parallel(struct Globals *globals, TopLevelDecls *tlds, size_t worker_count)
+{
+    struct CompileJob job;
+    job.globals = globals;
+    job.tld_count = 0;
+    job.tlds = malloc(tlds->length * sizeof(*(job.tlds)));
+    linkedlist_foreach(lnode, tlds->head) {
+        struct TopLevelDecl *tld = lnode->value;
+        // Classes and foreign functions don't have any code of their own
+        if (tld->type == TLD_TYPE_FUNDEF && !tld->fundef->is_foreign) {
+            job.tlds[job.tld_count++] = tld;
+        }
+    }
+    job.chunk_count = parallel_chunks(worker_count, job.tld_count);
+    job.chunks = calloc(job.chunk_count, sizeof(*(job.chunks)));
+    job.allocators = malloc(worker_count * sizeof(*(job.allocators)));
+    for (size_t w = 0; w < worker_count; w++) {
+        job.allocators[w] = allocator_new();
+    }
+    parallel_run(worker_count, job.chunk_count, compile_chunk, &job);
+    for (size_t w = 0; w < worker_count; w++) {
+        allocator_merge(globals->allocator, job.allocators[w]);
+    }
+    for (size_t c = 0; c < job.chunk_count; c++) {
+        append_chunk(globals, &(job.chunks[c]));
+    }
+    free(job.allocators);
+    free(job.chunks);
+    free(job.tlds);
+}
+
+/* Instead of its body, each function gets a stub that has the vm call compile_lazily the first
+ * time the function is called */
+static void compile_stubs(struct Globals *globals, TopLevelDecls *tlds)
+{
+    struct CompilerContext *cc = globals->cc;
+    cc->lazy_functions = calloc(tlds->length + 1, sizeof(*(cc->lazy_functions)));
+    linkedlist_foreach(lnode, tlds->head) {
+        struct TopLevelDecl *tld = lnode->value;
+        if (tld->type != TLD_TYPE_FUNDEF || tld->fundef->is_foreign) {
+            continue;
+        }
+        struct LazyFunction *function = &(cc->lazy_functions[cc->lazy_count]);
+        function->fundef = tld->fundef;
+        function->stub = cc->instructions->length;
+        function->is_compiled = false;
+        add_comment(globals, "stub for function: %s", lookup_symbol(globals, tld->fundef->name));
+        add_ft_node(globals, cc->funcall_table, tld->fundef->name, function->stub);
+        load_opcode(globals, COMPILE);
+        load_offset(globals, cc->lazy_count++);
+    }
+}
+
 static void compile_tlds(struct Globals *globals, TopLevelDecls *tlds)
 {
-    globals->cc->funcall_table = new_ft(globals, 0);
     compile_entrypoint(globals);
+    if (globals->compile_mode != COMPILE_EAGER) {
+        compile_stubs(globals, tlds);
+        return;
+    }
+    size_t workers = parallel_workers(globals->function_count);
+    if (workers > 1) {
+        compile_tlds_parallel(globals, tlds, workers);
+        return;
+    }
     linkedlist_foreach(lnode, tlds->head) {
         compile_tld(globals, (struct TopLevelDecl *) lnode->value);
     }
@@ -928,32 +1601,116 @@ static void resolve_function_declarations_help(struct Vector *instructions,
 static void resolve_function_declarations(struct Vector *instructions,
         struct FunctionCallTable *funcall_table)
 {
-    if (funcall_table == NULL) return;
-    resolve_function_declarations_help(instructions, funcall_table->node);
-    resolve_function_declarations(instructions, funcall_table->left);
-    resolve_function_declarations(instructions, funcall_table->right);
-    return;
+    ft_foreach(node, funcall_table) {
+        resolve_function_declarations_help(instructions, node);
+    }
 }
 
 // #include "test_compile.c"
 
-size_t compile(struct Globals *globals, TopLevelDecls *tlds)
+static void compile_class_layouts(struct Globals *globals)
 {
-    globals->cc->instructions = vector_new(128, INSTRUCTIONS_MAX);
-    globals->cc->comments     = linkedlist_new(globals->allocator);
-    globals->cc->breaks       = linkedlist_new(globals->allocator);
-    globals->cc->continues    = linkedlist_new(globals->allocator);
-    globals->cc->string_count = 0;
-    if (globals->string_count > 0) {
-        globals->cc->string_pool = calloc(globals->string_count, sizeof(char *));
-    } else {
-        globals->cc->string_pool = NULL;
+    struct ClassTable *class_table = globals->cc->class_table;
+    globals->cc->class_count = class_table->size;
+    if (class_table->size == 0) {
+        globals->cc->layouts = NULL;
+        return;
     }
+    globals->cc->layouts = calloc(class_table->size, sizeof(*(globals->cc->layouts)));
+    for (size_t i = 0; i < class_table->size; i++) {
+        struct Class *cls = &(class_table->table[i]);
+        struct ClassLayout *layout = &(globals->cc->layouts[i]);
+        layout->name = cls->name;
+        layout->field_count = cls->slot_count;
+        layout->types = calloc(layout->field_count, sizeof(*(layout->types)));
+        layout->ptr_bitmap = calloc(layout->field_count / 64 + 1, sizeof(*(layout->ptr_bitmap)));
+        linkedlist_foreach(lnode, cls->definitions->head) {
+            struct Definition *def = lnode->value;
+            size_t field = def->scope_offset;
+            if (is_struct(def->type)) {
+                // Struct fields only ever hold primitives
+                struct Class *inner = lookup_class(class_table, def->type);
+                linkedlist_foreach(inner_lnode, inner->definitions->head) {
+                    struct Definition *inner_def = inner_lnode->value;
+                    layout->types[field + inner_def->scope_offset] = inner_def->type;
+                }
+                continue;
+            }
+            layout->types[field] = def->type;
+            if (is_object(def->type)) {
+                layout->ptr_bitmap[field / 64] |= UINT64_C(1) << (field % 64);
+            }
+        }
+    }
+}
+
+size_t compile(struct Globals *globals, TopLevelDecls *tlds)
+{
+    init_compiler_context(globals, globals->string_count);
+    compile_class_layouts(globals);
     compile_tlds(globals, tlds);
     resolve_function_declarations(globals->cc->instructions, globals->cc->funcall_table);
+    if (globals->compile_mode == COMPILE_EAGER) {
+        // A lazily compiled program keeps adding strings to its pool as it runs
+        free(globals->cc->string_buckets);
+        globals->cc->string_buckets = NULL;
+    }
     return globals->cc->instructions->length;
     // run_tests();
     // printf("compiler under construction. come back later.\n");
     // exit(0);
 }
 
+/* Points the program at everything compiling another function may have added to or moved */
+static void update_program(struct Program *program, struct CompilerContext *cc)
+{
+    program->instructions = cc->instructions;
+    program->string_count = cc->string_count;
+    program->string_pool = cc->string_pool;
+    program->const_array_count = cc->const_array_count;
+    program->const_arrays = cc->const_arrays;
+    program->function_count = cc->function_count;
+    program->functions = cc->functions;
+    program->foreign_call_count = cc->foreign_call_count;
+    program->foreign_calls = cc->foreign_calls;
+}
+
+/* Compiles the body of a function onto the end of the program, the first time it's called. Every
+ * call to it that's been compiled so far gets pointed at the body, and its stub becomes a jump
+ * to the body, so the vm can carry on from the stub once this returns. Returns false if the body
+ * doesn't typecheck. */
+bool compile_lazily(struct Program *program, size_t function)
+{
+    struct Globals *globals = program->compiler;
+    struct CompilerContext *cc = globals->cc;
+    struct LazyFunction *lazy = &(cc->lazy_functions[function]);
+    if (lazy->is_compiled) {
+        return true;
+    } else if (globals->compile_mode == COMPILE_LAZY_TYPECHECK
+            && !typecheck_function(globals, lazy->fundef)) {
+        return false;
+    }
+    escape_function(globals, lazy->fundef);
+    add_comment(globals, "function definition: %s", lookup_symbol(globals, lazy->fundef->name));
+    compile_fundef(globals, lazy->fundef);
+    struct FunctionCallTableNode *node = lookup_ft_node(cc->funcall_table, lazy->fundef->name);
+    resolve_function_declarations_help(cc->instructions, node);
+    cc->instructions->values[lazy->stub].opcode = JMP;
+    cc->instructions->values[lazy->stub + 1].offset = node->location;
+    lazy->is_compiled = true;
+    update_program(program, cc);
+    return true;
+}
+
+/* Compiles every function that hasn't been called yet, so the program can be saved */
+bool compile_remaining(struct Program *program)
+{
+    struct CompilerContext *cc = program->compiler->cc;
+    for (size_t i = 0; i < cc->lazy_count; i++) {
+        if (!compile_lazily(program, i)) {
+            return false;
+        }
+    }
+    program->compiler = NULL;
+    return true;
+}
@@ -15,29 +15,133 @@ typedef union {
     double floating;
     char byte;
     char chars[8];
-    uint16_t types[4];
+    uint32_t types[2];
     enum Code opcode;
     Type type;
     intptr_t pointer;
 } DelValue;
 
+/* Layout of a class, recorded once per class rather than in every instance. Instances only
+ * carry a header word holding their class id (the index into the layout table), so field k
+ * of an object lives at slot OBJECT_HEADER_SLOTS + k */
+struct ClassLayout {
+    Symbol name;
+    size_t field_count;
+    Type *types;
+    // Bit k is set if field k holds a pointer, so the gc doesn't need to decode types
+    uint64_t *ptr_bitmap;
+};
+
+static inline bool layout_is_ptr(struct ClassLayout *layout, size_t field)
+{
+    return (layout->ptr_bitmap[field / 64] >> (field % 64)) & 1;
+}
+
+/* An array literal whose elements are all constants, already packed the way the vm stores an
+ * array of its type. NEW_ARRAY_FROM_CONST copies it into a fresh array. */
+struct ConstArray {
+    Type type;
+    size_t count;
+    size_t slots;
+    DelValue *values;
+};
+
+/* Where a function's code starts, so the vm can say which function an instruction is in */
+struct FunctionLocation {
+    size_t location;
+    char *name;
+};
+
+/* A call to a foreign function. The CALL instruction's context and function pointer operands
+ * start at location, and function is the function's index in the program's foreign functions.
+ * A saved program leaves the pointers out, and whoever loads it fills them back in. */
+struct ForeignCall {
+    size_t location;
+    size_t function;
+};
+
+/* A foreign function a program can call. They're matched up by name with the functions
+ * registered with the compiler that loads a saved program, so the signature is kept as well to
+ * check that they agree. */
+struct ProgramForeignFunction {
+    char *name;
+    bool is_yielding;
+    Type return_type;
+    size_t arg_count;
+    Type *arg_types;
+};
+
+/* A string literal. The length and hash are worked out once at compile time, so that nothing
+ * needs to call strlen on it again. */
+struct PooledString {
+    char *string;
+    size_t length;
+    uint64_t hash;
+};
+
+/* An operand of code compiled on its own that has to be fixed up once the code is appended to
+ * the rest: an instruction address, an index into the string pool, or an index into the
+ * constant section */
+enum RelocationType {
+    RELOCATE_ADDRESS,
+    RELOCATE_STRING,
+    RELOCATE_CONST_ARRAY
+};
+
+struct Relocation {
+    enum RelocationType type;
+    size_t location;
+};
+
 struct Comment {
     size_t location;
     char *comment;
 };
 
+/* A function that's compiled the first time it's called. Until then, calls to it jump to a stub
+ * that asks the vm to compile it. */
+struct LazyFunction {
+    struct FunDef *fundef;
+    size_t stub;
+    bool is_compiled;
+};
+
 struct CompilerContext {
     struct Vector *instructions;
     size_t string_count;
-    char **string_pool;
+    size_t string_capacity;
+    struct PooledString *string_pool;
+    size_t string_bucket_capacity;
+    size_t *string_buckets; // Index into string_pool + 1, or 0 for an empty bucket
     struct LinkedList *comments;
     BreakLocations *breaks;
     BreakLocations *continues;
     struct FunctionCallTable *funcall_table;
     struct ClassTable *class_table;
     struct FunctionTable *fundef_table;
+    size_t class_count;
+    struct ClassLayout *layouts;
+    size_t const_array_count;
+    size_t const_array_capacity;
+    struct ConstArray *const_arrays;
+    size_t function_count;
+    size_t function_capacity;
+    struct FunctionLocation *functions; // In order of location
+    size_t foreign_call_count;
+    size_t foreign_call_capacity;
+    struct ForeignCall *foreign_calls;
+    // Set for a chunk of functions compiled on its own thread, to be appended to the rest later
+    bool is_chunk;
+    size_t relocation_count;
+    size_t relocation_capacity;
+    struct Relocation *relocations;
+    // Indexed by the operand of each stub's COMPILE, or NULL unless compiling lazily
+    size_t lazy_count;
+    struct LazyFunction *lazy_functions;
 };
 
 size_t compile(struct Globals *globals, TopLevelDecls *tlds);
+bool compile_lazily(struct Program *program, size_t function);
+bool compile_remaining(struct Program *program);
 
 #endif
@@ -1,3 +1,5 @@
+#include <time.h>
+#include <sys/resource.h>
 #include "common.h"
 #include "allocator.h"
 #include "linkedlist.h"
@@ -8,24 +10,90 @@
 #include "ast.h"
 #include "parser.h"
 #include "typecheck.h"
+#include "escape.h"
 #include "compiler.h"
 #include "printers.h"
 #include "vector.h"
+#include "delc.h"
 #include "del.h"
 
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t max_rss_bytes(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return (uint64_t) usage.ru_maxrss * 1024;
+#endif
+}
+
+/* Records how long the phase took since start, and how much memory is in use after it */
+static void end_phase(struct Globals *globals, enum CompilePhase phase, uint64_t start)
+{
+    struct CompileStats *stats = &(globals->compile_stats);
+    stats->ns[phase] = now_ns() - start;
+    stats->bytes[phase] = allocator_usage(globals->allocator);
+    if (phase == PHASE_LEX) {
+        stats->bytes[phase] += globals->lexer->tokens->capacity * sizeof(struct Token);
+    } else if (phase == PHASE_CODEGEN) {
+        stats->bytes[phase] += globals->cc->instructions->capacity * sizeof(DelValue);
+    }
+    stats->max_rss_bytes[phase] = max_rss_bytes();
+}
+
+/* Copies the signatures of the registered foreign functions into the program, in the order they
+ * were registered, so that a saved program can check them against the ones it's loaded with */
+static void program_foreign_functions(struct Globals *globals, struct Program *program)
+{
+    size_t count = globals->foreign_function_table->length;
+    program->foreign_function_count = count;
+    program->foreign_functions = calloc(count + 1, sizeof(*(program->foreign_functions)));
+    struct ForeignFunction *ff = NULL;
+    size_t i = 0;
+    linkedlist_vforeach(ff, globals->foreign_function_table) {
+        struct ProgramForeignFunction *pff = &(program->foreign_functions[i++]);
+        pff->name = malloc(strlen(ff->function_name) + 1);
+        strcpy(pff->name, ff->function_name);
+        pff->is_yielding = ff->is_yielding;
+        pff->return_type = ff->return_type;
+        pff->arg_count = ff->arg_types->length;
+        pff->arg_types = calloc(pff->arg_count + 1, sizeof(*(pff->arg_types)));
+        size_t j = 0;
+        Type *type = NULL;
+        linkedlist_vforeach(type, ff->arg_types) {
+            pff->arg_types[j++] = *type;
+        }
+    }
+}
+
 static bool parse_and_compile(struct Globals *globals, struct Program **program)
 {
+    memset(&(globals->compile_stats), 0, sizeof(globals->compile_stats));
 #if DEBUG_LEXER
     printf("........ TOKENIZING INPUT ........\n");
 #endif
+    uint64_t start = now_ns();
     struct Lexer lexer;
     lexer_init(globals, &lexer, false);
     globals->lexer = &lexer;
-    if (!tokenize(globals)) {
+    bool tokenized = tokenize(globals);
+    end_phase(globals, PHASE_LEX, start);
+    if (!tokenized) {
         fprintf(globals->ferr, "Error at line %d column %d: %s\n",
                 globals->lexer->error.line_number,
                 globals->lexer->error.column_number,
                 globals->lexer->error.message);
+        lexer_free(globals->lexer);
         return false;
     }
 #if DEBUG_LEXER
@@ -35,16 +103,18 @@ static bool parse_and_compile(struct Globals *globals, struct Program **program)
 
 #if DEBUG_LEXER
     printf("........ PRINTING ALL SYMBOLS ........\n");
-    linkedlist_foreach(lnode, globals->symbol_table->head) {
-        printf("symbol: '%s'\n", (char *) lnode->value);
+    for (size_t i = 0; i < globals->symbol_table->length; i++) {
+        printf("symbol: '%s'\n", globals->symbol_table->names[i]);
     }
 #endif
 
 #if DEBUG_FFI
     printf("........ REGISTERING FOREIGN FUNCTIONS ........\n");
 #endif
+    start = now_ns();
     if (!ffi_register_functions(globals)) {
         fprintf(globals->ferr, "Error registering foreign function\n");
+        lexer_free(globals->lexer);
         return false;
     }
 
@@ -53,9 +123,14 @@ static bool parse_and_compile(struct Globals *globals, struct Program **program)
 #endif
     // struct Parser parser = { globals->lexer.tokens->head, &lexer };
     // globals->parser = &parser;
-    globals->parser = globals->lexer->tokens->head;
-    if (!parse_tlds(globals)) {
+    globals->parser = globals->lexer->tokens->length == 0 ? NULL : globals->lexer->tokens->values;
+    bool parsed = parse_tlds(globals);
+    if (!parsed) {
         error_print(globals);
+    }
+    lexer_free(globals->lexer);
+    end_phase(globals, PHASE_PARSE, start);
+    if (!parsed) {
         return false;
     }
 #if DEBUG_PARSER
@@ -71,7 +146,10 @@ static bool parse_and_compile(struct Globals *globals, struct Program **program)
 #if DEBUG_TYPECHECKER
     printf("`````````````` TYPECHECK ```````````````\n");
 #endif
-    if (typecheck(globals)) {
+    start = now_ns();
+    bool typechecked = typecheck(globals);
+    end_phase(globals, PHASE_TYPECHECK, start);
+    if (typechecked) {
 #if DEBUG_TYPECHECKER
         printf("program has typechecked\n");
 #endif
@@ -81,14 +159,34 @@ static bool parse_and_compile(struct Globals *globals, struct Program **program)
 #endif
         return false;
     }
+    start = now_ns();
+    if (globals->compile_mode == COMPILE_EAGER) {
+        // Lazily compiled functions are analysed as they're compiled
+        escape_analysis(globals, globals->ast);
+    }
+    end_phase(globals, PHASE_ESCAPE, start);
 #if DEBUG_COMPILER
     printf("`````````````` COMPILE ```````````````\n");
 #endif
+    start = now_ns();
     compile(globals, globals->ast);
+    end_phase(globals, PHASE_CODEGEN, start);
     *program = malloc(sizeof(**program));
     (*program)->instructions = globals->cc->instructions;
     (*program)->string_count = globals->cc->string_count;
     (*program)->string_pool = globals->cc->string_pool;
+    (*program)->class_count = globals->cc->class_count;
+    (*program)->layouts = globals->cc->layouts;
+    (*program)->const_array_count = globals->cc->const_array_count;
+    (*program)->const_arrays = globals->cc->const_arrays;
+    (*program)->function_count = globals->cc->function_count;
+    (*program)->functions = globals->cc->functions;
+    (*program)->foreign_call_count = globals->cc->foreign_call_count;
+    (*program)->foreign_calls = globals->cc->foreign_calls;
+    program_foreign_functions(globals, *program);
+    (*program)->mapping = NULL;
+    (*program)->mapping_length = 0;
+    (*program)->compiler = globals->compile_mode == COMPILE_EAGER ? NULL : globals;
 #if DEBUG_COMPILER
     printf("\n");
     printf("````````````` INSTRUCTIONS `````````````\n");
@@ -111,7 +209,7 @@ static bool parse_and_compile_file(struct Globals *globals, struct Program **pro
 #if DEBUG_TEXT
     printf("........ READING FILE : %s ........\n", filename);
 #endif
-    struct FileContext file = { filename, 0, NULL };
+    struct FileContext file = { filename, 0, NULL, false };
     if (!readfile(globals, &file)) {
         fprintf(globals->ferr, "Error: could not read contents of empty file\n");
         return false;
@@ -122,13 +220,15 @@ static bool parse_and_compile_file(struct Globals *globals, struct Program **pro
     printf("%s\n", globals->file->input);
     print_memory_usage(globals->allocator);
 #endif
-    return parse_and_compile(globals, program);
+    bool compiled = parse_and_compile(globals, program);
+    closefile(&file);
+    return compiled;
 }
 
 static bool parse_and_compile_text(struct Globals *globals, struct Program **program,
         char *program_text)
 {
-    struct FileContext file = { NULL, strlen(program_text), program_text };
+    struct FileContext file = { NULL, strlen(program_text), program_text, false };
     globals->file = &file;
     return parse_and_compile(globals, program);
 }
@@ -148,10 +248,32 @@ void del_compiler_init(DelCompiler *compiler, FILE *ferr)
 void del_compiler_free(DelCompiler compiler)
 {
     struct Globals *globals = (struct Globals *) compiler;
+    if (globals->cc != NULL) {
+        // Only left over if the last program was compiled lazily
+        free(globals->cc->string_buckets);
+        free(globals->cc->lazy_functions);
+    }
+    free_symbol_table(globals);
     allocator_freeall(globals->allocator);
     free(globals);
 }
 
+void del_compiler_set_mode(DelCompiler compiler, enum DelCompileMode mode)
+{
+    struct Globals *globals = (struct Globals *) compiler;
+    switch (mode) {
+        case DEL_COMPILE_EAGER:
+            globals->compile_mode = COMPILE_EAGER;
+            break;
+        case DEL_COMPILE_LAZY:
+            globals->compile_mode = COMPILE_LAZY;
+            break;
+        case DEL_COMPILE_LAZY_TYPECHECK:
+            globals->compile_mode = COMPILE_LAZY_TYPECHECK;
+            break;
+    }
+}
+
 void del_register_function_helper(DelCompiler compiler, void *context, bool is_yielding,
         DelForeignFunctionCall function, char *ff_name, int arg_count, ...)
 {
@@ -192,23 +314,89 @@ DelProgram del_compile_file(DelCompiler compiler, char *filename)
     return 0;
 }
 
+void del_compiler_stats(DelCompiler compiler, struct DelCompileStats *stats)
+{
+    struct Globals *globals = (struct Globals *) compiler;
+    for (size_t i = 0; i < DEL_COMPILE_PHASES; i++) {
+        stats->phase_ns[i] = globals->compile_stats.ns[i];
+        stats->phase_bytes[i] = globals->compile_stats.bytes[i];
+        stats->phase_max_rss[i] = globals->compile_stats.max_rss_bytes[i];
+    }
+}
+
+bool del_program_save(DelProgram del_program, char *filename, FILE *ferr)
+{
+    struct Program *program = (struct Program *) del_program;
+    if (program->compiler != NULL && !compile_remaining(program)) {
+        return false;
+    }
+    return program_save(program, filename, ferr);
+}
+
+DelProgram del_program_load(DelCompiler compiler, char *filename)
+{
+    struct Globals *globals = (struct Globals *) compiler;
+    return (DelProgram) program_load(globals, filename);
+}
+
 void del_program_free(DelProgram del_program)
 {
     struct Program *program = (struct Program *) del_program;
+    if (program->mapping != NULL) {
+        program_unmap(program);
+        return;
+    }
     vector_free(program->instructions);
     for (size_t i = 0; i < program->string_count; i++) {
-        free(program->string_pool[i]);
+        free(program->string_pool[i].string);
     }
     if (program->string_pool != NULL) free(program->string_pool);
+    for (size_t i = 0; i < program->class_count; i++) {
+        free(program->layouts[i].types);
+        free(program->layouts[i].ptr_bitmap);
+    }
+    if (program->layouts != NULL) free(program->layouts);
+    for (size_t i = 0; i < program->const_array_count; i++) {
+        free(program->const_arrays[i].values);
+    }
+    if (program->const_arrays != NULL) free(program->const_arrays);
+    for (size_t i = 0; i < program->function_count; i++) {
+        free(program->functions[i].name);
+    }
+    if (program->functions != NULL) free(program->functions);
+    for (size_t i = 0; i < program->foreign_function_count; i++) {
+        free(program->foreign_functions[i].name);
+        free(program->foreign_functions[i].arg_types);
+    }
+    free(program->foreign_functions);
+    free(program->foreign_calls);
     free(program);
 }
 
+void del_vm_default_settings(struct DelVMSettings *settings)
+{
+    settings->heap_init_bytes = IN_BYTES(HEAP_INIT);
+    settings->heap_max_bytes = HEAP_MAX;
+    settings->heap_soft_limit_bytes = 0;
+    settings->soft_limit_callback = NULL;
+    settings->soft_limit_context = NULL;
+    settings->profile_allocations = false;
+}
+
 void del_vm_init(DelVM *del_vm, FILE *fout, FILE *ferr, DelProgram del_program)
+{
+    struct DelVMSettings settings;
+    del_vm_default_settings(&settings);
+    del_vm_init_with_settings(del_vm, fout, ferr, del_program, &settings);
+}
+
+void del_vm_init_with_settings(DelVM *del_vm, FILE *fout, FILE *ferr, DelProgram del_program,
+        const struct DelVMSettings *settings)
 {
     struct VirtualMachine *vm = malloc(sizeof(*vm));
     memset(vm, 0, sizeof(*vm));
     struct Program *program = (struct Program *) del_program;
-    vm_init(vm, fout, ferr, program->instructions->values, program->string_pool);
+    vm_init(vm, fout, ferr, program, settings);
     *del_vm = (DelVM) vm;
 }
 
@@ -224,6 +412,18 @@ enum DelVirtualMachineStatus del_vm_status(DelVM del_vm)
     return vm->status;
 }
 
+void del_vm_stats(DelVM del_vm, struct DelVMStats *stats)
+{
+    struct VirtualMachine *vm = (struct VirtualMachine *) del_vm;
+    vm_stats(vm, stats);
+}
+
+void del_vm_print_allocation_profile(DelVM del_vm, FILE *out)
+{
+    struct VirtualMachine *vm = (struct VirtualMachine *) del_vm;
+    vm_print_allocation_profile(vm, out);
+}
+
 void del_vm_free(DelVM del_vm)
 {
     struct VirtualMachine *vm = (struct VirtualMachine *) del_vm;
@@ -9,7 +9,8 @@ enum DelVirtualMachineStatus {
     DEL_VM_STATUS_INITIALIZED = 0,
     DEL_VM_STATUS_ERROR = 1, 
     DEL_VM_STATUS_COMPLETED = 2, 
-    DEL_VM_STATUS_YIELD = 3
+    DEL_VM_STATUS_YIELD = 3,
+    DEL_VM_STATUS_OUT_OF_MEMORY = 4
 };
 
 typedef intptr_t DelProgram;
@@ -49,13 +50,87 @@ union DelForeignValue {
 
 typedef union DelForeignValue (*DelForeignFunctionCall)(union DelForeignValue *, void *);
 
+// Called the first time the heap grows past its soft limit, and again each time it grows past
+// it after a collection brought it back under. Checked whenever the heap collects or grows.
+typedef void (*DelSoftLimitCallback)(void *context, uint64_t heap_bytes);
+
+// Per VM memory settings, see del_vm_default_settings for the defaults
+struct DelVMSettings {
+    uint64_t heap_init_bytes;
+    uint64_t heap_max_bytes;        // Going over this stops the VM with DEL_VM_STATUS_OUT_OF_MEMORY
+    uint64_t heap_soft_limit_bytes; // 0 for no soft limit
+    DelSoftLimitCallback soft_limit_callback;
+    void *soft_limit_context;
+    // Count the objects and bytes allocated by each instruction that allocates, for
+    // del_vm_print_allocation_profile. Off by default, since it slows down every allocation.
+    bool profile_allocations;
+};
+
+// Memory statistics, see del_vm_stats. pause_histogram[0] counts collections that took under a
+// microsecond, and pause_histogram[i] those that took at least 2^(i-1) and under 2^i
+// microseconds. The last bucket also counts anything longer than that.
+#define DEL_PAUSE_HISTOGRAM_BUCKETS 24
+
+struct DelVMStats {
+    uint64_t bytes_allocated; // Over the lifetime of the VM
+    uint64_t heap_bytes;      // Taken up by objects and arrays right now, garbage or not
+    uint64_t live_bytes;      // Still reachable as of the last collection
+    uint64_t collections;
+    uint64_t total_pause_ns;
+    uint64_t max_pause_ns;
+    uint64_t pause_histogram[DEL_PAUSE_HISTOGRAM_BUCKETS];
+    // Object counts indexed by class id. These point into the VM and are valid until it's freed.
+    size_t class_count;
+    const uint64_t *objects_allocated;
+    const uint64_t *objects_live; // As of the last collection
+};
+
+// Compile time statistics, see del_compiler_stats. Each array is indexed by phase.
+enum DelCompilePhase {
+    DEL_COMPILE_LEX,
+    DEL_COMPILE_PARSE,
+    DEL_COMPILE_TYPECHECK,
+    DEL_COMPILE_ESCAPE,
+    DEL_COMPILE_CODEGEN,
+    DEL_COMPILE_PHASES
+};
+
+struct DelCompileStats {
+    uint64_t phase_ns[DEL_COMPILE_PHASES];
+    uint64_t phase_bytes[DEL_COMPILE_PHASES];   // Memory held by the compiler after each phase
+    uint64_t phase_max_rss[DEL_COMPILE_PHASES]; // Peak resident set size of the whole process
+                                                // in bytes, as of the end of each phase
+};
+
+// How much of a program to compile before it runs, see del_compiler_set_mode
+enum DelCompileMode {
+    DEL_COMPILE_EAGER,         // All of it (the default)
+    DEL_COMPILE_LAZY,          // Each function is compiled the first time it's called
+    DEL_COMPILE_LAZY_TYPECHECK // Each function is typechecked then too, so type errors in
+                               // functions that never run aren't reported
+};
+
 // Del compiler functions
 void del_compiler_init(DelCompiler *compiler, FILE *ferr);
 void del_compiler_free(DelCompiler compiler);
+// A lazily compiled program compiles the rest of itself with the compiler as it runs. So the
+// compiler has to be freed after the program, and can't compile anything else in the meantime,
+// and the program's VMs can't run on more than one thread at once.
+void del_compiler_set_mode(DelCompiler compiler, enum DelCompileMode mode);
 void del_register_function_helper(DelCompiler compiler, void *context, bool is_yielding,
         DelForeignFunctionCall function, char *ff_name, int arg_count, ...);
 DelProgram del_compile_text(DelCompiler compiler, char *program_text);
 DelProgram del_compile_file(DelCompiler compiler, char *filename);
+// Covers the last program compiled
+void del_compiler_stats(DelCompiler compiler, struct DelCompileStats *stats);
+// Saves a compiled program to a .delc file, which del_program_load can run without compiling it
+// again. The foreign functions it calls have to be registered with the loading compiler under
+// the same names and signatures.
+// Loading checks that the file is laid out right and that the instructions' class, constant
+// array and jump target operands are in range, but not values that only show up at run time,
+// like string indices, field offsets or return addresses. So only load .delc files you trust.
+bool del_program_save(DelProgram del_program, char *filename, FILE *ferr);
+DelProgram del_program_load(DelCompiler compiler, char *filename);
 void del_program_free(DelProgram del_program);
  
 #define DEL_ARG_COUNT(...) \
@@ -74,9 +149,18 @@ void del_program_free(DelProgram del_program);
             DEL_ARG_COUNT(__VA_ARGS__) - 1, __VA_ARGS__)
 
 // Del runtime functions
+void del_vm_default_settings(struct DelVMSettings *settings);
 void del_vm_init(DelVM *del_vm, FILE *fout, FILE *ferr, DelProgram del_program);
+// If the heap can't be set up, say because heap_max_bytes is under 8, the VM's status is
+// DEL_VM_STATUS_OUT_OF_MEMORY and del_vm_execute won't run it
+void del_vm_init_with_settings(DelVM *del_vm, FILE *fout, FILE *ferr, DelProgram del_program,
+        const struct DelVMSettings *settings);
 void del_vm_execute(DelVM del_vm);
 void del_vm_free(DelVM del_vm);
 enum DelVirtualMachineStatus del_vm_status(DelVM del_vm);
+void del_vm_stats(DelVM del_vm, struct DelVMStats *stats);
+// Prints each allocation site (function and bytecode address) with the number of allocations
+// and bytes it made, largest first. Needs profile_allocations to have been set.
+void del_vm_print_allocation_profile(DelVM del_vm, FILE *out);
 
 #endif
@@ -0,0 +1,687 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "common.h"
+#include "readfile.h"
+#include "compiler.h"
+#include "vector.h"
+#include "ffi.h"
+#include "delc.h"
+
+/* A .delc file holds a compiled program, laid out so that loading it is mostly a matter of
+ * mapping it into memory:
+ *
+ *   header
+ *   instructions     the same DelValues the vm runs, except that the context and function
+ *                    pointer operands of each CALL are zeroed
+ *   records          one per string, class layout, constant array, function, foreign function
+ *                    and foreign call, each kind in a table the header points at
+ *   data             whatever the records point at: strings, layout types, constant values
+ *
+ * Offsets are from the start of the file, and everything starts on an 8 byte boundary. Numbers
+ * are in the byte order of the machine that wrote the file, and the header records which, so
+ * that a file only loads where it was made.
+ *
+ * The mapping is private, so filling in the CALL pointers only copies the pages they're on.
+ * Loading reads through the instructions once, to check that the opcodes and the operands that
+ * index something (class ids, constant arrays, jump targets) are in range. Foreign functions are
+ * found by name among the ones registered with the compiler doing the loading. */
+
+#define DELC_MAGIC "DELC"
+#define DELC_VERSION 1
+#define DELC_BYTE_ORDER UINT32_C(0x01020304)
+#define DELC_ALIGNMENT 8
+
+struct DelcSection {
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct DelcHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t opcode_count; // Bytecode from a build with different opcodes won't run
+    uint64_t file_length;
+    struct DelcSection instructions;
+    struct DelcSection strings;
+    struct DelcSection layouts;
+    struct DelcSection const_arrays;
+    struct DelcSection functions;
+    struct DelcSection foreign_functions;
+    struct DelcSection foreign_calls;
+};
+
+struct DelcString {
+    uint64_t offset; // Null terminated
+    uint64_t length;
+    uint64_t hash;
+};
+
+struct DelcLayout {
+    uint64_t name;
+    uint64_t field_count;
+    uint64_t types;
+    uint64_t ptr_bitmap;
+};
+
+struct DelcConstArray {
+    uint64_t type;
+    uint64_t count;
+    uint64_t slots;
+    uint64_t values;
+};
+
+struct DelcFunction {
+    uint64_t location;
+    uint64_t name;
+};
+
+struct DelcForeignFunction {
+    uint64_t name;
+    uint64_t is_yielding;
+    uint64_t return_type;
+    uint64_t arg_count;
+    uint64_t arg_types;
+};
+
+struct DelcForeignCall {
+    uint64_t location;
+    uint64_t function;
+};
+
+struct Writer {
+    size_t length;
+    size_t capacity;
+    char *data;
+};
+
+/* Appends size bytes at the next 8 byte boundary, and returns where they went */
+static uint64_t write_bytes(struct Writer *writer, const void *bytes, size_t size)
+{
+    size_t offset = (writer->length + DELC_ALIGNMENT - 1) & ~(size_t) (DELC_ALIGNMENT - 1);
+    if (offset + size > writer->capacity) {
+        while (offset + size > writer->capacity) {
+            writer->capacity = writer->capacity == 0 ? 4096 : 2 * writer->capacity;
+        }
+        writer->data = realloc(writer->data, writer->capacity);
+    }
+    memset(writer->data + writer->length, 0, offset - writer->length);
+    if (size > 0) {
+        memcpy(writer->data + offset, bytes, size);
+    }
+    writer->length = offset + size;
+    return offset;
+}
+
+static struct DelcSection write_section(struct Writer *writer, const void *records, size_t count,
+        size_t size)
+{
+    struct DelcSection section = { write_bytes(writer, records, count * size), count };
+    return section;
+}
+
+static uint64_t write_string(struct Writer *writer, const char *string)
+{
+    return write_bytes(writer, string, strlen(string) + 1);
+}
+
+static void write_instructions(struct Writer *writer, struct Program *program,
+        struct DelcHeader *header)
+{
+    struct Vector *instructions = program->instructions;
+    header->instructions = write_section(writer, instructions->values, instructions->length,
+            sizeof(DelValue));
+    DelValue *values = (DelValue *) (writer->data + header->instructions.offset);
+    for (size_t i = 0; i < program->foreign_call_count; i++) {
+        size_t location = program->foreign_calls[i].location;
+        values[location].pointer = 0;
+        values[location + 1].pointer = 0;
+    }
+}
+
+static void write_strings(struct Writer *writer, struct Program *program,
+        struct DelcHeader *header)
+{
+    struct DelcString *strings = calloc(program->string_count + 1, sizeof(*strings));
+    for (size_t i = 0; i < program->string_count; i++) {
+        struct PooledString *pooled = &(program->string_pool[i]);
+        strings[i].offset = write_bytes(writer, pooled->string, pooled->length + 1);
+        strings[i].length = pooled->length;
+        strings[i].hash = pooled->hash;
+    }
+    header->strings = write_section(writer, strings, program->string_count, sizeof(*strings));
+    free(strings);
+}
+
+static void write_layouts(struct Writer *writer, struct Program *program,
+        struct DelcHeader *header)
+{
+    struct DelcLayout *layouts = calloc(program->class_count + 1, sizeof(*layouts));
+    for (size_t i = 0; i < program->class_count; i++) {
+        struct ClassLayout *layout = &(program->layouts[i]);
+        layouts[i].name = layout->name;
+        layouts[i].field_count = layout->field_count;
+        layouts[i].types = write_bytes(writer, layout->types,
+                layout->field_count * sizeof(*(layout->types)));
+        layouts[i].ptr_bitmap = write_bytes(writer, layout->ptr_bitmap,
+                (layout->field_count / 64 + 1) * sizeof(*(layout->ptr_bitmap)));
+    }
+    header->layouts = write_section(writer, layouts, program->class_count, sizeof(*layouts));
+    free(layouts);
+}
+
+static void write_const_arrays(struct Writer *writer, struct Program *program,
+        struct DelcHeader *header)
+{
+    struct DelcConstArray *const_arrays = calloc(program->const_array_count + 1,
+            sizeof(*const_arrays));
+    for (size_t i = 0; i < program->const_array_count; i++) {
+        struct ConstArray *const_array = &(program->const_arrays[i]);
+        const_arrays[i].type = const_array->type;
+        const_arrays[i].count = const_array->count;
+        const_arrays[i].slots = const_array->slots;
+        const_arrays[i].values = write_bytes(writer, const_array->values,
+                const_array->slots * sizeof(*(const_array->values)));
+    }
+    header->const_arrays = write_section(writer, const_arrays, program->const_array_count,
+            sizeof(*const_arrays));
+    free(const_arrays);
+}
+
+static void write_functions(struct Writer *writer, struct Program *program,
+        struct DelcHeader *header)
+{
+    struct DelcFunction *functions = calloc(program->function_count + 1, sizeof(*functions));
+    for (size_t i = 0; i < program->function_count; i++) {
+        functions[i].location = program->functions[i].location;
+        functions[i].name = write_string(writer, program->functions[i].name);
+    }
+    header->functions = write_section(writer, functions, program->function_count,
+            sizeof(*functions));
+    free(functions);
+}
+
+/* Only the foreign functions the program actually calls are written, so that loading it doesn't
+ * need the rest to be registered */
+static void write_foreign_functions(struct Writer *writer, struct Program *program,
+        struct DelcHeader *header)
+{
+    size_t *indexes = malloc((program->foreign_function_count + 1) * sizeof(*indexes));
+    for (size_t i = 0; i < program->foreign_function_count; i++) {
+        indexes[i] = SIZE_MAX;
+    }
+    for (size_t i = 0; i < program->foreign_call_count; i++) {
+        indexes[program->foreign_calls[i].function] = 0;
+    }
+    struct DelcForeignFunction *functions = calloc(program->foreign_function_count + 1,
+            sizeof(*functions));
+    size_t count = 0;
+    for (size_t i = 0; i < program->foreign_function_count; i++) {
+        if (indexes[i] == SIZE_MAX) {
+            continue;
+        }
+        struct ProgramForeignFunction *ff = &(program->foreign_functions[i]);
+        indexes[i] = count;
+        functions[count].name = write_string(writer, ff->name);
+        functions[count].is_yielding = ff->is_yielding;
+        functions[count].return_type = ff->return_type;
+        functions[count].arg_count = ff->arg_count;
+        functions[count].arg_types = write_bytes(writer, ff->arg_types,
+                ff->arg_count * sizeof(*(ff->arg_types)));
+        count++;
+    }
+    header->foreign_functions = write_section(writer, functions, count, sizeof(*functions));
+    struct DelcForeignCall *calls = calloc(program->foreign_call_count + 1, sizeof(*calls));
+    for (size_t i = 0; i < program->foreign_call_count; i++) {
+        calls[i].location = program->foreign_calls[i].location;
+        calls[i].function = indexes[program->foreign_calls[i].function];
+    }
+    header->foreign_calls = write_section(writer, calls, program->foreign_call_count,
+            sizeof(*calls));
+    free(calls);
+    free(functions);
+    free(indexes);
+}
+
+bool program_save(struct Program *program, char *filename, FILE *ferr)
+{
+    struct Writer writer = { 0, 0, NULL };
+    struct DelcHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DELC_MAGIC, sizeof(header.magic));
+    header.version = DELC_VERSION;
+    header.byte_order = DELC_BYTE_ORDER;
+    header.opcode_count = READ + 1;
+    write_bytes(&writer, &header, sizeof(header));
+    write_instructions(&writer, program, &header);
+    write_strings(&writer, program, &header);
+    write_layouts(&writer, program, &header);
+    write_const_arrays(&writer, program, &header);
+    write_functions(&writer, program, &header);
+    write_foreign_functions(&writer, program, &header);
+    header.file_length = writer.length;
+    memcpy(writer.data, &header, sizeof(header));
+
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        fprintf(ferr, "Error: could not open file '%s'\n", filename);
+        free(writer.data);
+        return false;
+    }
+    bool is_written = fwrite(writer.data, 1, writer.length, fp) == writer.length;
+    is_written = fclose(fp) == 0 && is_written;
+    if (!is_written) {
+        fprintf(ferr, "Error: could not write file '%s'\n", filename);
+    }
+    free(writer.data);
+    return is_written;
+}
+
+struct Loader {
+    char *data;
+    size_t length;
+    uint64_t *starts; // One bit per instruction slot, set where an instruction starts
+    size_t call_count;
+};
+
+/* Whether count records of the given size starting at offset lie inside the file */
+static bool in_file(struct Loader *loader, uint64_t offset, uint64_t count, size_t size)
+{
+    return offset % DELC_ALIGNMENT == 0 && offset <= loader->length
+        && count <= (loader->length - offset) / size;
+}
+
+static bool in_file_section(struct Loader *loader, struct DelcSection section, size_t size)
+{
+    return in_file(loader, section.offset, section.count, size);
+}
+
+/* Returns the null terminated string at offset, or NULL if it runs off the end of the file */
+static char *file_string(struct Loader *loader, uint64_t offset)
+{
+    if (!in_file(loader, offset, 0, 1)
+            || memchr(loader->data + offset, '\0', loader->length - offset) == NULL) {
+        return NULL;
+    }
+    return loader->data + offset;
+}
+
+static bool load_header(struct Loader *loader, struct DelcHeader *header, char *filename,
+        FILE *ferr)
+{
+    if (loader->length < sizeof(*header)
+            || memcmp(loader->data, DELC_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(ferr, "Error: '%s' is not a compiled del program\n", filename);
+        return false;
+    }
+    memcpy(header, loader->data, sizeof(*header));
+    if (header->version != DELC_VERSION || header->byte_order != DELC_BYTE_ORDER
+            || header->opcode_count != READ + 1) {
+        fprintf(ferr, "Error: '%s' was compiled by a different version of del\n", filename);
+        return false;
+    } else if (header->file_length != loader->length
+            || !in_file_section(loader, header->instructions, sizeof(DelValue))
+            || !in_file_section(loader, header->strings, sizeof(struct DelcString))
+            || !in_file_section(loader, header->layouts, sizeof(struct DelcLayout))
+            || !in_file_section(loader, header->const_arrays, sizeof(struct DelcConstArray))
+            || !in_file_section(loader, header->functions, sizeof(struct DelcFunction))
+            || !in_file_section(loader, header->foreign_functions,
+                sizeof(struct DelcForeignFunction))
+            || !in_file_section(loader, header->foreign_calls, sizeof(struct DelcForeignCall))) {
+        fprintf(ferr, "Error: '%s' is corrupt\n", filename);
+        return false;
+    }
+    return true;
+}
+
+static bool load_strings(struct Loader *loader, struct DelcHeader *header,
+        struct Program *program)
+{
+    struct DelcString *strings = (struct DelcString *) (loader->data + header->strings.offset);
+    program->string_pool = calloc(header->strings.count + 1, sizeof(*(program->string_pool)));
+    program->string_count = header->strings.count;
+    for (size_t i = 0; i < program->string_count; i++) {
+        if (strings[i].length == UINT64_MAX
+                || !in_file(loader, strings[i].offset, strings[i].length + 1, 1)
+                || loader->data[strings[i].offset + strings[i].length] != '\0') {
+            return false;
+        }
+        program->string_pool[i].string = loader->data + strings[i].offset;
+        program->string_pool[i].length = strings[i].length;
+        program->string_pool[i].hash = strings[i].hash;
+    }
+    return true;
+}
+
+static bool load_layouts(struct Loader *loader, struct DelcHeader *header,
+        struct Program *program)
+{
+    struct DelcLayout *layouts = (struct DelcLayout *) (loader->data + header->layouts.offset);
+    program->layouts = calloc(header->layouts.count + 1, sizeof(*(program->layouts)));
+    program->class_count = header->layouts.count;
+    for (size_t i = 0; i < program->class_count; i++) {
+        struct ClassLayout *layout = &(program->layouts[i]);
+        if (!in_file(loader, layouts[i].types, layouts[i].field_count, sizeof(Type))
+                || !in_file(loader, layouts[i].ptr_bitmap, layouts[i].field_count / 64 + 1,
+                    sizeof(uint64_t))) {
+            return false;
+        }
+        layout->name = layouts[i].name;
+        layout->field_count = layouts[i].field_count;
+        layout->types = (Type *) (loader->data + layouts[i].types);
+        layout->ptr_bitmap = (uint64_t *) (loader->data + layouts[i].ptr_bitmap);
+    }
+    return true;
+}
+
+static bool load_const_arrays(struct Loader *loader, struct DelcHeader *header,
+        struct Program *program)
+{
+    struct DelcConstArray *const_arrays =
+        (struct DelcConstArray *) (loader->data + header->const_arrays.offset);
+    program->const_arrays = calloc(header->const_arrays.count + 1,
+            sizeof(*(program->const_arrays)));
+    program->const_array_count = header->const_arrays.count;
+    for (size_t i = 0; i < program->const_array_count; i++) {
+        struct ConstArray *const_array = &(program->const_arrays[i]);
+        if (!in_file(loader, const_arrays[i].values, const_arrays[i].slots, sizeof(DelValue))) {
+            return false;
+        }
+        const_array->type = const_arrays[i].type;
+        const_array->count = const_arrays[i].count;
+        const_array->slots = const_arrays[i].slots;
+        const_array->values = (DelValue *) (loader->data + const_arrays[i].values);
+    }
+    return true;
+}
+
+/* The number of operands that follow an instruction */
+static size_t operand_count(enum Code opcode)
+{
+    switch (opcode) {
+        case PUSH:
+        case PUSH_OBJ:
+        case NEW:
+        case NEW_ARRAY_FROM_CONST:
+        case JNE:
+        case JMP:
+        case RET_STRUCT:
+        case GET_LOCAL:
+        case SET_LOCAL:
+        case GET_LOCAL_OBJ:
+        case SET_LOCAL_OBJ:
+        case DEFINE:
+        case DEFINE_OBJ:
+        case GET_HEAP:
+        case GET_HEAP_OBJ:
+        case SET_HEAP:
+        case SET_HEAP_OBJ:
+        case INIT_FIELD:
+        case INIT_FIELD_OBJ:
+        case COMPILE:
+        case PRINT_STRUCT:
+            return 1;
+        case NEW_IN_FRAME:
+            return 2;
+        case GET_ARRAY_STRUCT:
+        case SET_ARRAY_STRUCT:
+        case GET_ARRAY_SOA:
+        case SET_ARRAY_SOA:
+        case CALL:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+static bool is_start(struct Loader *loader, struct DelcHeader *header, uint64_t location)
+{
+    return location < header->instructions.count
+        && (loader->starts[location / 64] >> (location % 64) & 1);
+}
+
+/* Checks that every opcode is one the vm knows, that its operands are in the file, and that the
+ * operands indexing the program's tables or instructions are in range. Runs before the CALL
+ * pointers are filled in, so they should all still be zero. */
+static bool load_instructions(struct Loader *loader, struct DelcHeader *header,
+        struct Program *program)
+{
+    DelValue *values = program->instructions->values;
+    size_t count = header->instructions.count;
+    loader->starts = calloc(count / 64 + 1, sizeof(*(loader->starts)));
+    size_t last = 0;
+    for (size_t i = 0; i < count; i += operand_count(values[i].opcode) + 1) {
+        if ((unsigned int) values[i].opcode > READ
+                || operand_count(values[i].opcode) >= count - i) {
+            return false;
+        }
+        loader->starts[i / 64] |= UINT64_C(1) << (i % 64);
+        last = i;
+    }
+    // The vm would run off the end after anything else
+    enum Code opcode = count == 0 ? PUSH : values[last].opcode;
+    if (opcode != RET && opcode != RET_STRUCT && opcode != JMP && opcode != EXIT) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i += operand_count(values[i].opcode) + 1) {
+        switch (values[i].opcode) {
+            case NEW:
+            case NEW_IN_FRAME:
+            case PRINT_STRUCT:
+                if (values[i + 1].offset >= program->class_count) {
+                    return false;
+                }
+                break;
+            case NEW_ARRAY_FROM_CONST:
+                if (values[i + 1].offset >= program->const_array_count) {
+                    return false;
+                }
+                break;
+            case JNE:
+            case JMP:
+                if (!is_start(loader, header, values[i + 1].offset)) {
+                    return false;
+                }
+                break;
+            case CALL:
+                if (values[i + 2].pointer != 0 || values[i + 3].pointer != 0) {
+                    return false;
+                }
+                loader->call_count++;
+                break;
+            case COMPILE:
+                // Lazily compiled programs are compiled the rest of the way before being saved
+                return false;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+static bool load_functions(struct Loader *loader, struct DelcHeader *header,
+        struct Program *program)
+{
+    struct DelcFunction *functions =
+        (struct DelcFunction *) (loader->data + header->functions.offset);
+    program->functions = calloc(header->functions.count + 1, sizeof(*(program->functions)));
+    program->function_count = header->functions.count;
+    for (size_t i = 0; i < program->function_count; i++) {
+        char *name = file_string(loader, functions[i].name);
+        if (name == NULL || !is_start(loader, header, functions[i].location)) {
+            return false;
+        }
+        program->functions[i].location = functions[i].location;
+        program->functions[i].name = name;
+    }
+    return true;
+}
+
+static bool same_signature(struct ProgramForeignFunction *pff, struct ForeignFunction *ff)
+{
+    if (pff->is_yielding != ff->is_yielding || pff->return_type != ff->return_type
+            || pff->arg_count != ff->arg_types->length) {
+        return false;
+    }
+    size_t i = 0;
+    Type *type = NULL;
+    linkedlist_vforeach(type, ff->arg_types) {
+        if (pff->arg_types[i++] != *type) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Matches each foreign function the program calls with the one registered under its name */
+static bool load_foreign_functions(struct Globals *globals, struct Loader *loader,
+        struct DelcHeader *header, struct Program *program, struct ForeignFunction **registered)
+{
+    struct DelcForeignFunction *functions =
+        (struct DelcForeignFunction *) (loader->data + header->foreign_functions.offset);
+    program->foreign_function_count = header->foreign_functions.count;
+    for (size_t i = 0; i < program->foreign_function_count; i++) {
+        struct ProgramForeignFunction *pff = &(program->foreign_functions[i]);
+        pff->name = file_string(loader, functions[i].name);
+        if (pff->name == NULL
+                || !in_file(loader, functions[i].arg_types, functions[i].arg_count, sizeof(Type))) {
+            fprintf(globals->ferr, "Error: '%s' is corrupt\n", globals->file->filename);
+            return false;
+        }
+        pff->is_yielding = functions[i].is_yielding;
+        pff->return_type = functions[i].return_type;
+        pff->arg_count = functions[i].arg_count;
+        pff->arg_types = (Type *) (loader->data + functions[i].arg_types);
+        Symbol symbol = add_symbol(globals, pff->name, strlen(pff->name));
+        registered[i] = ffi_lookup_ff(globals, symbol);
+        if (registered[i] == NULL) {
+            fprintf(globals->ferr, "Error: foreign function '%s' is not registered\n", pff->name);
+            return false;
+        } else if (!same_signature(pff, registered[i])) {
+            fprintf(globals->ferr, "Error: foreign function '%s' was registered with a different "
+                    "signature than the program was compiled with\n", pff->name);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Fills the registered functions' context and function pointers back in to each CALL, which
+ * should each be filled in exactly once */
+static bool load_foreign_calls(struct Loader *loader, struct DelcHeader *header,
+        struct Program *program, struct ForeignFunction **registered)
+{
+    struct DelcForeignCall *calls =
+        (struct DelcForeignCall *) (loader->data + header->foreign_calls.offset);
+    DelValue *values = program->instructions->values;
+    program->foreign_call_count = header->foreign_calls.count;
+    for (size_t i = 0; i < program->foreign_call_count; i++) {
+        uint64_t location = calls[i].location;
+        if (location < 2 || !is_start(loader, header, location - 2)
+                || values[location - 2].opcode != CALL || values[location + 1].pointer != 0
+                || calls[i].function >= program->foreign_function_count) {
+            return false;
+        }
+        struct ForeignFunction *ff = registered[calls[i].function];
+        values[location].pointer = (intptr_t) ff->context;
+        values[location + 1].pointer = (intptr_t) ff->function;
+        program->foreign_calls[i].location = location;
+        program->foreign_calls[i].function = calls[i].function;
+    }
+    return program->foreign_call_count == loader->call_count;
+}
+
+static struct Program *load_program(struct Globals *globals, struct Loader *loader)
+{
+    char *filename = globals->file->filename;
+    struct DelcHeader header;
+    if (!load_header(loader, &header, filename, globals->ferr)) {
+        return NULL;
+    }
+    struct Program *program = calloc(1, sizeof(*program));
+    program->mapping = loader->data;
+    program->mapping_length = loader->length;
+    struct Vector *instructions = malloc(sizeof(*instructions));
+    instructions->length = header.instructions.count;
+    instructions->capacity = header.instructions.count;
+    instructions->min_capacity = header.instructions.count;
+    instructions->max_capacity = header.instructions.count;
+    instructions->values = (DelValue *) (loader->data + header.instructions.offset);
+    program->instructions = instructions;
+    program->foreign_functions = calloc(header.foreign_functions.count + 1,
+            sizeof(*(program->foreign_functions)));
+    program->foreign_calls = calloc(header.foreign_calls.count + 1,
+            sizeof(*(program->foreign_calls)));
+    struct ForeignFunction **registered = calloc(header.foreign_functions.count + 1,
+            sizeof(*registered));
+    bool is_loaded = load_foreign_functions(globals, loader, &header, program, registered);
+    if (is_loaded && !(load_strings(loader, &header, program)
+                && load_layouts(loader, &header, program)
+                && load_const_arrays(loader, &header, program)
+                && load_instructions(loader, &header, program)
+                && load_functions(loader, &header, program)
+                && load_foreign_calls(loader, &header, program, registered))) {
+        fprintf(globals->ferr, "Error: '%s' is corrupt\n", filename);
+        is_loaded = false;
+    }
+    free(registered);
+    free(loader->starts);
+    if (!is_loaded) {
+        // program_load unmaps the file
+        program->mapping = NULL;
+        program_unmap(program);
+        return NULL;
+    }
+    return program;
+}
+
+struct Program *program_load(struct Globals *globals, char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        fprintf(globals->ferr, "Error: could not open file '%s'\n", filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(globals->ferr, "Error: '%s' is not a compiled del program\n", filename);
+        close(fd);
+        return NULL;
+    }
+    struct Loader loader = { NULL, st.st_size, NULL, 0 };
+    // Private and writable, so the CALL pointers can be filled in without touching the file
+    loader.data = mmap(NULL, loader.length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (loader.data == MAP_FAILED) {
+        fprintf(globals->ferr, "Error: could not read file '%s'\n", filename);
+        return NULL;
+    }
+    struct FileContext file = { filename, loader.length, NULL, false };
+    struct FileContext *old_file = globals->file;
+    globals->file = &file;
+    struct Program *program = load_program(globals, &loader);
+    globals->file = old_file;
+    if (program == NULL) {
+        munmap(loader.data, loader.length);
+    }
+    return program;
+}
+
+/* Frees a program that was loaded from a file. Everything but the tables of records points into
+ * the mapping. */
+void program_unmap(struct Program *program)
+{
+    free(program->instructions);
+    free(program->string_pool);
+    free(program->layouts);
+    free(program->const_arrays);
+    free(program->functions);
+    free(program->foreign_functions);
+    free(program->foreign_calls);
+    if (program->mapping != NULL) {
+        munmap(program->mapping, program->mapping_length);
+    }
+    free(program);
+}
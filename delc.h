@@ -0,0 +1,11 @@
+#ifndef DELC_H
+#define DELC_H
+
+#include "common.h"
+
+/* Compiled programs saved to and loaded from .delc files, see delc.c for the format */
+bool program_save(struct Program *program, char *filename, FILE *ferr);
+struct Program *program_load(struct Globals *globals, char *filename);
+void program_unmap(struct Program *program);
+
+#endif
@@ -17,7 +17,7 @@ static void get_bad_line(struct Globals *globals, char *text, char *underline, s
     // Start / end indices
     int line_end = line_start;
     // char *c = globals->file->input + line_start;
-    for (char *c = globals->file->input + line_start; *c != '\n'; c++) {
+    for (char *c = globals->file->input + line_start; *c != '\n' && *c != '\0'; c++) {
         line_end++;
     }
     int length = line_end - line_start;
@@ -51,29 +51,29 @@ void error_parser(struct Globals *globals, const char *message, ...)
     va_start(args, message);
     vsnprintf(errormsg, ERROR_MESSAGE_MAX, message, args);
     va_end(args);
-    struct Token *token = globals->parser->value;
+    // Errors at the end of the input point at the last token
+    Tokens *tokens = globals->lexer->tokens;
+    if (tokens->length == 0) {
+        snprintf(globals->error, ERROR_MESSAGE_MAX, "%s\n", errormsg);
+        return;
+    }
+    struct Token *token = globals->parser != NULL
+        ? globals->parser
+        : &(tokens->values[tokens->length - 1]);
     char text[PRINTF_FUDGE_FACTOR_LENGTH] = {0};
     char underline[PRINTF_FUDGE_FACTOR_LENGTH] = {0};
     get_bad_line(globals, text, underline, token);
-    char *msg = globals->file->filename
-        ?  "Error in file '%s' at line %d, column %d\n"
-        "%5d | %s\n        %s\n"
-        "%s\n"
-        : "Error at line %d, column %d\n"
-        "%5d | %s\n        %s\n"
-        "%s\n";
-    snprintf(
-        globals->error,
-        ERROR_MESSAGE_MAX,
-        msg,
-        globals->file->filename,
-        token->line_number,
-        token->column_number,
-        token->line_number,
-        text,
-        underline,
-        errormsg
-    );
+    if (globals->file->filename) {
+        snprintf(globals->error, ERROR_MESSAGE_MAX,
+                "Error in file '%s' at line %d, column %d\n%5d | %s\n        %s\n%s\n",
+                globals->file->filename, token->line_number, token->column_number,
+                token->line_number, text, underline, errormsg);
+    } else {
+        snprintf(globals->error, ERROR_MESSAGE_MAX,
+                "Error at line %d, column %d\n%5d | %s\n        %s\n%s\n",
+                token->line_number, token->column_number,
+                token->line_number, text, underline, errormsg);
+    }
 }
 
 void error_print(struct Globals *globals)
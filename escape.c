@@ -0,0 +1,283 @@
+#include "common.h"
+#include "allocator.h"
+#include "linkedlist.h"
+#include "ast.h"
+#include "typecheck.h"
+#include "compiler.h"
+#include "heap_ptr.h"
+#include "escape.h"
+
+/* Objects with more fields than this stay whole (in the frame) rather than using up a local
+ * per field */
+#define SCALAR_REPLACEMENT_FIELDS_MAX 8
+
+/* A local that holds an object that might not escape */
+struct Candidate {
+    struct Definition *def;
+    struct Constructor *constructor;
+    bool escapes;
+};
+
+struct EscapeContext {
+    size_t length;
+    size_t capacity;
+    struct Candidate *candidates;
+};
+
+static void escape_value(struct EscapeContext *context, struct Value *val);
+static void escape_statements(struct EscapeContext *context, Statements *stmts);
+
+static void add_candidate(struct EscapeContext *context, struct SetLocal *set)
+{
+    if (context->length == context->capacity) {
+        context->capacity = context->capacity == 0 ? 8 : 2 * context->capacity;
+        context->candidates = realloc(context->candidates,
+                context->capacity * sizeof(*(context->candidates)));
+    }
+    struct Candidate *candidate = &(context->candidates[context->length++]);
+    candidate->def = set->def;
+    candidate->constructor = set->expr->constructor;
+    candidate->escapes = false;
+}
+
+static void escapes(struct EscapeContext *context, struct Definition *def)
+{
+    for (size_t i = 0; i < context->length; i++) {
+        if (context->candidates[i].def == def) {
+            context->candidates[i].escapes = true;
+            return;
+        }
+    }
+}
+
+static void escape_values(struct EscapeContext *context, Values *vals)
+{
+    if (vals == NULL) return;
+    struct Value *val = NULL;
+    linkedlist_vforeach(val, vals) {
+        escape_value(context, val);
+    }
+}
+
+/* Getting or setting a property of a local doesn't let the local's object escape, but using
+ * the local for anything else does */
+static void escape_accessor(struct EscapeContext *context, struct Value *accessor)
+{
+    if (accessor->vtype != VTYPE_GET_LOCAL) {
+        escape_value(context, accessor);
+    }
+}
+
+static void escape_value(struct EscapeContext *context, struct Value *val)
+{
+    if (val == NULL) return;
+    switch (val->vtype) {
+        case VTYPE_STRING:
+        case VTYPE_BYTE:
+        case VTYPE_INT:
+        case VTYPE_FLOAT:
+        case VTYPE_BOOL:
+        case VTYPE_NULL:
+            break;
+        case VTYPE_EXPR:
+            escape_value(context, val->expr->val1);
+            escape_value(context, val->expr->val2);
+            break;
+        case VTYPE_ARRAY_LITERAL:
+            escape_values(context, val->array);
+            break;
+        case VTYPE_FUNCALL:
+        case VTYPE_BUILTIN_FUNCALL:
+            escape_values(context, val->funcall->args);
+            break;
+        case VTYPE_CONSTRUCTOR:
+        case VTYPE_BUILTIN_CONSTRUCTOR:
+            escape_values(context, val->constructor->funcall->args);
+            break;
+        case VTYPE_GET_LOCAL:
+            escapes(context, val->get_local);
+            break;
+        case VTYPE_GET_PROPERTY:
+            escape_accessor(context, val->get_property->accessor);
+            break;
+        case VTYPE_INDEX:
+            escape_value(context, val->get_property->accessor);
+            escape_value(context, val->get_property->index);
+            break;
+        case VTYPE_CAST:
+            escape_value(context, val->cast->value);
+            break;
+    }
+}
+
+static void escape_statement(struct EscapeContext *context, struct Statement *stmt)
+{
+    if (stmt == NULL) return;
+    switch (stmt->type) {
+        case STMT_LET:
+        case STMT_BREAK:
+        case STMT_CONTINUE:
+            break;
+        case STMT_SET_LOCAL:
+            escape_value(context, stmt->set_local->expr);
+            if (!stmt->set_local->is_define) {
+                escapes(context, stmt->set_local->def);
+            }
+            break;
+        case STMT_SET_PROPERTY:
+            escape_accessor(context, stmt->set_property->access->accessor);
+            escape_value(context, stmt->set_property->expr);
+            break;
+        case STMT_SET_INDEX:
+            escape_value(context, stmt->set_property->access->accessor);
+            escape_value(context, stmt->set_property->access->index);
+            escape_value(context, stmt->set_property->expr);
+            break;
+        case STMT_IF:
+            escape_value(context, stmt->if_stmt->condition);
+            escape_statements(context, stmt->if_stmt->if_stmts);
+            escape_statements(context, stmt->if_stmt->else_stmts);
+            break;
+        case STMT_WHILE:
+            escape_value(context, stmt->while_stmt->condition);
+            escape_statements(context, stmt->while_stmt->stmts);
+            break;
+        case STMT_FOR:
+            escape_statement(context, stmt->for_stmt->init);
+            escape_value(context, stmt->for_stmt->condition);
+            escape_statement(context, stmt->for_stmt->increment);
+            escape_statements(context, stmt->for_stmt->stmts);
+            break;
+        case STMT_FOREACH:
+            escape_value(context, stmt->for_each->condition);
+            escape_statements(context, stmt->for_each->stmts);
+            break;
+        case STMT_FUNCALL:
+        case STMT_BUILTIN_FUNCALL:
+            escape_values(context, stmt->funcall->args);
+            break;
+        case STMT_RETURN:
+        case STMT_INC:
+        case STMT_DEC:
+            escape_value(context, stmt->val);
+            break;
+    }
+}
+
+static void escape_statements(struct EscapeContext *context, Statements *stmts)
+{
+    if (stmts == NULL) return;
+    linkedlist_foreach(lnode, stmts->head) {
+        escape_statement(context, lnode->value);
+    }
+}
+
+/* Every `let x = new Class(...)` in the function is a candidate until proven otherwise */
+static void find_candidates(struct EscapeContext *context, Statements *stmts);
+
+static void find_candidate(struct EscapeContext *context, struct Statement *stmt)
+{
+    if (stmt == NULL) return;
+    switch (stmt->type) {
+        case STMT_SET_LOCAL:
+            // Structs are never allocated in the first place
+            if (stmt->set_local->is_define && stmt->set_local->expr->vtype == VTYPE_CONSTRUCTOR
+                    && !is_struct(stmt->set_local->expr->type)) {
+                add_candidate(context, stmt->set_local);
+            }
+            break;
+        case STMT_IF:
+            find_candidates(context, stmt->if_stmt->if_stmts);
+            find_candidates(context, stmt->if_stmt->else_stmts);
+            break;
+        case STMT_WHILE:
+            find_candidates(context, stmt->while_stmt->stmts);
+            break;
+        case STMT_FOR:
+            find_candidate(context, stmt->for_stmt->init);
+            find_candidates(context, stmt->for_stmt->stmts);
+            break;
+        case STMT_FOREACH:
+            find_candidates(context, stmt->for_each->stmts);
+            break;
+        default:
+            break;
+    }
+}
+
+static void find_candidates(struct EscapeContext *context, Statements *stmts)
+{
+    if (stmts == NULL) return;
+    linkedlist_foreach(lnode, stmts->head) {
+        find_candidate(context, lnode->value);
+    }
+}
+
+/* Give each field of the object its own local, past any local the typechecker handed out. The
+ * compiler then turns property accesses into plain local accesses, and there's no object. */
+static void replace_scalars(struct Globals *globals, struct FunDef *fundef, struct Class *cls,
+        struct Definition *def)
+{
+    def->field_offsets = allocator_malloc(globals->allocator,
+            cls->definitions->length * sizeof(*(def->field_offsets)));
+    size_t i = 0;
+    linkedlist_foreach(lnode, cls->definitions->head) {
+        struct Definition *field = lnode->value;
+        def->field_offsets[i++] = is_object(field->type)
+            ? fundef->max_objcount++
+            : fundef->max_varcount++;
+    }
+}
+
+/* Each allocation site that doesn't escape gets replaced by locals if it's small, and otherwise
+ * gets its own spot in the frame. Either way an allocation inside of a loop can reuse the same
+ * space on every iteration, since the object from the last iteration was only reachable through
+ * the variable being redefined. */
+static void escape_fundef(struct Globals *globals, struct EscapeContext *context,
+        struct FunDef *fundef)
+{
+    context->length = 0;
+    find_candidates(context, fundef->stmts);
+    if (context->length == 0) {
+        return;
+    }
+    escape_statements(context, fundef->stmts);
+    size_t frame_offset = 0;
+    for (size_t i = 0; i < context->length; i++) {
+        struct Candidate *candidate = &(context->candidates[i]);
+        if (candidate->escapes) {
+            continue;
+        }
+        struct Class *cls = lookup_class(globals->cc->class_table, candidate->def->type);
+        size_t field_count = cls->definitions == NULL ? 0 : cls->definitions->length;
+        // A struct field would need a local per field of the struct, so those stay whole
+        bool has_struct_fields = cls->slot_count != field_count;
+        if (field_count > 0 && field_count <= SCALAR_REPLACEMENT_FIELDS_MAX && !has_struct_fields) {
+            replace_scalars(globals, fundef, cls, candidate->def);
+            continue;
+        }
+        candidate->constructor->in_frame = true;
+        candidate->constructor->frame_offset = frame_offset;
+        frame_offset += OBJECT_HEADER_SLOTS + cls->slot_count;
+    }
+}
+
+// For a function that's compiled lazily, the first time it's called
+void escape_function(struct Globals *globals, struct FunDef *fundef)
+{
+    struct EscapeContext context = { 0, 0, NULL };
+    escape_fundef(globals, &context, fundef);
+    free(context.candidates);
+}
+
+void escape_analysis(struct Globals *globals, TopLevelDecls *tlds)
+{
+    struct EscapeContext context = { 0, 0, NULL };
+    linkedlist_foreach(lnode, tlds->head) {
+        struct TopLevelDecl *tld = lnode->value;
+        if (tld->type == TLD_TYPE_FUNDEF && !tld->fundef->is_foreign) {
+            escape_fundef(globals, &context, tld->fundef);
+        }
+    }
+    free(context.candidates);
+}
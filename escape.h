@@ -0,0 +1,19 @@
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+#include "common.h"
+#include "ast.h"
+
+/* Escape analysis: finds objects that can be allocated in their function's frame rather than
+ * on the heap, or that don't need to be allocated at all because each of their fields can just
+ * be a local (scalar replacement). Runs over the typed ast, between the typechecker and the
+ * compiler.
+ *
+ * An object doesn't escape if it's created by a `let x = new Class(...)` and x is never used
+ * for anything other than getting or setting its properties. Any other use (being returned,
+ * passed to a function, stored in a property / array / other variable, or x being reassigned)
+ * lets the object outlive the frame, so it stays on the heap. */
+void escape_analysis(struct Globals *globals, TopLevelDecls *tlds);
+void escape_function(struct Globals *globals, struct FunDef *fundef);
+
+#endif
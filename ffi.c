@@ -4,12 +4,44 @@
 #include "linkedlist.h"
 #include "ffi.h"
 
-struct ForeignFunction *ffi_lookup_ff(struct Globals *globals, Symbol symbol)
+static inline size_t bucket_index(Symbol symbol, size_t capacity)
+{
+    return ((symbol * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & (capacity - 1);
+}
+
+static void insert_bucket(struct Globals *globals, struct ForeignFunction *ff)
+{
+    size_t capacity = globals->foreign_function_bucket_capacity;
+    size_t i = bucket_index(ff->symbol, capacity);
+    while (globals->foreign_function_buckets[i] != NULL) {
+        i = (i + 1) & (capacity - 1);
+    }
+    globals->foreign_function_buckets[i] = ff;
+}
+
+// Old tables just stay in the allocator, which frees them along with everything else
+static void grow_buckets(struct Globals *globals)
 {
+    size_t capacity = globals->foreign_function_bucket_capacity;
+    globals->foreign_function_bucket_capacity = capacity == 0 ? 16 : 2 * capacity;
+    globals->foreign_function_buckets = allocator_malloc(globals->allocator,
+            globals->foreign_function_bucket_capacity * sizeof(struct ForeignFunction *));
     struct ForeignFunction *ff = NULL;
     linkedlist_vforeach(ff, globals->foreign_function_table) {
-        if (ff->symbol == symbol) {
-            return ff;
+        insert_bucket(globals, ff);
+    }
+}
+
+struct ForeignFunction *ffi_lookup_ff(struct Globals *globals, Symbol symbol)
+{
+    size_t capacity = globals->foreign_function_bucket_capacity;
+    if (capacity == 0) {
+        return NULL;
+    }
+    size_t i = bucket_index(symbol, capacity);
+    for (; globals->foreign_function_buckets[i] != NULL; i = (i + 1) & (capacity - 1)) {
+        if (globals->foreign_function_buckets[i]->symbol == symbol) {
+            return globals->foreign_function_buckets[i];
         }
     }
     return NULL;
@@ -45,22 +77,20 @@ Type convert_ffi_type(enum DelForeignType dtype)
     return type;
 }
 
-static void validate_ffs(struct Globals *globals, char *ff_name)
+// Names are interned, so two functions with the same name have the same symbol
+static void validate_ffs(struct Globals *globals, Symbol symbol)
 {
-    struct ForeignFunction *ff = NULL;
-    linkedlist_vforeach(ff, globals->foreign_function_table) {
-        if (strcmp(ff->function_name, ff_name) == 0) {
-            printf("Error: Cannot register the same function twice\n");
-            assert(false);
-        }
+    if (ffi_lookup_ff(globals, symbol) != NULL) {
+        printf("Error: Cannot register the same function twice\n");
+        assert(false);
     }
 }
 
 void ffi_register_function(struct Globals *globals, void *context, bool is_yielding,
         DelForeignFunctionCall function, char *ff_name, enum DelForeignType rettype, Types *types)
 {
-    validate_ffs(globals, ff_name);
     Symbol symbol = add_symbol(globals, ff_name, strlen(ff_name));
+    validate_ffs(globals, symbol);
     struct ForeignFunction *ff = allocator_malloc(globals->allocator, sizeof(*ff));
     ff->symbol = symbol;
     ff->function_name = ff_name;
@@ -70,13 +100,20 @@ void ffi_register_function(struct Globals *globals, void *context, bool is_yield
     ff->context       = context;
     ff->function      = function;
     linkedlist_append(globals->foreign_function_table, ff);
+    if (2 * globals->foreign_function_table->length > globals->foreign_function_bucket_capacity) {
+        grow_buckets(globals);
+    } else {
+        insert_bucket(globals, ff);
+    }
 }
 
 bool ffi_register_functions(struct Globals *globals)
 { 
     struct ForeignFunction *ff = NULL;
+    size_t index = 0;
     linkedlist_vforeach(ff, globals->foreign_function_table) {
         struct ForeignFunctionBody *ffb = allocator_malloc(globals->allocator, sizeof(*ffb));
+        ffb->index = index++;
         ffb->is_yielding = ff->is_yielding;
         ffb->context = ff->context;
         ffb->function = ff->function;
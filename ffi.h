@@ -5,6 +5,7 @@
 #include "del.h"
 
 struct ForeignFunctionBody {
+    size_t index; // Order the function was registered in
     bool is_yielding;
     void *context;
     union DelForeignValue (*function)(union DelForeignValue *, void *);
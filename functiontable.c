@@ -3,66 +3,104 @@
 #include "functiontable.h"
 #include "printers.h"
 
-struct FunctionCallTable *new_ft(struct Globals *globals, uint64_t function)
+#define FT_CAPACITY_INIT 16
+
+static struct FunctionCallTableNode *new_nodes(struct Globals *globals, size_t capacity)
+{
+    // The allocator hands out zeroed memory, so every bucket starts out empty
+    return allocator_malloc(globals->allocator, capacity * sizeof(struct FunctionCallTableNode));
+}
+
+struct FunctionCallTable *new_ft(struct Globals *globals)
 {
     struct FunctionCallTable *ft = allocator_malloc(globals->allocator, sizeof(struct FunctionCallTable));
-    ft->node = allocator_malloc(globals->allocator, sizeof(struct FunctionCallTableNode));
-    ft->node->function = function;
-    ft->node->location = 0;
-    ft->node->callsites = linkedlist_new(globals->allocator);
-    ft->left = NULL;
-    ft->right = NULL;
+    ft->length = 0;
+    ft->capacity = FT_CAPACITY_INIT;
+    ft->nodes = new_nodes(globals, ft->capacity);
     return ft;
 }
 
-static inline struct FunctionCallTableNode *add_function_internal(struct Globals *globals, struct FunctionCallTable *ft, 
-       Symbol function, uint64_t loc, int noloc)
+static inline size_t ft_index(Symbol function, size_t capacity)
 {
-    int from_left = 0;
-    struct FunctionCallTable *prev = NULL;
-    for (;;) {
-        if (ft == NULL) {
-            ft = new_ft(globals, function);
-            if (!noloc) ft->node->location = loc;
-            if (from_left) {
-                prev->left = ft;
-            } else {
-                prev->right = ft;
-            }
-            break;
-        } else if (function < ft->node->function) {
-            from_left = 1;
-            prev = ft;
-            ft = ft->left;
-        } else if (function > ft->node->function) {
-            from_left = 0;
-            prev = ft;
-            ft = ft->right;
-        } else /* if (function == ft->node->function) */ {
-            /* function exists, update location if applicable */
-            if (!noloc) ft->node->location = loc;
-            break;
-        }
+    return ((function * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & (capacity - 1);
+}
+
+static struct FunctionCallTableNode *find_bucket(struct FunctionCallTableNode *nodes, size_t capacity,
+        Symbol function)
+{
+    size_t i = ft_index(function, capacity);
+    while (nodes[i].function != 0 && nodes[i].function != function) {
+        i = (i + 1) & (capacity - 1);
     }
-    return ft->node;
+    return &(nodes[i]);
 }
 
-// Adds function to table, *does not* set the location of the function call
-#define add_function_noloc(globals, ft, function) \
-    add_function_internal(globals, ft, function, 0, 1)
+// Returns NULL if function isn't in the table
+struct FunctionCallTableNode *lookup_ft_node(struct FunctionCallTable *ft, Symbol function)
+{
+    struct FunctionCallTableNode *node = find_bucket(ft->nodes, ft->capacity, function);
+    return node->function == 0 ? NULL : node;
+}
+
+// The old buckets stay in the allocator until the compiler is freed
+static void grow_ft(struct Globals *globals, struct FunctionCallTable *ft)
+{
+    size_t capacity = 2 * ft->capacity;
+    struct FunctionCallTableNode *nodes = new_nodes(globals, capacity);
+    ft_foreach(node, ft) {
+        *find_bucket(nodes, capacity, node->function) = *node;
+    }
+    ft->capacity = capacity;
+    ft->nodes = nodes;
+}
+
+static struct FunctionCallTableNode *add_function(struct Globals *globals, struct FunctionCallTable *ft,
+        Symbol function)
+{
+    struct FunctionCallTableNode *node = find_bucket(ft->nodes, ft->capacity, function);
+    if (node->function != 0) {
+        return node;
+    } else if (2 * (ft->length + 1) > ft->capacity) {
+        grow_ft(globals, ft);
+        node = find_bucket(ft->nodes, ft->capacity, function);
+    }
+    ft->length++;
+    node->function = function;
+    node->is_defined = false;
+    node->location = 0;
+    node->callsites = linkedlist_new(globals->allocator);
+    return node;
+}
 
 // Adds function to table, *does* set the location of the function call
 struct FunctionCallTableNode *add_ft_node(struct Globals *globals, struct FunctionCallTable *ft, Symbol function, uint64_t loc)
 {
-    return add_function_internal(globals, ft, function, loc, 0);
+    struct FunctionCallTableNode *node = add_function(globals, ft, function);
+    node->is_defined = true;
+    node->location = loc;
+    return node;
 }
 
+// Adds function to table, *does not* set the location of the function call
 void add_callsite(struct Globals *globals, struct FunctionCallTable *ft, Symbol function, uint64_t callsite)
 {
-    struct FunctionCallTableNode *node = add_function_noloc(globals, ft, function);
+    struct FunctionCallTableNode *node = add_function(globals, ft, function);
     uint64_t *hcallsite = allocator_malloc(globals->allocator, sizeof(uint64_t));
     *hcallsite = callsite;
     linkedlist_append(node->callsites, hcallsite);
 }
 
-#undef add_function_noloc
+/* Adds everything in from to ft, for code that was compiled on its own and then moved offset
+ * instructions along */
+void merge_ft(struct Globals *globals, struct FunctionCallTable *ft, struct FunctionCallTable *from,
+        uint64_t offset)
+{
+    ft_foreach(node, from) {
+        if (node->is_defined) {
+            add_ft_node(globals, ft, node->function, node->location + offset);
+        }
+        linkedlist_foreach(lnode, node->callsites->head) {
+            add_callsite(globals, ft, node->function, *((uint64_t *) lnode->value) + offset);
+        }
+    }
+}
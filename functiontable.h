@@ -8,23 +8,32 @@
  * until after it is compiled, we'll need to walk through this structure after
  * the initial compilation to fill in all of the callsites.
  *
- * Using a binary tree to store this information.
+ * Using an open addressed hash table keyed by the function's symbol, kept at most half full.
+ * Function symbols are handed out in order, so a binary tree of them degenerates into a list.
  */
 struct FunctionCallTable {
-    struct FunctionCallTableNode *node;
-    struct FunctionCallTable *left;
-    struct FunctionCallTable *right;
+    size_t length;
+    size_t capacity;
+    struct FunctionCallTableNode *nodes; // function is 0 for an empty bucket
 };
 
 struct FunctionCallTableNode {
     Symbol function;
+    bool is_defined; // Whether location has been set yet
     uint64_t location;
     struct LinkedList *callsites;
 };
 
-struct FunctionCallTable *new_ft(struct Globals *globals, uint64_t function);
+struct FunctionCallTable *new_ft(struct Globals *globals);
+struct FunctionCallTableNode *lookup_ft_node(struct FunctionCallTable *ft, Symbol function);
 struct FunctionCallTableNode *add_ft_node(struct Globals *globals, struct FunctionCallTable *ft, Symbol function,
         uint64_t loc);
 void add_callsite(struct Globals *globals, struct FunctionCallTable *ft, Symbol function, uint64_t callsite);
+void merge_ft(struct Globals *globals, struct FunctionCallTable *ft, struct FunctionCallTable *from,
+        uint64_t offset);
+
+#define ft_foreach(node, ft) \
+    for (struct FunctionCallTableNode *node = (ft)->nodes; node != (ft)->nodes + (ft)->capacity; node++) \
+        if (node->function != 0)
 
 #endif
@@ -1,67 +1,254 @@
-#include "allocator.h"
-#include "linkedlist.h"
+#include <time.h>
+#include "common.h"
 #include "heap_ptr.h"
+#include "heap.h"
 #include "gc.h"
 
-/*
-struct PointerRemap {
-    size_t old_ptr;
-    size_t new_ptr;
-};
+static void list_push(struct PointerList *list, HeapPointer ptr)
+{
+    if (list->length == list->capacity) {
+        list->capacity = list->capacity == 0 ? 64 : 2 * list->capacity;
+        list->values = realloc(list->values, list->capacity * sizeof(*(list->values)));
+    }
+    list->values[list->length++] = ptr;
+}
 
-typedef struct LinkedList PointerRemaps;
+static inline bool is_forwarded(struct GarbageCollector *gc, size_t location)
+{
+    return (gc->forwarded[location / 64] >> (location % 64)) & 1;
+}
 
-struct GarbageCollector {
-    Allocator allocator;
-    size_t current_loc;
-    struct LinkedListNode *next_remap;
-    PointerRemaps *map;
-};
-*/
+static inline void set_forwarded(struct GarbageCollector *gc, size_t location)
+{
+    gc->forwarded[location / 64] |= UINT64_C(1) << (location % 64);
+}
 
-void gc_init(struct GarbageCollector *gc)
+static inline HeapPointer relocate(HeapPointer ptr, size_t location)
 {
-    gc->allocator = allocator_new();
-    gc->current_loc = 0;
-    gc->next_remap = NULL;
-    gc->map = linkedlist_new(gc->allocator);
+    return (ptr & ~LOCATION_MASK) | location;
 }
 
-void gc_free(struct GarbageCollector *gc)
+/* The heap that objects are scanned in once they've been reached */
+static inline struct Heap *scan_heap(struct GarbageCollector *gc)
 {
-    allocator_freeall(gc->allocator);
+#if GC_NONMOVING
+    return gc->from;
+#else
+    return &(gc->to);
+#endif
 }
 
-void gc_remap(struct GarbageCollector *gc, size_t old_ptr)
+/* Copy the value ptr points to into to-space, unless that already happened, and return the
+ * pointer to the copy. In non-moving mode this just marks it and returns the same pointer. */
+static HeapPointer gc_forward(struct GarbageCollector *gc, HeapPointer ptr)
 {
-    size_t old_count = get_count(old_ptr);
-    HeapPointer new_ptr = gc->current_loc;
-    set_count_no_check(&new_ptr, old_count);
+    if (ptr == 0) {
+        return 0;
+    } else if (is_large_ptr(ptr)) {
+        // Large objects stay where they are, we just need to remember that they're live
+        struct LargeObject *obj = &(scan_heap(gc)->large.objects[get_location(ptr)]);
+        if (!obj->marked) {
+            obj->marked = true;
+            if (!is_array_ptr(ptr) || is_array_of_objects(ptr)) list_push(&(gc->worklist), ptr);
+        }
+        return ptr;
+    } else if (is_frame_ptr(ptr)) {
+        DelValue *header = &(gc->frame_objs->values[get_location(ptr)]);
+        if (!(header->offset & GC_MARK_MASK)) {
+            header->offset |= GC_MARK_MASK;
+            list_push(&(gc->frames), ptr);
+            list_push(&(gc->worklist), ptr);
+        }
+        return ptr;
+    }
+    size_t location = get_location(ptr);
+#if GC_NONMOVING
+    if (!is_forwarded(gc, location)) {
+        set_forwarded(gc, location);
+        if (!is_array_ptr(ptr) || is_array_of_objects(ptr)) {
+            list_push(&(gc->worklist), ptr);
+        }
+    }
+    return ptr;
+#else
+    DelValue *old = &(gc->from->values[location]);
+    if (is_forwarded(gc, location)) {
+        return relocate(ptr, old->offset);
+    }
+    size_t slots = get_slots(ptr);
+    size_t new_location = heap_alloc(&(gc->to), slots);
+    memcpy(&(gc->to.values[new_location]), old, IN_BYTES(slots));
+    set_forwarded(gc, location);
+    old->offset = new_location;
+    HeapPointer new_ptr = relocate(ptr, new_location);
+    if (!is_array_ptr(ptr) || is_array_of_objects(ptr)) {
+        list_push(&(gc->worklist), new_ptr);
+    }
+    return new_ptr;
+#endif
+}
 
-    struct PointerRemap *remap = allocator_malloc(gc->allocator, sizeof(*remap));
-    remap->old_ptr = old_ptr;
-    remap->new_ptr = new_ptr;
-    linkedlist_append(gc->map, remap);
-    gc->current_loc += old_count;
+/* Forward every pointer held by an object that has already been copied */
+static void gc_scan(struct GarbageCollector *gc, HeapPointer ptr)
+{
+    DelValue *values = is_frame_ptr(ptr)
+        ? &(gc->frame_objs->values[get_location(ptr)])
+        : heap_values(scan_heap(gc), ptr);
+    if (is_array_ptr(ptr)) {
+        size_t count = heap_count(scan_heap(gc), ptr);
+        for (size_t i = 0; i < count; i++) {
+            values[i].offset = gc_forward(gc, values[i].offset);
+        }
+    } else {
+        size_t class_id = values[0].offset & ~GC_MARK_MASK;
+        struct ClassLayout *layout = &(gc->layouts[class_id]);
+        if (!is_frame_ptr(ptr)) {
+            gc->from->stats->objects_live[class_id]++;
+        }
+        for (size_t i = 0; i < layout->field_count; i++) {
+            if (layout_is_ptr(layout, i)) {
+                DelValue *field = &values[OBJECT_HEADER_SLOTS + i];
+                field->offset = gc_forward(gc, field->offset);
+            }
+        }
+    }
 }
 
-void print_remap(struct GarbageCollector *gc)
+/* Forward everything reachable from the roots, then everything reachable from that */
+static void gc_trace(struct GarbageCollector *gc, struct Stack *stack_obj,
+        struct StackFrames *sfs_obj)
 {
-    printf("{\n");
-    linkedlist_foreach(lnode, gc->map->head) {
-        if (lnode != gc->map->head) printf(",\n");
-        struct PointerRemap *map = lnode->value;
-        printf("%lu -> %lu", get_location(map->old_ptr), get_location(map->new_ptr));
+    gc->worklist = (struct PointerList) { 0, 0, NULL };
+    gc->frames = (struct PointerList) { 0, 0, NULL };
+    for (size_t i = 0; i < stack_obj->offset; i++) {
+        stack_obj->values[i].offset = gc_forward(gc, stack_obj->values[i].offset);
+    }
+    for (size_t i = 0; i < sfs_obj->index; i++) {
+        sfs_obj->values[i].offset = gc_forward(gc, sfs_obj->values[i].offset);
     }
-    printf("\n}\n");
+    while (gc->worklist.length > 0) {
+        gc_scan(gc, gc->worklist.values[--gc->worklist.length]);
+    }
+    for (size_t i = 0; i < gc->frames.length; i++) {
+        gc->frame_objs->values[get_location(gc->frames.values[i])].offset &= ~GC_MARK_MASK;
+    }
+    free(gc->worklist.values);
+    free(gc->frames.values);
 }
 
-void gc_remap_ptr(struct GarbageCollector *gc, HeapPointer *ptr)
+#if GC_NONMOVING
+/* Unreached cells go back on the free lists for their size */
+static bool gc_mark_sweep(struct Heap *heap, struct Stack *stack_obj, struct StackFrames *sfs_obj,
+        struct StackFrames *frame_objs, struct ClassLayout *layouts)
 {
-    assert(ptr != NULL);
-    if (gc->next_remap == NULL) gc->next_remap = gc->map->head;
-    struct PointerRemap *pr = gc->next_remap->value;
-    assert(*ptr == pr->old_ptr);
-    *ptr = pr->new_ptr;
+    struct GarbageCollector gc;
+    gc.from = heap;
+    gc.frame_objs = frame_objs;
+    gc.layouts = layouts;
+    gc.forwarded = calloc(heap->length / 64 + 1, sizeof(*(gc.forwarded)));
+    if (gc.forwarded == NULL) {
+        return false;
+    }
+    gc_trace(&gc, stack_obj, sfs_obj);
+    size_t live = heap_sweep(heap, gc.forwarded);
+    free(gc.forwarded);
+    large_sweep(&(heap->large));
+    heap->stats->live_slots = live + heap->large.slots;
+    return true;
+}
+#else
+static bool gc_copy(struct Heap *heap, struct Stack *stack_obj, struct StackFrames *sfs_obj,
+        struct StackFrames *frame_objs, struct ClassLayout *layouts)
+{
+    struct GarbageCollector gc;
+    gc.forwarded = calloc(heap->length / 64 + 1, sizeof(*(gc.forwarded)));
+    if (gc.forwarded == NULL) {
+        return false;
+    }
+    // Nothing can grow during a collection, so to-space just needs to be as large as from-space
+    if (!heap_init(&(gc.to), heap->capacity, heap->max_capacity)) {
+        free(gc.forwarded);
+        return false;
+    }
+    gc.from = heap;
+    gc.to.large = heap->large;
+    gc.frame_objs = frame_objs;
+    gc.layouts = layouts;
+    gc_trace(&gc, stack_obj, sfs_obj);
+    free(gc.forwarded);
+    large_sweep(&(gc.to.large));
+    gc.to.gc_threshold = heap->gc_threshold;
+    gc.to.stats = heap->stats;
+    gc.to.limits = heap->limits;
+    gc.to.stats->live_slots = gc.to.length + gc.to.large.slots;
+    heap->large.length = 0;
+    heap->large.objects = NULL;
+    heap_free(heap);
+    *heap = gc.to;
+    return true;
+}
+#endif
+
+static void record_pause(struct HeapStats *stats, uint64_t pause_ns)
+{
+    stats->collections++;
+    stats->total_pause_ns += pause_ns;
+    if (pause_ns > stats->max_pause_ns) {
+        stats->max_pause_ns = pause_ns;
+    }
+    size_t bucket = 0;
+    for (uint64_t us = pause_ns / 1000; us > 0 && bucket < DEL_PAUSE_HISTOGRAM_BUCKETS - 1;
+            us >>= 1) {
+        bucket++;
+    }
+    stats->pause_histogram[bucket]++;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * UINT64_C(1000000000) + (uint64_t)ts.tv_nsec;
 }
 
+/* A heap that's mostly still live after a collection would only be collected again soon for
+ * little gain, so it gets more room to grow. One that was mostly garbage gets less. */
+static void adapt_growth(struct HeapLimits *limits, size_t before, size_t live)
+{
+    if (before == 0) {
+        return;
+    }
+    size_t survival = live >= before ? 100 : 100 * live / before;
+    if (survival > GC_SURVIVAL_HIGH) {
+        limits->growth_percent *= 2;
+        if (limits->growth_percent > GC_GROWTH_PERCENT_MAX) {
+            limits->growth_percent = GC_GROWTH_PERCENT_MAX;
+        }
+    } else if (survival < GC_SURVIVAL_LOW) {
+        limits->growth_percent /= 2;
+        if (limits->growth_percent < GC_GROWTH_PERCENT_MIN) {
+            limits->growth_percent = GC_GROWTH_PERCENT_MIN;
+        }
+    }
+}
+
+bool gc_collect(struct Heap *heap, struct Stack *stack_obj, struct StackFrames *sfs_obj,
+        struct StackFrames *frame_objs, struct ClassLayout *layouts)
+{
+    struct HeapStats *stats = heap->stats;
+    size_t before = heap_usage(heap);
+    if (stats->class_count > 0) {
+        memset(stats->objects_live, 0, stats->class_count * sizeof(*(stats->objects_live)));
+    }
+    uint64_t start = now_ns();
+#if GC_NONMOVING
+    bool collected = gc_mark_sweep(heap, stack_obj, sfs_obj, frame_objs, layouts);
+#else
+    bool collected = gc_copy(heap, stack_obj, sfs_obj, frame_objs, layouts);
+#endif
+    record_pause(stats, now_ns() - start);
+    if (collected) {
+        adapt_growth(&(heap->limits), before, stats->live_slots);
+    }
+    return collected;
+}
@@ -1,28 +1,41 @@
 #ifndef GC_H
 #define GC_H
 
-#include "allocator.h"
-#include "linkedlist.h"
+#include "vm.h"
 
-struct PointerRemap {
-    size_t old_ptr;
-    size_t new_ptr;
+/* Copying collector: everything reachable from the object stack and object locals is copied
+ * into a fresh region in the order it's found, leaving the garbage behind. This compacts the
+ * heap as a side effect. Large objects are only marked, and the ones that weren't reached are
+ * unmapped at the end. Objects in frames (see escape.h) can only be reached through the
+ * stacks, and are never copied either, but their fields are forwarded. Fields are walked with
+ * an explicit worklist rather than recursion so that long linked structures can't overflow the
+ * C stack.
+ *
+ * With GC_NONMOVING set, reachable objects are marked rather than copied, and the cells that
+ * weren't reached are swept onto the free lists for their size (see heap.h). */
+struct PointerList {
+    size_t length;
+    size_t capacity;
+    HeapPointer *values;
 };
 
-typedef struct LinkedList PointerRemaps;
-
 struct GarbageCollector {
-    Allocator allocator;
-    size_t current_loc;
-    struct LinkedListNode *next_remap;
-    PointerRemaps *map;
+    struct Heap *from;
+    struct Heap to;
+    struct StackFrames *frame_objs;
+    struct ClassLayout *layouts;
+    // One bit per from-space slot, set once the object starting there has been copied. The
+    // first slot of a copied object is then overwritten with its new location. In non-moving
+    // mode this is the mark bit of each cell instead.
+    uint64_t *forwarded;
+    // Copied objects whose fields still point into from-space
+    struct PointerList worklist;
+    // Objects in frames that have had their fields forwarded already. They can't move, so
+    // they're marked in their header instead, and unmarked once the collection is done.
+    struct PointerList frames;
 };
 
-void gc_init(struct GarbageCollector *gc);
-void gc_free(struct GarbageCollector *gc);
-void gc_remap(struct GarbageCollector *gc, size_t old_ptr);
-void print_remap(struct GarbageCollector *gc);
-void gc_remap_ptr(struct GarbageCollector *gc, HeapPointer *ptr);
+bool gc_collect(struct Heap *heap, struct Stack *stack_obj, struct StackFrames *sfs_obj,
+        struct StackFrames *frame_objs, struct ClassLayout *layouts);
 
 #endif
-
@@ -0,0 +1,89 @@
+/* Code in this file is autogenerated - do not edit */
+{
+&&PUSH,
+&&PUSH_OBJ,
+&&DUP,
+&&DUP_OBJ,
+&&NEW,
+&&NEW_IN_FRAME,
+&&PUSH_ARRAY,
+&&NEW_ARRAY_FROM_CONST,
+&&LEN_ARRAY,
+&&AND,
+&&OR,
+&&ADD,
+&&SUB,
+&&MUL,
+&&DIV,
+&&MOD,
+&&EQ_OBJ,
+&&NEQ_OBJ,
+&&EQ,
+&&NEQ,
+&&LT,
+&&LTE,
+&&GT,
+&&GTE,
+&&UNARY_MINUS,
+&&NOT,
+&&FLOAT_ADD,
+&&FLOAT_SUB,
+&&FLOAT_MUL,
+&&FLOAT_DIV,
+&&FLOAT_EQ,
+&&FLOAT_NEQ,
+&&FLOAT_LT,
+&&FLOAT_LTE,
+&&FLOAT_GT,
+&&FLOAT_GTE,
+&&FLOAT_UNARY_MINUS,
+&&JE,
+&&JNE,
+&&JMP,
+&&RET,
+&&RET_STRUCT,
+&&POP,
+&&POP_OBJ,
+&&EXIT,
+&&YIELD,
+&&GET_LOCAL,
+&&SET_LOCAL,
+&&GET_LOCAL_OBJ,
+&&SET_LOCAL_OBJ,
+&&DEFINE,
+&&DEFINE_OBJ,
+&&GET_HEAP,
+&&GET_HEAP_OBJ,
+&&SET_HEAP,
+&&SET_HEAP_OBJ,
+&&INIT_FIELD,
+&&INIT_FIELD_OBJ,
+&&GET_ARRAY,
+&&GET_ARRAY_OBJ,
+&&SET_ARRAY,
+&&SET_ARRAY_OBJ,
+&&GET_ARRAY_BYTE,
+&&SET_ARRAY_BYTE,
+&&GET_ARRAY_BOOL,
+&&SET_ARRAY_BOOL,
+&&GET_ARRAY_INT32,
+&&SET_ARRAY_INT32,
+&&GET_ARRAY_FLOAT32,
+&&SET_ARRAY_FLOAT32,
+&&GET_ARRAY_STRUCT,
+&&SET_ARRAY_STRUCT,
+&&GET_ARRAY_SOA,
+&&SET_ARRAY_SOA,
+&&CAST_INT,
+&&CAST_FLOAT,
+&&CAST_BYTE_ARRAY,
+&&CALL,
+&&COMPILE,
+&&SWAP,
+&&SWAP_OBJ,
+&&PUSH_SCOPE,
+&&POP_SCOPE,
+&&PRINT,
+&&PRINT_STRUCT,
+&&READ
+};
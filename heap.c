@@ -0,0 +1,246 @@
+#ifdef __linux__
+#define _GNU_SOURCE // for mremap
+#endif
+#include <sys/mman.h>
+#include "common.h"
+#include "heap.h"
+
+static DelValue *map_values(size_t capacity)
+{
+    void *values = mmap(NULL, IN_BYTES(capacity), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return values == MAP_FAILED ? NULL : values;
+}
+
+bool heap_init(struct Heap *heap, size_t capacity, size_t max_capacity)
+{
+    // Locations have to fit in a heap pointer
+    if (max_capacity > LOCATION_MASK) {
+        max_capacity = LOCATION_MASK;
+    }
+    if (capacity > max_capacity) {
+        capacity = max_capacity;
+    }
+    assert(capacity > 0 && capacity <= max_capacity);
+    heap->values = map_values(capacity);
+    if (heap->values == NULL) {
+        return false;
+    }
+    heap->length = 0;
+    heap->capacity = capacity;
+    heap->max_capacity = max_capacity;
+    heap->gc_threshold = capacity;
+    heap->large.gc_threshold = LARGE_OBJECT_SLOTS * LARGE_OBJECT_GC_INIT;
+    heap->large.slots = 0;
+    heap->large.length = 0;
+    heap->large.capacity = 0;
+    heap->large.free = SIZE_MAX;
+    heap->large.objects = NULL;
+    heap->stats = NULL;
+    heap->limits.soft_limit = 0;
+    heap->limits.soft_limit_callback = NULL;
+    heap->limits.soft_limit_context = NULL;
+    heap->limits.over_soft_limit = false;
+    heap->limits.out_of_memory = false;
+    heap->limits.growth_percent = GC_GROWTH_PERCENT_INIT;
+#if GC_NONMOVING
+    // Nothing is allocated until the first block is, so no point in collecting before that
+    if (heap->gc_threshold < BLOCK_SLOTS) {
+        heap->gc_threshold = BLOCK_SLOTS < max_capacity ? BLOCK_SLOTS : max_capacity;
+    }
+    for (size_t i = 0; i <= SIZE_CLASS_SLOTS_MAX; i++) {
+        heap->classes.free_cells[i] = SIZE_MAX;
+    }
+    heap->classes.free_blocks = SIZE_MAX;
+    heap->classes.block_capacity = 0;
+    heap->classes.block_slots = NULL;
+#endif
+    heap_fit_large_threshold(heap);
+    return true;
+}
+
+void heap_free(struct Heap *heap)
+{
+    if (heap->values != NULL) {
+        munmap(heap->values, IN_BYTES(heap->capacity));
+    }
+    heap->values = NULL;
+    struct LargeObjectSpace *large = &(heap->large);
+    for (size_t i = 0; i < large->length; i++) {
+        if (large->objects[i].values != NULL) {
+            munmap(large->objects[i].values, IN_BYTES(large->objects[i].slots));
+        }
+    }
+    free(large->objects);
+    large->objects = NULL;
+    large->length = 0;
+    large->capacity = 0;
+    large->free = SIZE_MAX;
+    large->slots = 0;
+#if GC_NONMOVING
+    free(heap->classes.block_slots);
+    heap->classes.block_slots = NULL;
+    heap->classes.block_capacity = 0;
+#endif
+}
+
+/* Grow the heap to at least min_capacity slots, keeping everything in place */
+bool heap_grow(struct Heap *heap, size_t min_capacity)
+{
+    if (min_capacity > heap->max_capacity) {
+        return false;
+    }
+    size_t new_capacity = heap->capacity * GC_GROWTH_FACTOR;
+    if (new_capacity < min_capacity) {
+        new_capacity = min_capacity;
+    }
+    if (new_capacity > heap->max_capacity) {
+        new_capacity = heap->max_capacity;
+    }
+#ifdef __linux__
+    // The kernel can usually extend the mapping (or at worst remap its pages) without copying
+    void *values = mremap(heap->values, IN_BYTES(heap->capacity), IN_BYTES(new_capacity),
+            MREMAP_MAYMOVE);
+    if (values == MAP_FAILED) {
+        return false;
+    }
+#else
+    DelValue *values = map_values(new_capacity);
+    if (values == NULL) {
+        return false;
+    }
+    memcpy(values, heap->values, IN_BYTES(heap->length));
+    munmap(heap->values, IN_BYTES(heap->capacity));
+#endif
+    heap->values = values;
+    heap->capacity = new_capacity;
+    return true;
+}
+
+/* Map a zeroed region for a large object and store its index in the table */
+bool large_alloc(struct LargeObjectSpace *large, size_t count, size_t slots, size_t *index)
+{
+    DelValue *values = map_values(slots);
+    if (values == NULL) {
+        return false;
+    }
+    if (large->free != SIZE_MAX) {
+        *index = large->free;
+        large->free = large->objects[*index].count;
+    } else {
+        if (large->length == large->capacity) {
+            size_t capacity = large->capacity == 0 ? 16 : GC_GROWTH_FACTOR * large->capacity;
+            struct LargeObject *objects = realloc(large->objects, capacity * sizeof(*objects));
+            if (objects == NULL) {
+                munmap(values, IN_BYTES(slots));
+                return false;
+            }
+            large->objects = objects;
+            large->capacity = capacity;
+        }
+        *index = large->length++;
+    }
+    struct LargeObject *obj = &(large->objects[*index]);
+    obj->count = count;
+    obj->slots = slots;
+    obj->marked = false;
+    obj->values = values;
+    large->slots += slots;
+    return true;
+}
+
+/* Unmap every large object the collector didn't reach, and reset the marks on the rest */
+void large_sweep(struct LargeObjectSpace *large)
+{
+    for (size_t i = 0; i < large->length; i++) {
+        struct LargeObject *obj = &(large->objects[i]);
+        if (obj->values == NULL) {
+            continue;
+        } else if (obj->marked) {
+            obj->marked = false;
+            continue;
+        }
+        munmap(obj->values, IN_BYTES(obj->slots));
+        large->slots -= obj->slots;
+        obj->values = NULL;
+        obj->count = large->free;
+        large->free = i;
+    }
+}
+
+#if GC_NONMOVING
+/* Splits the block starting at start into cells of the given size, and threads them onto its
+ * free list so that they're handed out in order */
+static void thread_cells(struct Heap *heap, size_t start, size_t slots, const uint64_t *marked)
+{
+    size_t *free_cells = &(heap->classes.free_cells[slots]);
+    for (size_t i = BLOCK_SLOTS / slots; i-- > 0;) {
+        size_t cell = start + i * slots;
+        if (marked == NULL || !((marked[cell / 64] >> (cell % 64)) & 1)) {
+            heap->values[cell].offset = *free_cells;
+            *free_cells = cell;
+        }
+    }
+}
+
+/* Gives the size class a block, reusing an empty one if there is one and bump allocating one
+ * otherwise */
+bool heap_new_block(struct Heap *heap, size_t slots)
+{
+    struct SizeClasses *classes = &(heap->classes);
+    size_t start;
+    if (heap_has_free_block(heap)) {
+        start = classes->free_blocks;
+        classes->free_blocks = heap->values[start].offset;
+    } else {
+        if (!heap_has_room(heap, BLOCK_SLOTS) && !heap_grow(heap, heap->length + BLOCK_SLOTS)) {
+            return false;
+        }
+        size_t block = heap->length / BLOCK_SLOTS;
+        if (block == classes->block_capacity) {
+            size_t capacity = classes->block_capacity == 0 ? 16 : GC_GROWTH_FACTOR * block;
+            uint8_t *block_slots = realloc(classes->block_slots, capacity);
+            if (block_slots == NULL) {
+                return false;
+            }
+            classes->block_slots = block_slots;
+            classes->block_capacity = capacity;
+        }
+        start = heap_alloc(heap, BLOCK_SLOTS);
+    }
+    classes->block_slots[start / BLOCK_SLOTS] = slots;
+    thread_cells(heap, start, slots, NULL);
+    return true;
+}
+
+/* Rebuilds the free lists out of every cell that wasn't marked, and returns the number of live
+ * slots. Blocks with nothing live in them go back on the block list, so that any size class
+ * can use them. */
+size_t heap_sweep(struct Heap *heap, const uint64_t *marked)
+{
+    struct SizeClasses *classes = &(heap->classes);
+    for (size_t i = 0; i <= SIZE_CLASS_SLOTS_MAX; i++) {
+        classes->free_cells[i] = SIZE_MAX;
+    }
+    classes->free_blocks = SIZE_MAX;
+    size_t live = 0;
+    // Going backwards means the lists come out in address order
+    for (size_t block = heap->length / BLOCK_SLOTS; block-- > 0;) {
+        size_t start = block * BLOCK_SLOTS;
+        size_t slots = classes->block_slots[block];
+        size_t block_live = 0;
+        for (size_t cell = start; slots > 0 && cell + slots <= start + BLOCK_SLOTS; cell += slots) {
+            block_live += (marked[cell / 64] >> (cell % 64)) & 1;
+        }
+        if (block_live == 0) {
+            classes->block_slots[block] = 0;
+            heap->values[start].offset = classes->free_blocks;
+            classes->free_blocks = start;
+            continue;
+        }
+        live += block_live * slots;
+        thread_cells(heap, start, slots, marked);
+    }
+    return live;
+}
+#endif
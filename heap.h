@@ -0,0 +1,188 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include "common.h"
+#include "del.h"
+#include "compiler.h"
+#include "heap_ptr.h"
+
+/* The heap is a single bump allocated region of DelValues mapped directly from the OS.
+ * Heap pointers store a location (an index) rather than an address, so the region is free to
+ * move when it grows. Memory handed out by heap_alloc is always zeroed: fresh pages from mmap
+ * and mremap are zero, and we never reuse memory without moving to a fresh region first.
+ *
+ * With GC_NONMOVING set, the region is instead bump allocated a block at a time, and each block
+ * is split into cells of a single size class (a number of slots). Free cells of each size are
+ * threaded onto a free list through their first slot, so an allocation just pops a cell off of
+ * the list for its size. Nothing ever moves, which means a heap pointer stays valid for as long
+ * as its object is reachable, e.g. while host code holds on to it. */
+
+/* Arrays that are too big to be worth copying, or too big to fit their count in a heap pointer,
+ * each get their own mapping instead. Heap pointers to them hold an index into this table, so
+ * the collector can trace them and free them in place but never has to move them. */
+struct LargeObject {
+    size_t count;     // Number of elements, or the next free entry if values is NULL
+    size_t slots;
+    bool marked;
+    DelValue *values;
+};
+
+struct LargeObjectSpace {
+    size_t gc_threshold; // Collect before large objects take up more than this many slots
+    size_t slots;        // Slots taken up by all large objects
+    size_t length;
+    size_t capacity;
+    size_t free;         // Head of the list of reusable entries, SIZE_MAX if there are none
+    struct LargeObject *objects;
+};
+
+/* Per VM limits and growth policy, which carry over when a collection replaces the heap */
+struct HeapLimits {
+    size_t soft_limit;     // In slots, 0 if there isn't one
+    DelSoftLimitCallback soft_limit_callback;
+    void *soft_limit_context;
+    bool over_soft_limit;  // Set once the callback has been called, until usage drops back under
+    bool out_of_memory;    // Set when an allocation fails for lack of memory
+    size_t growth_percent; // See GC_GROWTH_PERCENT_INIT
+};
+
+/* Running totals behind del_vm_stats. Keeping them costs a couple of additions per allocation and
+ * a clock read on either side of each collection, so they're always on. */
+struct HeapStats {
+    size_t allocated_slots;
+    size_t live_slots;
+    size_t collections;
+    uint64_t total_pause_ns;
+    uint64_t max_pause_ns;
+    uint64_t pause_histogram[DEL_PAUSE_HISTOGRAM_BUCKETS];
+    size_t class_count;
+    uint64_t *objects_allocated;
+    uint64_t *objects_live;
+};
+
+#if GC_NONMOVING
+struct SizeClasses {
+    size_t free_cells[SIZE_CLASS_SLOTS_MAX + 1]; // Head of the free list of each size, or SIZE_MAX
+    size_t free_blocks;    // Head of the list of blocks with no live cells, or SIZE_MAX
+    size_t block_capacity;
+    uint8_t *block_slots;  // Size of every cell in each block, 0 for blocks on the free list
+};
+#endif
+
+struct Heap {
+    size_t gc_threshold; // Collect before the heap grows past this many slots
+    size_t length;       // Bump pointer
+    size_t capacity;
+    size_t max_capacity;
+    DelValue *values;
+    struct LargeObjectSpace large;
+    struct HeapStats *stats; // Survives the heap being replaced by a collection
+    struct HeapLimits limits;
+#if GC_NONMOVING
+    struct SizeClasses classes;
+#endif
+};
+
+bool heap_init(struct Heap *heap, size_t capacity, size_t max_capacity);
+void heap_free(struct Heap *heap);
+bool heap_grow(struct Heap *heap, size_t min_capacity);
+bool large_alloc(struct LargeObjectSpace *large, size_t count, size_t slots, size_t *index);
+void large_sweep(struct LargeObjectSpace *large);
+#if GC_NONMOVING
+bool heap_new_block(struct Heap *heap, size_t slots);
+size_t heap_sweep(struct Heap *heap, const uint64_t *marked);
+#endif
+
+/* Slots taken up by objects and arrays, whether or not they're still reachable */
+static inline size_t heap_usage(struct Heap *heap)
+{
+    return heap->length + heap->large.slots;
+}
+
+/* How far usage can go before the next collection */
+static inline size_t heap_headroom(struct Heap *heap, size_t usage)
+{
+    return usage + usage / 100 * heap->limits.growth_percent
+        + usage % 100 * heap->limits.growth_percent / 100;
+}
+
+/* The fast paths only check their own space's threshold, so to keep usage under max_capacity
+ * the two thresholds can't add up to more than it. Whichever was just raised keeps its value and
+ * the other one gives way. */
+static inline void heap_fit_large_threshold(struct Heap *heap)
+{
+    size_t main = heap->length > heap->gc_threshold ? heap->length : heap->gc_threshold;
+    if (heap->large.gc_threshold > heap->max_capacity - main) {
+        heap->large.gc_threshold = heap->max_capacity - main;
+    }
+}
+
+static inline void heap_fit_gc_threshold(struct Heap *heap)
+{
+    if (heap->gc_threshold > heap->max_capacity - heap->large.gc_threshold) {
+        heap->gc_threshold = heap->max_capacity - heap->large.gc_threshold;
+    }
+}
+
+static inline bool heap_has_room(struct Heap *heap, size_t slots)
+{
+    return heap->capacity - heap->length >= slots;
+}
+
+/* Allocates slots in O(1). Caller must check that there's room first */
+static inline size_t heap_alloc(struct Heap *heap, size_t slots)
+{
+    size_t location = heap->length;
+    heap->length += slots;
+    return location;
+}
+
+#if GC_NONMOVING
+/* Pops a zeroed cell of the given size in O(1), if there's one free */
+static inline bool heap_pop_cell(struct Heap *heap, size_t slots, size_t *location)
+{
+    size_t cell = heap->classes.free_cells[slots];
+    if (cell == SIZE_MAX) {
+        return false;
+    }
+    heap->classes.free_cells[slots] = heap->values[cell].offset;
+    memset(&(heap->values[cell]), 0, IN_BYTES(slots));
+    *location = cell;
+    return true;
+}
+
+static inline bool heap_has_free_block(struct Heap *heap)
+{
+    return heap->classes.free_blocks != SIZE_MAX;
+}
+#endif
+
+/* Should an array of this many elements / slots go in the large object space? */
+static inline bool is_large(size_t count, size_t slots)
+{
+#if GC_NONMOVING
+    // Anything bigger than the biggest size class gets its own mapping
+    return count > COUNT_MAX || slots > SIZE_CLASS_SLOTS_MAX;
+#else
+    return count > COUNT_MAX || slots >= LARGE_OBJECT_SLOTS;
+#endif
+}
+
+static inline DelValue *heap_values(struct Heap *heap, HeapPointer ptr)
+{
+    if (is_large_ptr(ptr)) {
+        return heap->large.objects[get_location(ptr)].values;
+    }
+    return &(heap->values[get_location(ptr)]);
+}
+
+/* Number of fields in an object or elements in an array */
+static inline size_t heap_count(struct Heap *heap, HeapPointer ptr)
+{
+    if (is_large_ptr(ptr)) {
+        return heap->large.objects[get_location(ptr)].count;
+    }
+    return get_count(ptr);
+}
+
+#endif
@@ -7,24 +7,37 @@
  *   - Currently this includes the "mark" portion of mark and sweep gc as the highest bit.
  *   - The second highest bit is set if the pointer points to an array.
  *   - The third highest bit is set if the pointer points to an array of objects.
- *   - TBD if the other bits will be used. Maybe I will use them to make the size portion larger.
- * - Count: The next 24 bytes store the size of the data. For most objects this will be small,
- *   but arrays could possibly use up the full range.
- * - Location: The last 32 bits store the location in the heap: that means our heap can store
- *   up to about 4 gigabytes of data before hitting this limit.
+ *   - The fourth highest bit is set if the value lives in the large object space (see heap.h).
+ *   - The fifth highest bit is set if the value is an object living in a function's frame
+ *     (see escape.h). The location is then an index into the frame objects.
+ *   - The lowest 3 bits of the metadata store the element width of an array (see enum ArrayWidth). Anything
+ *     narrower than 64 bits is packed, so e.g. a slot holds 8 bytes or 64 bools.
+ * - Count: The next 16 bits store the size of the data. Anything bigger than that goes in the
+ *   large object space, which keeps track of its own count, and the count bits are left empty.
+ * - Location: The last 40 bits store the location in the heap, or the index of a large object:
+ *   that means our heap can store up to about 8 terabytes of data before hitting this limit.
  */
-#define COUNT_OFFSET         UINT64_C(32)
-#define COUNT_MAX            (UINT64_C(1) * UINT16_MAX * 3 / 2)
+#define COUNT_OFFSET         UINT64_C(40)
+#define COUNT_MAX            (UINT64_C(1) * UINT16_MAX)
 #define METADATA_OFFSET      UINT64_C(56)
 #define GC_MARK_OFFSET       UINT64_C(63)
 #define ARRAY_BIT_OFFSET     UINT64_C(62)
 #define ARRAY_OBJ_BIT_OFFSET UINT64_C(61)
+#define LARGE_BIT_OFFSET     UINT64_C(60)
+#define FRAME_BIT_OFFSET     UINT64_C(59)
+#define ARRAY_WIDTH_OFFSET   UINT64_C(56)
 #define METADATA_MASK        (UINT64_MAX - ((UINT64_C(1) << METADATA_OFFSET) - 1))
 #define LOCATION_MASK        ((UINT64_C(1) << COUNT_OFFSET) - 1)
 #define COUNT_MASK           (UINT64_MAX - (LOCATION_MASK + METADATA_MASK))
 #define GC_MARK_MASK         (UINT64_C(1) << GC_MARK_OFFSET)
 #define ARRAY_BIT_MASK       (UINT64_C(1) << ARRAY_BIT_OFFSET)
 #define ARRAY_OBJ_BIT_MASK   (UINT64_C(1) << ARRAY_OBJ_BIT_OFFSET)
+#define LARGE_BIT_MASK       (UINT64_C(1) << LARGE_BIT_OFFSET)
+#define FRAME_BIT_MASK       (UINT64_C(1) << FRAME_BIT_OFFSET)
+#define ARRAY_WIDTH_MASK     (UINT64_C(7) << ARRAY_WIDTH_OFFSET)
+
+/* Objects (but not arrays) start with a header storing the id of their class layout */
+#define OBJECT_HEADER_SLOTS  UINT64_C(1)
 
 typedef uint64_t HeapPointer;
 
@@ -35,7 +48,7 @@ static inline void set_count_no_check(HeapPointer *ptr, size_t count)
 
 static inline bool set_count(HeapPointer *ptr, size_t count)
 {
-    if (count > UINT16_MAX * 3 / 2) {
+    if (count > COUNT_MAX) {
         return false;
     }
     set_count_no_check(ptr, count);
@@ -98,5 +111,76 @@ static inline bool is_array_of_objects(HeapPointer ptr)
     return ptr & ARRAY_OBJ_BIT_MASK;
 }
 
+static inline void set_large_bit(HeapPointer *ptr)
+{
+    *ptr = *ptr | LARGE_BIT_MASK;
+}
+
+static inline bool is_large_ptr(HeapPointer ptr)
+{
+    return ptr & LARGE_BIT_MASK;
+}
+
+static inline void set_frame_bit(HeapPointer *ptr)
+{
+    *ptr = *ptr | FRAME_BIT_MASK;
+}
+
+static inline bool is_frame_ptr(HeapPointer ptr)
+{
+    return ptr & FRAME_BIT_MASK;
+}
+
+enum ArrayWidth {
+    ARRAY_WIDTH_64 = 0,
+    ARRAY_WIDTH_1,
+    ARRAY_WIDTH_8,
+    ARRAY_WIDTH_32
+};
+
+static inline void set_array_width(HeapPointer *ptr, enum ArrayWidth width)
+{
+    *ptr = *ptr | ((uint64_t)width << ARRAY_WIDTH_OFFSET);
+}
+
+static inline enum ArrayWidth get_array_width(HeapPointer ptr)
+{
+    return (ptr & ARRAY_WIDTH_MASK) >> ARRAY_WIDTH_OFFSET;
+}
+
+/* How tightly an array of the given element type is packed */
+static inline enum ArrayWidth array_width(Type type)
+{
+    switch (type) {
+        case TYPE_BOOL:    return ARRAY_WIDTH_1;
+        case TYPE_BYTE:    return ARRAY_WIDTH_8;
+        case TYPE_INT32:   return ARRAY_WIDTH_32;
+        case TYPE_FLOAT32: return ARRAY_WIDTH_32;
+        default:           return ARRAY_WIDTH_64;
+    }
+}
+
+/* Number of heap slots needed to store count elements of an array */
+static inline size_t array_slots(size_t count, enum ArrayWidth width)
+{
+    size_t per_slot = 1;
+    switch (width) {
+        case ARRAY_WIDTH_64: per_slot = 1;  break;
+        case ARRAY_WIDTH_1:  per_slot = 64; break;
+        case ARRAY_WIDTH_8:  per_slot = 8;  break;
+        case ARRAY_WIDTH_32: per_slot = 2;  break;
+    }
+    return count / per_slot + (count % per_slot == 0 ? 0 : 1);
+}
+
+/* Number of heap slots taken up by whatever ptr points to. Only meaningful for small objects */
+static inline size_t get_slots(HeapPointer ptr)
+{
+    if (is_array_ptr(ptr)) {
+        return array_slots(get_count(ptr), get_array_width(ptr));
+    }
+    return get_count(ptr);
+}
+
 #endif
 
@@ -1,7 +1,9 @@
 #include "common.h"
+#if LEXER_SSE2
+#include <emmintrin.h>
+#endif
 #include "readfile.h"
 #include "allocator.h"
-#include "linkedlist.h"
 #include "lexer.h"
 
 struct TokenMapping {
@@ -26,8 +28,12 @@ struct TokenMapping keywords[] = {
     { "int",         ST_INT },
     { "float",       ST_FLOAT },
     { "bool",        ST_BOOL },
+    { "int32",       ST_INT32 },
+    { "float32",     ST_FLOAT32 },
     { "null",        ST_NULL },
     { "class",       ST_CLASS },
+    { "struct",      ST_STRUCT },
+    { "soa",         ST_SOA },
     { "return",      ST_RETURN },
     { "break",       ST_BREAK },
     { "continue",    ST_CONTINUE },
@@ -70,9 +76,15 @@ struct TokenMapping symbols1[] = {
     { ".",        ST_DOT }
 };
 
+// Appends a token to the lexer's token array
 static struct Token *new_token(struct Globals *globals, int start, int end, enum TokenType type)
 {
-    struct Token *token = allocator_malloc(globals->allocator, sizeof(*token));
+    Tokens *tokens = globals->lexer->tokens;
+    if (tokens->length == tokens->capacity) {
+        tokens->capacity = tokens->capacity == 0 ? 1024 : 2 * tokens->capacity;
+        tokens->values = realloc(tokens->values, tokens->capacity * sizeof(*(tokens->values)));
+    }
+    struct Token *token = &(tokens->values[tokens->length++]);
     token->start = start;
     token->end = end;
     token->line_number = globals->lexer->error.line_number;
@@ -156,6 +168,119 @@ static inline char next(struct Globals *globals)
     return globals->file->input[globals->lexer->offset++];
 }
 
+/* Moves the lexer forward count characters, none of which are newlines */
+static inline void skip(struct Globals *globals, int count)
+{
+    globals->lexer->offset += count;
+    globals->lexer->error.column_number += count;
+}
+
+#if LEXER_SSE2
+// Each of these sets bit i of the result if character i of the chunk is in the class. Only
+// signed comparisons are available, which works out since anything past ascii is negative and
+// so never in range.
+static inline unsigned in_range(__m128i chunk, char low, char high)
+{
+    __m128i above = _mm_cmpgt_epi8(chunk, _mm_set1_epi8(low - 1));
+    __m128i below = _mm_cmplt_epi8(chunk, _mm_set1_epi8(high + 1));
+    return _mm_movemask_epi8(_mm_and_si128(above, below));
+}
+
+static inline unsigned equal_to(__m128i chunk, char c)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+}
+
+static inline unsigned digit_mask(__m128i chunk)
+{
+    return in_range(chunk, '0', '9');
+}
+
+static inline unsigned symbol_token_mask(__m128i chunk)
+{
+    // Setting 0x20 lowercases letters and doesn't turn anything else into a letter
+    __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+    return in_range(lower, 'a', 'z') | digit_mask(chunk) | equal_to(chunk, '_');
+}
+
+static inline unsigned space_mask(__m128i chunk)
+{
+    return equal_to(chunk, ' ') | equal_to(chunk, '\t') | equal_to(chunk, '\n')
+        | equal_to(chunk, '\r');
+}
+
+// Loads are only done where all 16 characters are in the input, so they can't run off the
+// end of it
+#define can_load(globals, i) ((i) + 16 <= (globals)->file->length)
+#define load_chunk(globals, i) _mm_loadu_si128((const __m128i *) ((globals)->file->input + (i)))
+#endif
+
+/* Number of characters from the lexer's offset on that can be part of a symbol */
+static inline int symbol_token_length(struct Globals *globals)
+{
+    long i = globals->lexer->offset;
+#if LEXER_SSE2
+    for (; can_load(globals, i); i += 16) {
+        unsigned mask = symbol_token_mask(load_chunk(globals, i));
+        if (mask != 0xFFFF) {
+            return i + __builtin_ctz(~mask) - globals->lexer->offset;
+        }
+    }
+#endif
+    char *input = globals->file->input;
+    while (isalnum(input[i]) || input[i] == '_') {
+        i++;
+    }
+    return i - globals->lexer->offset;
+}
+
+/* Number of digits from the lexer's offset on */
+static inline int digit_length(struct Globals *globals)
+{
+    long i = globals->lexer->offset;
+#if LEXER_SSE2
+    for (; can_load(globals, i); i += 16) {
+        unsigned mask = digit_mask(load_chunk(globals, i));
+        if (mask != 0xFFFF) {
+            return i + __builtin_ctz(~mask) - globals->lexer->offset;
+        }
+    }
+#endif
+    char *input = globals->file->input;
+    while (isdigit(input[i])) {
+        i++;
+    }
+    return i - globals->lexer->offset;
+}
+
+/* Skips over whitespace, keeping track of line and column numbers */
+static void skip_whitespace(struct Globals *globals)
+{
+#if LEXER_SSE2
+    struct Lexer *lexer = globals->lexer;
+    while (can_load(globals, lexer->offset)) {
+        __m128i chunk = load_chunk(globals, lexer->offset);
+        unsigned spaces = space_mask(chunk);
+        int count = spaces == 0xFFFF ? 16 : __builtin_ctz(~spaces);
+        unsigned newlines = equal_to(chunk, '\n') & ((1u << count) - 1);
+        if (newlines != 0) {
+            int last_newline = 31 - __builtin_clz(newlines);
+            lexer->error.line_number += __builtin_popcount(newlines);
+            lexer->error.column_number = count - last_newline;
+        } else {
+            lexer->error.column_number += count;
+        }
+        lexer->offset += count;
+        if (count < 16) {
+            return;
+        }
+    }
+#endif
+    while (is_space(peek(globals))) {
+        next(globals);
+    }
+}
+
 // Checks if lexer matches given string, consuming the characters it reads on success
 // Returns the number of characters consumed on success, otherwise return 0. 
 // 'require_terminal' should be set to true if it expects to be terminated by a terminal
@@ -184,16 +309,15 @@ static int match(struct Globals *globals, char *str, bool require_terminal)
 
 static void tokenize_comment(struct Globals *globals)
 {
-    char c = '\0';
     int init_offset = globals->lexer->offset;
-    while (peek(globals) != '\n' && peek(globals) != '\0') {
-        c = next(globals);
-    }
+    // The input is null terminated, and strcspn is usually vectorized already
+    int count = strcspn(globals->file->input + init_offset, "\n");
+    skip(globals, count);
     if (globals->lexer->include_comments) {
-        if (c == '\r') {
-            linkedlist_append(globals->lexer->tokens, new_token(globals, init_offset, globals->lexer->offset - 1, T_COMMENT));
+        if (count > 0 && globals->file->input[init_offset + count - 1] == '\r') {
+            new_token(globals, init_offset, globals->lexer->offset - 1, T_COMMENT);
         } else {
-            linkedlist_append(globals->lexer->tokens, new_token(globals, init_offset, globals->lexer->offset, T_COMMENT));
+            new_token(globals, init_offset, globals->lexer->offset, T_COMMENT);
         }
     }
 }
@@ -212,15 +336,13 @@ static char *make_string(struct Globals *globals, char *input, int start, int en
 static void tokenize_string(struct Globals *globals)
 {
     int init_offset = globals->lexer->offset;
-    while (peek(globals) != '"') {
-        if (peek(globals) == '\n' || peek(globals) == '\0') {
-            globals->lexer->error.message = "Unexpected end of string";
-            return;
-        }
-        next(globals);
+    skip(globals, strcspn(globals->file->input + init_offset, "\"\n"));
+    if (peek(globals) != '"') {
+        globals->lexer->error.message = "Unexpected end of string";
+        return;
     }
     char *str = make_string(globals, globals->file->input, init_offset, globals->lexer->offset);
-    linkedlist_append(globals->lexer->tokens, new_string_token(globals, init_offset, globals->lexer->offset, str));
+    new_string_token(globals, init_offset, globals->lexer->offset, str);
     next(globals);
 }
 
@@ -255,8 +377,7 @@ static void tokenize_byte(struct Globals *globals)
         return;
     }
     next(globals);
-    struct Token *token = new_byte_token(globals, init_offset, globals->lexer->offset, c);
-    linkedlist_append(globals->lexer->tokens, token);
+    new_byte_token(globals, init_offset, globals->lexer->offset, c);
 }
 
 static bool match_simple_token_list(struct Globals *globals, struct TokenMapping *tm_list, size_t length,
@@ -266,7 +387,7 @@ static bool match_simple_token_list(struct Globals *globals, struct TokenMapping
     for (size_t i = 0; i < length; i++) {
         struct TokenMapping tm = tm_list[i];
         if (match(globals, tm.string, require_terminal)) {
-            linkedlist_append(globals->lexer->tokens, new_token(globals, init_offset, globals->lexer->offset, tm.type));
+            new_token(globals, init_offset, globals->lexer->offset, tm.type);
             return true;
         }
     }
@@ -280,8 +401,7 @@ static bool match_simple_token_list(struct Globals *globals, struct TokenMapping
 static bool match_simple_token(struct Globals *globals)
 {
     return match_simple_token_list_m(globals, symbols2, false) ||
-           match_simple_token_list_m(globals, symbols1, false) ||
-           match_simple_token_list_m(globals, keywords, true);
+           match_simple_token_list_m(globals, symbols1, false);
 }
 
 #undef match_simple_token_list_m
@@ -306,9 +426,7 @@ static int64_t str_to_int64(struct Globals *globals, int init_offset, int count)
 
 static bool check_digit_part(struct Globals *globals)
 {
-    while (isdigit(peek(globals))) {
-        next(globals);
-    }
+    skip(globals, digit_length(globals));
     if (!is_terminal(peek(globals))) {
         globals->lexer->error.message = "unexpected character in numeric literal";
         return false;
@@ -322,7 +440,6 @@ static void tokenize_number(struct Globals *globals)
     if (!check_digit_part(globals)) {
         return;
     }
-    struct Token *token = NULL;
     if (peek(globals) == '.') {
         // float
         // Currently only parses floats of the form nnn.nnn
@@ -334,39 +451,65 @@ static void tokenize_number(struct Globals *globals)
         double num = strtod(globals->file->input + init_offset, &end);
         assert(end == globals->file->input + globals->lexer->offset);
         errno = 0; // reset in event that it overflows (we don't care)
-        token = new_floating_token(globals, init_offset, globals->lexer->offset, num);
+        new_floating_token(globals, init_offset, globals->lexer->offset, num);
     } else {
         // int
         int count = globals->lexer->offset - init_offset;
         int64_t num = str_to_int64(globals, init_offset, count);
-        token = new_integer_token(globals, init_offset, globals->lexer->offset, num);
+        if (!globals->lexer->error.message) {
+            new_integer_token(globals, init_offset, globals->lexer->offset, num);
+        }
     }
-    if (!globals->lexer->error.message) {
-        linkedlist_append(globals->lexer->tokens, token);
+}
+
+// Perfect hash of the keywords: no two of them land in the same slot (lexer_init checks)
+static inline size_t keyword_hash(const char *str, size_t len)
+{
+    return (len + 25 * (unsigned char) str[0] + 5 * (unsigned char) str[len - 1])
+        & (KEYWORD_SLOTS - 1);
+}
+
+static void init_keyword_slots(struct Lexer *lexer)
+{
+    memset(lexer->keyword_slots, 0, sizeof(lexer->keyword_slots));
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(*keywords); i++) {
+        size_t slot = keyword_hash(keywords[i].string, strlen(keywords[i].string));
+        assert(lexer->keyword_slots[slot] == 0);
+        lexer->keyword_slots[slot] = i + 1;
     }
 }
 
-static bool is_symbol_token(char c)
+/* Returns the keyword's mapping, or NULL if the text isn't a keyword */
+static struct TokenMapping *lookup_keyword(struct Lexer *lexer, const char *str, size_t len)
 {
-    return (isalnum(c) || c == '_');
+    uint8_t slot = lexer->keyword_slots[keyword_hash(str, len)];
+    if (slot == 0) {
+        return NULL;
+    }
+    struct TokenMapping *tm = &keywords[slot - 1];
+    if (strncmp(tm->string, str, len) != 0 || tm->string[len] != '\0') {
+        return NULL;
+    }
+    return tm;
 }
 
 static void tokenize_symbol(struct Globals *globals)
 {
     int init_offset = globals->lexer->offset;
-    while (is_symbol_token(peek(globals))) {
-        next(globals);
-    }
+    skip(globals, symbol_token_length(globals));
     if (!is_terminal(peek(globals))) {
         globals->lexer->error.message = "unexpected character in integer literal";
         return;
     }
     int count = globals->lexer->offset - init_offset;
-    char *text = allocator_malloc(globals->allocator, count + 1);
-    memcpy(text, globals->file->input + init_offset, count);
-    text[count] = '\0';
-    Symbol symbol = add_symbol(globals, text, count);
-    linkedlist_append(globals->lexer->tokens, new_symbol_token(globals, init_offset, globals->lexer->offset, symbol));
+    struct TokenMapping *keyword = lookup_keyword(globals->lexer,
+            globals->file->input + init_offset, count);
+    if (keyword != NULL) {
+        new_token(globals, init_offset, globals->lexer->offset, keyword->type);
+        return;
+    }
+    Symbol symbol = add_symbol(globals, globals->file->input + init_offset, count);
+    new_symbol_token(globals, init_offset, globals->lexer->offset, symbol);
 }
 
 void print_token(struct Globals *globals, struct Token *token)
@@ -398,9 +541,9 @@ void print_lexer(struct Globals *globals, struct Lexer *lexer)
 {
     printf("lexer {\n");
     printf("  [\n");
-    for (struct LinkedListNode *node = lexer->tokens->head; node != NULL; node = node->next) {
+    for (size_t i = 0; i < lexer->tokens->length; i++) {
         printf("    ");
-        print_token(globals, node->value);
+        print_token(globals, &(lexer->tokens->values[i]));
     }
     printf("  ]\n");
     printf("}\n");
@@ -415,7 +558,20 @@ void lexer_init(struct Globals *globals, struct Lexer *lexer, bool include_comme
     // lexer->input_length = input_length;
     lexer->include_comments = include_comments;
     lexer->offset = 0;
-    lexer->tokens = linkedlist_new(globals->allocator);
+    lexer->tokens = allocator_malloc(globals->allocator, sizeof(*(lexer->tokens)));
+    lexer->tokens->length = 0;
+    lexer->tokens->capacity = 0;
+    lexer->tokens->values = NULL;
+    init_keyword_slots(lexer);
+}
+
+// Tokens aren't needed once the parser is done with them
+void lexer_free(struct Lexer *lexer)
+{
+    free(lexer->tokens->values);
+    lexer->tokens->values = NULL;
+    lexer->tokens->length = 0;
+    lexer->tokens->capacity = 0;
 }
 
 bool tokenize(struct Globals *globals)
@@ -427,7 +583,7 @@ bool tokenize(struct Globals *globals)
     while (has_next(globals)) {
         if (is_space(peek(globals))) {
             // ignore whitespace
-            next(globals);
+            skip_whitespace(globals);
         } else if (match(globals, "//", false)) {
             tokenize_comment(globals);
         } else if (isdigit(peek(globals))) {
@@ -438,10 +594,11 @@ bool tokenize(struct Globals *globals)
         } else if (peek(globals) ==  '\'') {
             next(globals);
             tokenize_byte(globals);
-        } else if (match_simple_token(globals)) {
-            // Do nothing, match_simple_token will consume the token on success
         } else if (isalpha(peek(globals)) || peek(globals) == '_') {
+            // Checked before the operators, since none of them start with a letter
             tokenize_symbol(globals);
+        } else if (match_simple_token(globals)) {
+            // Do nothing, match_simple_token will consume the token on success
         } else {
             globals->lexer->error.message = "illegal characters in token";
         }
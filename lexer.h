@@ -25,11 +25,15 @@ enum TokenType {
     ST_INT,
     ST_FLOAT,
     ST_BOOL,
+    ST_INT32,
+    ST_FLOAT32,
     ST_AND,
     ST_OR,
     ST_NOT,
     ST_NULL,
     ST_CLASS,
+    ST_STRUCT,
+    ST_SOA,
     ST_RETURN,
     ST_BREAK,
     ST_CONTINUE,
@@ -77,7 +81,15 @@ struct Token {
     };
 };
 
-typedef struct LinkedList Tokens;
+/* Tokens are stored one after another, and point back into the input with their start and end
+ * offsets */
+struct Tokens {
+    size_t length;
+    size_t capacity;
+    struct Token *values;
+};
+
+typedef struct Tokens Tokens;
 
 struct LexerError {
     char *message;
@@ -85,14 +97,19 @@ struct LexerError {
     int column_number;
 };
 
+/* Size of the keyword hash table, see keyword_hash in lexer.c */
+#define KEYWORD_SLOTS 64
+
 struct Lexer {
     struct LexerError error;
     bool include_comments;
     int offset;
     Tokens *tokens;
+    uint8_t keyword_slots[KEYWORD_SLOTS]; // Index into keywords + 1, or 0 if the slot is empty
 };
 
 void lexer_init(struct Globals *globals, struct Lexer *lexer, bool include_comments);
+void lexer_free(struct Lexer *lexer);
 bool tokenize(struct Globals *globals);
 void print_token(struct Globals *globals, struct Token *token);
 void print_lexer(struct Globals *globals, struct Lexer *lexer);
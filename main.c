@@ -6,8 +6,41 @@
 // TODO: As an alternative to a REPL, add a "watch" flag (maybe '-w') that recompiles + reruns the
 // code if any files have changed similar to ghcid.
 
+// Set by -p
+static bool profile_allocations = false;
+// Set by -c
+static char *output_filename = NULL;
+
+static bool has_suffix(char *string, char *suffix)
+{
+    size_t length = strlen(string);
+    size_t suffix_length = strlen(suffix);
+    return length >= suffix_length && strcmp(string + length - suffix_length, suffix) == 0;
+}
+
 DelProgram compile_with_args(DelCompiler compiler, int argc, char *argv[])
 {
+    while (argc >= 2) {
+        if (strcmp(argv[1], "-p") == 0) {
+            profile_allocations = true;
+        } else if (strcmp(argv[1], "-l") == 0) {
+            del_compiler_set_mode(compiler, DEL_COMPILE_LAZY);
+        } else if (strcmp(argv[1], "-L") == 0) {
+            del_compiler_set_mode(compiler, DEL_COMPILE_LAZY_TYPECHECK);
+        } else if (strcmp(argv[1], "-c") == 0) {
+            if (argc < 3) {
+                printf("Error: must supply a file to compile to\n");
+                return 0;
+            }
+            output_filename = argv[2];
+            argc--;
+            argv++;
+        } else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
     if (argc < 2) {
         printf("Error: must supply an argument\n");
         printf("Example: `del examples/hello.del`\n");
@@ -17,6 +50,11 @@ DelProgram compile_with_args(DelCompiler compiler, int argc, char *argv[])
         printf("Usage: del [options] [script]\n");
         printf("Options:\n");
         printf("  -e stuff   execute string 'stuff'\n");
+        printf("  -p         print where the script allocated memory when it exits\n");
+        printf("  -c file    compile the script to file instead of running it\n");
+        printf("  -l         compile each function the first time it's called\n");
+        printf("  -L         typecheck and compile each function the first time it's called\n");
+        printf("Scripts ending in .delc are run as compiled by -c, without compiling them again\n");
         return 0;
     }
     if (strcmp(argv[1], "-e") == 0) {
@@ -36,6 +74,9 @@ DelProgram compile_with_args(DelCompiler compiler, int argc, char *argv[])
         printf("Error: too many arguments\n");
         return 0;
     }
+    if (has_suffix(argv[1], ".delc")) {
+        return del_program_load(compiler, argv[1]);
+    }
     return del_compile_file(compiler, argv[1]);
 }
 
@@ -97,11 +138,19 @@ int main(int argc, char *argv[])
         del_compiler_free(compiler);
         return EXIT_FAILURE;
     }
-    del_compiler_free(compiler);
+    if (output_filename != NULL) {
+        bool is_saved = del_program_save(program, output_filename, stderr);
+        del_program_free(program);
+        del_compiler_free(compiler);
+        return is_saved ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     // Run
     DelVM vm;
-    del_vm_init(&vm, stdout, stderr, program);
+    struct DelVMSettings settings;
+    del_vm_default_settings(&settings);
+    settings.profile_allocations = profile_allocations;
+    del_vm_init_with_settings(&vm, stdout, stderr, program, &settings);
     del_vm_execute(vm);
     // while (del_vm_status(vm) == DEL_VM_STATUS_YIELD) {
     //     printf("Resuming after yield...\n");
@@ -110,14 +159,28 @@ int main(int argc, char *argv[])
     // printf("Finished!\n");
     // printf("Number we added earlier: %f\n", del_val_context);
 
-    if (del_vm_status(vm) == DEL_VM_STATUS_ERROR) {
+    // See how much memory the script used
+    // struct DelVMStats stats;
+    // del_vm_stats(vm, &stats);
+    // printf("%lu bytes allocated, %lu collections taking %lu ns\n", stats.bytes_allocated,
+    //         stats.collections, stats.total_pause_ns);
+
+    if (profile_allocations) {
+        del_vm_print_allocation_profile(vm, stderr);
+    }
+
+    enum DelVirtualMachineStatus status = del_vm_status(vm);
+    if (status == DEL_VM_STATUS_ERROR || status == DEL_VM_STATUS_OUT_OF_MEMORY) {
         del_vm_free(vm);
         del_program_free(program);
+        del_compiler_free(compiler);
         return EXIT_FAILURE;
     }
 
+    // Freed last, since a lazily compiled program compiles the rest of itself as it runs
     del_vm_free(vm);
     del_program_free(program);
+    del_compiler_free(compiler);
     return EXIT_SUCCESS;
 }
 
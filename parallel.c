@@ -0,0 +1,113 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "common.h"
+#include "parallel.h"
+
+// More chunks than workers, so that a worker that gets easy chunks can pick up the slack
+#define CHUNKS_PER_WORKER 4
+
+struct Pool {
+    ParallelJob job;
+    void *context;
+    pthread_mutex_t lock;
+    size_t next;   // The next chunk to hand out
+    size_t chunks; // Chunks from here on aren't handed out
+    bool is_success;
+};
+
+struct Worker {
+    struct Pool *pool;
+    size_t index;
+    pthread_t thread;
+};
+
+/* How many threads to split items between */
+size_t parallel_workers(size_t items)
+{
+    long threads = COMPILE_THREADS;
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads <= 0) {
+        threads = 1;
+    }
+    size_t workers = items / PARALLEL_COMPILE_MIN;
+    if (workers > (size_t) threads) {
+        workers = threads;
+    }
+    return workers == 0 ? 1 : workers;
+}
+
+size_t parallel_chunks(size_t workers, size_t items)
+{
+    size_t chunks = workers == 1 ? 1 : CHUNKS_PER_WORKER * workers;
+    if (chunks > items) {
+        chunks = items;
+    }
+    return chunks == 0 ? 1 : chunks;
+}
+
+static bool next_chunk(struct Pool *pool, size_t *chunk)
+{
+    pthread_mutex_lock(&(pool->lock));
+    bool has_chunk = pool->next < pool->chunks;
+    if (has_chunk) {
+        *chunk = pool->next++;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    return has_chunk;
+}
+
+static void stop_after(struct Pool *pool, size_t chunk)
+{
+    pthread_mutex_lock(&(pool->lock));
+    if (chunk + 1 < pool->chunks) {
+        pool->chunks = chunk + 1;
+    }
+    pool->is_success = false;
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+static void run_worker(struct Worker *worker)
+{
+    struct Pool *pool = worker->pool;
+    size_t chunk;
+    while (next_chunk(pool, &chunk)) {
+        if (!pool->job(pool->context, worker->index, chunk)) {
+            stop_after(pool, chunk);
+        }
+    }
+}
+
+static void *worker_thread(void *data)
+{
+    run_worker(data);
+    return NULL;
+}
+
+/* Returns false if any job did. If a thread can't be started, the ones that were do the work. */
+bool parallel_run(size_t workers, size_t chunks, ParallelJob job, void *context)
+{
+    struct Pool pool = { .job = job, .context = context, .next = 0, .chunks = chunks,
+        .is_success = true };
+    pthread_mutex_init(&(pool.lock), NULL);
+    struct Worker *threads = calloc(workers, sizeof(*threads));
+    size_t started = 1;
+    for (size_t i = 1; i < workers; i++) {
+        threads[i].pool = &pool;
+        threads[i].index = i;
+        if (pthread_create(&(threads[i].thread), NULL, worker_thread, &(threads[i])) != 0) {
+            break;
+        }
+        started++;
+    }
+    threads[0].pool = &pool;
+    threads[0].index = 0;
+    run_worker(&(threads[0]));
+    for (size_t i = 1; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    pthread_mutex_destroy(&(pool.lock));
+    free(threads);
+    return pool.is_success;
+}
@@ -0,0 +1,25 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "common.h"
+
+/* Splits a list of items into chunks and runs a job on each chunk over a few threads.
+ *
+ * job(context, worker, chunk) is called once for each chunk in [0, chunks), from one of the
+ * workers: worker 0 is the calling thread, and any state a job keeps per worker (an allocator,
+ * say) can be indexed by worker. Chunks are handed out in order, so when a job returns false
+ * the chunks after it that haven't started yet are skipped, but every chunk before it still
+ * runs to the end. */
+typedef bool (*ParallelJob)(void *context, size_t worker, size_t chunk);
+
+size_t parallel_workers(size_t items);
+size_t parallel_chunks(size_t workers, size_t items);
+bool parallel_run(size_t workers, size_t chunks, ParallelJob job, void *context);
+
+/* The first item in a chunk. Chunk c holds items [chunk_start(c), chunk_start(c + 1)). */
+static inline size_t chunk_start(size_t chunk, size_t chunks, size_t items)
+{
+    return chunk * items / chunks;
+}
+
+#endif
@@ -31,8 +31,7 @@ static inline bool parser_peek(struct Globals *globals, enum TokenType match)
     if (globals->parser == NULL) {
         return false;
     }
-    struct Token *token = globals->parser->value;
-    return token->type == match;
+    return globals->parser->type == match;
 }
 
 // Parses one or more tokens on success, does not consume tokens on failure
@@ -41,23 +40,17 @@ static bool parser_match(struct Globals *globals, enum TokenType *matches, size_
     if (globals->parser == NULL) {
         return false;
     }
-    struct LinkedListNode *head = globals->parser;
-    size_t i = 0;
-    linkedlist_foreach(lnode, head) {
-        if (i >= matches_length) {
-            break;
-        }
-        struct Token *token = lnode->value;
-        if (token->type != matches[i]) {
+    struct Token *head = globals->parser;
+    struct Token *end = globals->lexer->tokens->values + globals->lexer->tokens->length;
+    if ((size_t) (end - head) < matches_length) {
+        return false;
+    }
+    for (size_t i = 0; i < matches_length; i++) {
+        if (head[i].type != matches[i]) {
             return false;
         }
-        i++;
-        head = lnode;
-    }
-    if (i < matches_length) {
-        return false;
     }
-    globals->parser = head->next;
+    globals->parser = head + matches_length == end ? NULL : head + matches_length;
     return true;
 }
 
@@ -69,22 +62,10 @@ static inline bool match(struct Globals *globals, enum TokenType match)
     return parser_match(globals, &match, 1);
 }
 
-static struct LinkedListNode *nth_lnode(struct LinkedListNode *head, int num)
-{
-    int i = 1; // starting index at 1 to match flex/bison
-    linkedlist_foreach(lnode, head) {
-        if (i == num) {
-            return lnode;
-        }
-        i++;
-    }
-    return NULL;
-}
-
-static inline struct Token *nth_token(struct LinkedListNode *head, int num)
+// Only used on tokens that have already been matched, so it doesn't need a bounds check
+static inline struct Token *nth_token(struct Token *head, int num)
 {
-    struct LinkedListNode *lnode = nth_lnode(head, num);
-    return lnode == NULL ? NULL : lnode->value;
+    return &(head[num - 1]); // starting index at 1 to match flex/bison
 }
 
 // Cursed helper function for parsing expressions.
@@ -220,12 +201,16 @@ static Types *parse_type_args(struct Globals *globals)
     }
     Types *types = linkedlist_new(globals->allocator);
     do {
+        bool soa = match(globals, ST_SOA);
         Type type = parse_type(globals);
         if (type == TYPE_UNDEFINED) {
             return NULL;
         } else if (is_array(type)) {
             error_parser(globals, "Array may not contain other arrays");
             return NULL;
+        } else if (soa) {
+            // The typechecker makes sure this is an array of structs
+            type |= TYPE_SOA;
         }
         Type *type_ptr = allocator_malloc(globals->allocator, sizeof(*type_ptr));
         *type_ptr = type;
@@ -265,7 +250,7 @@ static struct Value *parse_constructor(struct Globals *globals, Symbol symbol)
 static struct Value *parse_property_access(struct Globals *globals, struct Value *val)
 {
     while (true) {
-        struct LinkedListNode *old_head = globals->parser;
+        struct Token *old_head = globals->parser;
         if (match(globals, ST_OPEN_PAREN)) {
             if (val->vtype != VTYPE_GET_LOCAL) {
                 printf("Error: accessor to function or classes not implemented\n");
@@ -332,7 +317,7 @@ static struct Value *parse_subexpr(struct Globals *globals)
         return NULL;
     }
     struct Value *val = NULL;
-    struct LinkedListNode *old_head = globals->parser;
+    struct Token *old_head = globals->parser;
     if (match(globals, T_INT)) {
         val = new_integer(globals, nth_token(old_head, 1)->integer);
     } else if (match(globals, T_FLOAT)) {
@@ -391,7 +376,7 @@ static struct Value *parse_unaryexpr(struct Globals *globals)
 // {
 //     Definitions *defs = linkedlist_new(globals->allocator);
 //     do {
-//         struct LinkedListNode *old_head = globals->parser;
+//         struct Token *old_head = globals->parser;
 //         if (match(globals, T_SYMBOL)) {
 //             Symbol symbol = nth_token(old_head, 1)->symbol;
 //             linkedlist_append(defs, new_define(globals, symbol, TYPE_UNDEFINED));
@@ -409,7 +394,7 @@ static struct Statement *parse_line(struct Globals *globals)
         error_parser(globals, "Unexpected end of input. Expected start of statement");
         return NULL;
     }
-    struct LinkedListNode *old_head = globals->parser;
+    struct Token *old_head = globals->parser;
     if (match(globals, ST_LET)) {
         Definitions *defs = NULL;
         enum TokenType matches[] = { T_SYMBOL, ST_EQ };
@@ -644,7 +629,7 @@ static Type parse_object_type(struct Globals *globals, Symbol symbol)
 
 static Type parse_type(struct Globals *globals)
 {
-    struct LinkedListNode *old_head = globals->parser;
+    struct Token *old_head = globals->parser;
     if (match(globals, ST_INT)) {
         return TYPE_INT;
     } else if (match(globals, ST_FLOAT)) {
@@ -655,6 +640,10 @@ static Type parse_type(struct Globals *globals)
         return TYPE_STRING;
     } else if (match(globals, ST_BYTE)) {
         return TYPE_BYTE;
+    } else if (match(globals, ST_INT32)) {
+        return TYPE_INT32;
+    } else if (match(globals, ST_FLOAT32)) {
+        return TYPE_FLOAT32;
     } else if (match(globals, T_SYMBOL)) {
         Symbol symbol = nth_token(old_head, 1)->symbol;
         return parse_object_type(globals, symbol);
@@ -665,7 +654,7 @@ static Type parse_type(struct Globals *globals)
 
 static struct Definition *parse_definition(struct Globals *globals)
 {
-    struct LinkedListNode *old_head = globals->parser;
+    struct Token *old_head = globals->parser;
     Type type = TYPE_UNDEFINED;
     if (!match(globals, T_SYMBOL)) {
         error_parser(globals, "Expected variable name");
@@ -716,7 +705,7 @@ static Definitions *parse_fundef_args(struct Globals *globals)
 
 static struct TopLevelDecl *parse_fundef(struct Globals *globals)
 {
-    struct LinkedListNode *old_head = globals->parser;
+    struct Token *old_head = globals->parser;
     if (match(globals, T_SYMBOL)) {
         Symbol funname = nth_token(old_head, 1)->symbol;
         if (is_builtin(funname)) {
@@ -746,7 +735,7 @@ static struct TopLevelDecl *parse_fundef(struct Globals *globals)
 static bool parse_class_definition(struct Globals *globals, Definitions *definitions,
         TopLevelDecls *methods)
 {
-    struct LinkedListNode *old_head = globals->parser;
+    struct Token *old_head = globals->parser;
     Type type = TYPE_UNDEFINED;
     char *err_msg = "expected property or method name";
     if (parser_peek(globals, ST_FUNCTION) || parser_peek(globals, ST_GET)
@@ -780,9 +769,9 @@ static bool parse_class_definition(struct Globals *globals, Definitions *definit
     return false;
 }
 
-static struct TopLevelDecl *parse_class(struct Globals *globals)
+static struct TopLevelDecl *parse_class(struct Globals *globals, bool is_struct)
 {
-    struct LinkedListNode *old_head = globals->parser;
+    struct Token *old_head = globals->parser;
     if (!match(globals, T_SYMBOL)) {
         error_parser(globals, "Expected class name");
         return NULL;
@@ -790,7 +779,7 @@ static struct TopLevelDecl *parse_class(struct Globals *globals)
     Symbol class_name = nth_token(old_head, 1)->symbol;
     Definitions *definitions = linkedlist_new(globals->allocator);
     TopLevelDecls *methods = linkedlist_new(globals->allocator);
-    struct TopLevelDecl *tld = new_class(globals, class_name, definitions, methods);
+    struct TopLevelDecl *tld = new_class(globals, class_name, definitions, methods, is_struct);
     if (!match(globals, ST_OPEN_BRACE)) {
         error_parser(globals, "Expected '{'");
         return NULL;
@@ -813,9 +802,11 @@ static struct TopLevelDecl *parse_tld(struct Globals *globals)
     if (match(globals, ST_FUNCTION)) {
         tld = parse_fundef(globals);
     } else if (match(globals, ST_CLASS)) {
-        tld = parse_class(globals);
+        tld = parse_class(globals, false);
+    } else if (match(globals, ST_STRUCT)) {
+        tld = parse_class(globals, true);
     } else {
-        error_parser(globals, "Expected function or class.");
+        error_parser(globals, "Expected function, class or struct.");
     }
     return tld;
 }
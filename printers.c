@@ -2,6 +2,7 @@
 #include "linkedlist.h"
 #include "printers.h"
 #include "vector.h"
+#include "heap_ptr.h"
 
 static void print_statements_indent(struct Globals *globals, Statements *stmts, int indent);
 static void print_definitions(struct Globals *globals, struct LinkedList *lst, char sep, int indent);
@@ -20,7 +21,7 @@ void print_instructions(struct CompilerContext *cc)
         comment = linkedlist_pop(comments);
     }
     size_t index;
-    DelValue val1, val2;
+    DelValue val1;
     for (size_t i = 0; i < length; i++) {
         while (comment != NULL && comment->location == i) {
             printf("// %s\n", comment->comment);
@@ -43,16 +44,31 @@ void print_instructions(struct CompilerContext *cc)
             case DUP:
                 printf("DUP\n");
                 break;
-            case PUSH_HEAP:
+            case DUP_OBJ:
+                printf("DUP_OBJ\n");
+                break;
+            case NEW:
                 i++;
                 val1 = instructions->values[i];
+                printf("NEW %lu (class id, %lu fields)\n", val1.offset,
+                        cc->layouts[val1.offset].field_count);
+                break;
+            case NEW_IN_FRAME:
                 i++;
-                val2 = instructions->values[i];
-                printf("PUSH_HEAP %lu (count), %lu (metadata)\n", val1.offset, val2.offset);
+                val1 = instructions->values[i];
+                i++;
+                printf("NEW_IN_FRAME %lu (class id, %lu fields) %lu (frame offset)\n", val1.offset,
+                        cc->layouts[val1.offset].field_count, instructions->values[i].offset);
                 break;
             case PUSH_ARRAY:
                 printf("PUSH_ARRAY\n");
                 break;
+            case NEW_ARRAY_FROM_CONST:
+                i++;
+                val1 = instructions->values[i];
+                printf("NEW_ARRAY_FROM_CONST %lu (%lu elements)\n", val1.offset,
+                        cc->const_arrays[val1.offset].count);
+                break;
             case LEN_ARRAY:
                 printf("LEN_ARRAY\n");
                 break;
@@ -99,6 +115,10 @@ void print_instructions(struct CompilerContext *cc)
             case RET:
                 printf("RET\n");
                 break;
+            case RET_STRUCT:
+                i++;
+                printf("RET_STRUCT %" PRIu64 "\n", instructions->values[i].offset);
+                break;
             case POP:
                 printf("POP\n");
                 break;
@@ -168,6 +188,10 @@ void print_instructions(struct CompilerContext *cc)
                 void *function = (void *)instructions->values[i].pointer;
                 printf("CALL args %lu, context %p, function %p\n", num_args, context, function);
                 break;
+            case COMPILE:
+                i++;
+                printf("COMPILE function %" PRIu64 "\n", instructions->values[i].offset);
+                break;
             case EQ_OBJ:
                 printf("EQ_OBJ\n");
                 break;
@@ -193,22 +217,32 @@ void print_instructions(struct CompilerContext *cc)
             case GET_HEAP:
                 i++;
                 index = instructions->values[i].offset;
-                printf("GET_HEAP %" PRIu64 "\n", index - index / 4 - 1);
+                printf("GET_HEAP %" PRIu64 "\n", index - OBJECT_HEADER_SLOTS);
                 break;
             case GET_HEAP_OBJ:
                 i++;
                 index = instructions->values[i].offset;
-                printf("GET_HEAP_OBJ %" PRIu64 "\n", index - index / 4 - 1);
+                printf("GET_HEAP_OBJ %" PRIu64 "\n", index - OBJECT_HEADER_SLOTS);
                 break;
             case SET_HEAP:
                 i++;
                 index = instructions->values[i].offset;
-                printf("SET_HEAP %" PRIu64 "\n", index - index / 4 - 1);
+                printf("SET_HEAP %" PRIu64 "\n", index - OBJECT_HEADER_SLOTS);
                 break;
             case SET_HEAP_OBJ:
                 i++;
                 index = instructions->values[i].offset;
-                printf("SET_HEAP_OBJ %" PRIu64 "\n", index - index / 4 - 1);
+                printf("SET_HEAP_OBJ %" PRIu64 "\n", index - OBJECT_HEADER_SLOTS);
+                break;
+            case INIT_FIELD:
+                i++;
+                index = instructions->values[i].offset;
+                printf("INIT_FIELD %" PRIu64 "\n", index - OBJECT_HEADER_SLOTS);
+                break;
+            case INIT_FIELD_OBJ:
+                i++;
+                index = instructions->values[i].offset;
+                printf("INIT_FIELD_OBJ %" PRIu64 "\n", index - OBJECT_HEADER_SLOTS);
                 break;
             case GET_ARRAY:
                 printf("GET_ARRAY\n");
@@ -222,6 +256,50 @@ void print_instructions(struct CompilerContext *cc)
             case SET_ARRAY_OBJ:
                 printf("SET_ARRAY_OBJ\n");
                 break;
+            case GET_ARRAY_BYTE:
+                printf("GET_ARRAY_BYTE\n");
+                break;
+            case SET_ARRAY_BYTE:
+                printf("SET_ARRAY_BYTE\n");
+                break;
+            case GET_ARRAY_BOOL:
+                printf("GET_ARRAY_BOOL\n");
+                break;
+            case SET_ARRAY_BOOL:
+                printf("SET_ARRAY_BOOL\n");
+                break;
+            case GET_ARRAY_INT32:
+                printf("GET_ARRAY_INT32\n");
+                break;
+            case SET_ARRAY_INT32:
+                printf("SET_ARRAY_INT32\n");
+                break;
+            case GET_ARRAY_FLOAT32:
+                printf("GET_ARRAY_FLOAT32\n");
+                break;
+            case SET_ARRAY_FLOAT32:
+                printf("SET_ARRAY_FLOAT32\n");
+                break;
+            case GET_ARRAY_STRUCT:
+                printf("GET_ARRAY_STRUCT %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", instructions->values[i + 1].offset,
+                        instructions->values[i + 2].offset, instructions->values[i + 3].offset);
+                i += 3;
+                break;
+            case SET_ARRAY_STRUCT:
+                printf("SET_ARRAY_STRUCT %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", instructions->values[i + 1].offset,
+                        instructions->values[i + 2].offset, instructions->values[i + 3].offset);
+                i += 3;
+                break;
+            case GET_ARRAY_SOA:
+                printf("GET_ARRAY_SOA %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", instructions->values[i + 1].offset,
+                        instructions->values[i + 2].offset, instructions->values[i + 3].offset);
+                i += 3;
+                break;
+            case SET_ARRAY_SOA:
+                printf("SET_ARRAY_SOA %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", instructions->values[i + 1].offset,
+                        instructions->values[i + 2].offset, instructions->values[i + 3].offset);
+                i += 3;
+                break;
             case EXIT:
                 printf("EXIT\n");
                 break;
@@ -235,14 +313,20 @@ void print_instructions(struct CompilerContext *cc)
                 printf("POP_SCOPE\n");
                 break;
             case DEFINE:
-                printf("DEFINE\n");
+                i++;
+                printf("DEFINE %" PRIu64 "\n", instructions->values[i].offset);
                 break;
             case DEFINE_OBJ:
-                printf("DEFINE_OBJ\n");
+                i++;
+                printf("DEFINE_OBJ %" PRIu64 "\n", instructions->values[i].offset);
                 break;
             case PRINT:
                 printf("PRINT\n");
                 break;
+            case PRINT_STRUCT:
+                i++;
+                printf("PRINT_STRUCT %" PRIu64 "\n", instructions->values[i].offset);
+                break;
             case READ:
                 printf("READ\n");
                 break;
@@ -300,14 +384,13 @@ void print_frames(struct StackFrames *sfs, bool is_obj)
 
 void print_heap(struct Heap *heap)
 {
-    struct Vector *vector = heap->vector;
     printf("heap: [ gc threshold: %lu bytes, memory usage: %lu bytes, ",
             IN_BYTES(heap->gc_threshold),
-            IN_BYTES(vector->length));
+            IN_BYTES(heap->length));
     printf("values: { "); 
-    for (size_t i = 0; i < vector->length; i++) {
-        printf("%" PRIu64 "", vector->values[i].integer);
-        if (i != vector->length - 1) printf(", ");
+    for (size_t i = 0; i < heap->length; i++) {
+        printf("%" PRIu64 "", heap->values[i].integer);
+        if (i != heap->length - 1) printf(", ");
     }
     printf(" } ]\n");
 }
@@ -732,9 +815,9 @@ void print_ft_node(struct Globals *globals, struct FunctionCallTableNode *fn)
 void print_ft(struct Globals *globals, struct FunctionCallTable *ft)
 {
     if (ft == NULL) return;
-    print_ft_node(globals, ft->node);
-    print_ft(globals, ft->left);
-    print_ft(globals, ft->right);
+    ft_foreach(node, ft) {
+        print_ft_node(globals, node);
+    }
 }
 
 void print_scope(struct Globals *globals, struct Scope *scope)
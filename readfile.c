@@ -1,34 +1,55 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "common.h"
 #include "allocator.h"
 #include "readfile.h"
 
-// Populates FileContext on success
+// Populates FileContext on success. The file is mapped rather than read into memory. The
+// mapping is one byte longer than the file, and that byte is anonymous memory, so the input is
+// null terminated even when the file ends on a page boundary.
 bool readfile(struct Globals *globals, struct FileContext *file)
 {
-    FILE *fp = fopen(file->filename, "r");
-    if (!fp) {
+    (void) globals;
+    int fd = open(file->filename, O_RDONLY);
+    if (fd == -1) {
         printf("Error: could not open file '%s'\n", file->filename);
         return false;
     }
     char *generic_error = "Error: encountered error while reading file\n";
-    if (fseek(fp, 0, SEEK_END) != 0) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
         printf("%s", generic_error);
+        close(fd);
         return false;
     }
-    file->length = ftell(fp);
-    if (file->length == -1) {
+    file->length = st.st_size;
+    char *input = mmap(NULL, file->length + 1, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (input == MAP_FAILED) {
         printf("%s", generic_error);
+        close(fd);
         return false;
     }
-    rewind(fp);
-
-    file->input = allocator_malloc(globals->allocator, file->length + 1);
-    if ((long) fread(file->input, 1, file->length, fp) != file->length) {
+    if (file->length > 0 && mmap(input, file->length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
         printf("%s", generic_error);
+        munmap(input, file->length + 1);
+        close(fd);
         return false;
     }
-    fclose(fp);
-
-    (file->input)[file->length] = '\0';
+    close(fd);
+    file->input = input;
+    file->is_mapped = true;
     return true;
 }
+
+void closefile(struct FileContext *file)
+{
+    if (file->is_mapped) {
+        munmap(file->input, file->length + 1);
+    }
+    file->input = NULL;
+    file->is_mapped = false;
+}
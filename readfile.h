@@ -8,8 +8,11 @@ struct FileContext {
     long length;
     // Stores contents of file being parsed
     char *input;
+    // Whether input is a mapping of the file that closefile has to unmap
+    bool is_mapped;
 };
 
 bool readfile(struct Globals *globals, struct FileContext *file);
+void closefile(struct FileContext *file);
 
 #endif
@@ -21,6 +21,13 @@
 #define DO_WE_HAVE_EXPECT() printf("__builtin_expect disabled\n")
 #endif
 
+// For slow paths that shouldn't be inlined into the VM's main loop
+#if defined(__GNUC__)
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
 #ifndef THREADED_CODE_ENABLED
 #define THREADED_CODE_ENABLED 1
 #endif
@@ -32,6 +39,30 @@
 #define DO_WE_HAVE_THREADING() printf("threading disabled\n")
 #endif
 
+// Lets the lexer scan 16 characters at a time where SSE2 is available
+#ifndef SIMD_ENABLED
+#define SIMD_ENABLED 1
+#endif
+
+#if SIMD_ENABLED && defined(__SSE2__)
+#define LEXER_SSE2 1
+#define DO_WE_HAVE_SIMD() printf("sse2 lexer enabled\n")
+#else
+#define LEXER_SSE2 0
+#define DO_WE_HAVE_SIMD() printf("sse2 lexer disabled\n")
+#endif
+
+// Function bodies are typechecked and compiled on up to COMPILE_THREADS threads, or one per
+// core when it's 0. A thread is only started for every PARALLEL_COMPILE_MIN functions, since
+// small programs compile faster than threads start.
+#ifndef COMPILE_THREADS
+#define COMPILE_THREADS 0
+#endif
+
+#ifndef PARALLEL_COMPILE_MIN
+#define PARALLEL_COMPILE_MIN 64
+#endif
+
 #if DEBUG_ALL
 #define DEBUG_GENERAL 1
 #define DEBUG_TEXT 1
@@ -72,13 +103,37 @@
 // maximum allowed size of a program input file.
 #define INSTRUCTIONS_MAX        UINT64_MAX
 #define STACK_MAX               1000
+#define FRAME_OBJECTS_MAX       (8 * STACK_MAX)
 // #define HEAP_MAX                1024
 #define HEAP_INIT               128
 #define HEAP_MAX                UINT64_MAX
 #define ERROR_MESSAGE_MAX       250
 #define GC_GROWTH_FACTOR 2
+// After a collection the heap gets to grow by growth percent of what's in use before the next
+// one. Growth starts at GC_GROWTH_PERCENT_INIT, doubles whenever more than GC_SURVIVAL_HIGH
+// percent of the heap survives a collection, and halves whenever less than GC_SURVIVAL_LOW
+// percent does, staying between GC_GROWTH_PERCENT_MIN and GC_GROWTH_PERCENT_MAX.
+#define GC_GROWTH_PERCENT_INIT  100
+#define GC_GROWTH_PERCENT_MIN   25
+#define GC_GROWTH_PERCENT_MAX   400
+#define GC_SURVIVAL_HIGH        50
+#define GC_SURVIVAL_LOW         10
+// Arrays at least this many slots big are allocated (and collected) separately from the main
+// heap, and are never copied. The large object space starts collecting once it holds
+// LARGE_OBJECT_GC_INIT such arrays' worth of slots.
+#define LARGE_OBJECT_SLOTS      8192
+#define LARGE_OBJECT_GC_INIT    8
+
+// Build with GC_NONMOVING=1 to allocate from per-size free lists and collect with mark and sweep
+// instead of copying (see heap.h), so objects never move once they're allocated. Objects of up
+// to SIZE_CLASS_SLOTS_MAX slots each get a size class, carved out of blocks of BLOCK_SLOTS slots.
+#ifndef GC_NONMOVING
+#define GC_NONMOVING 0
+#endif
+#define SIZE_CLASS_SLOTS_MAX    128
+#define BLOCK_SLOTS             1024
 
-#define IN_BYTES(val) (8 * val)
+#define IN_BYTES(val) (8 * (val))
 #define INSTRUCTIONS_MAX_BYTES        IN_BYTES(INSTRUCTIONS_MAX)
 #define STACK_MAX_BYTES               IN_BYTES(STACK_MAX)
 #define HEAP_MAX_BYTES                IN_BYTES(HEAP_MAX)
@@ -1,8 +1,37 @@
+# Runs test/<name>.del, with any extra arguments, and compares what it prints with test/<name>.out
+function expect {
+    local name=$1
+    shift
+    if ./del "$@" "test/$name.del" 2>&1 | diff -u "test/$name.out" -; then
+        echo "passed: $name"
+    else
+        echo "FAILED: $name"
+        failed=1
+    fi
+}
+
 function runtests {
-    ./del test/gc.del
-    echo $?
+    failed=0
+    expect gc
+    expect escape
+    expect locals
+    expect frame_objects
+    expect frame_full
+    expect packed_arrays
+    expect large_objects
+    expect layouts
+    expect const_arrays
+    expect structs
+    expect size_classes
+    expect big_objects
+    expect profile -p
+    make -s host_test && ./host_test || failed=1
+    return $failed
 }
 
 make clean
-make && runtests
+make && runtests || exit 1
 
+# Again with the non-moving heap
+make clean
+make CPPFLAGS=-DGC_NONMOVING=1 && runtests
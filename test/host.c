@@ -0,0 +1,202 @@
+// Tests of the embedding API, for what a del script can't check on its own. Each test runs a
+// script with the given VM settings and checks the VM's status and statistics afterwards.
+//
+// Usage: make host_test && ./host_test
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "del.h"
+#include "bytecode.h"
+
+struct Result {
+    enum DelVirtualMachineStatus status;
+    struct DelVMStats stats; // Only the counters, the class arrays are gone with the VM
+};
+
+static bool run(const char *source, const struct DelVMSettings *settings, struct Result *result)
+{
+    DelCompiler compiler;
+    del_compiler_init(&compiler, stderr);
+    DelProgram program = del_compile_text(compiler, (char *) source);
+    if (!program) {
+        del_compiler_free(compiler);
+        return false;
+    }
+    DelVM vm;
+    del_vm_init_with_settings(&vm, stdout, stderr, program, settings);
+    del_vm_execute(vm);
+    result->status = del_vm_status(vm);
+    del_vm_stats(vm, &(result->stats));
+    del_vm_free(vm);
+    del_program_free(program);
+    del_compiler_free(compiler);
+    return true;
+}
+
+static bool check(const char *name, bool passed)
+{
+    printf("%s: %s\n", passed ? "passed" : "FAILED", name);
+    return passed;
+}
+
+// Large arrays count towards heap_bytes in bytes, like everything else
+static bool test_large_heap_bytes(void)
+{
+    struct DelVMSettings settings;
+    del_vm_default_settings(&settings);
+    struct Result result;
+    bool ran = run("function main() { let big = new Array<int>(30000); big[0] = 1; }",
+            &settings, &result);
+    return check("large_heap_bytes", ran && result.status == DEL_VM_STATUS_COMPLETED
+            && result.stats.heap_bytes >= 240000 && result.stats.heap_bytes < 250000);
+}
+
+// Runs source with a 64KB heap, which it has to stay under
+static bool run_capped(const char *source, struct Result *result)
+{
+    struct DelVMSettings settings;
+    del_vm_default_settings(&settings);
+    settings.heap_init_bytes = 8192;
+    settings.heap_max_bytes = 65536;
+    return run(source, &settings, result);
+}
+
+static bool test_max_bytes_large(void)
+{
+    struct Result result;
+    bool ran = run_capped(
+            "function main() {\n"
+            "    let a = new Array<int>(10000);\n"
+            "    let b = new Array<int>(10000);\n"
+            "    let c = new Array<int>(10000);\n"
+            "}", &result);
+    return check("max_bytes_large", ran && result.status == DEL_VM_STATUS_OUT_OF_MEMORY);
+}
+
+static bool test_max_bytes_small(void)
+{
+    struct Result result;
+    bool ran = run_capped(
+            "class Node { value: int; next: Node; }\n"
+            "function main() {\n"
+            "    let head = new Node(0, null);\n"
+            "    for (let i = 0; i < 10000; i++) {\n"
+            "        head = new Node(i, head);\n"
+            "    }\n"
+            "}", &result);
+    return check("max_bytes_small", ran && result.status == DEL_VM_STATUS_OUT_OF_MEMORY);
+}
+
+// Garbage doesn't count against the cap, and arrays that fit under it are fine
+static bool test_max_bytes_fits(void)
+{
+    struct Result result;
+    bool ran = run_capped(
+            "class Node { value: int; next: Node; }\n"
+            "function main() {\n"
+            "    let a = new Array<int>(2000);\n"
+            "    for (let i = 0; i < 10; i++) {\n"
+            "        let b = new Array<int>(2000);\n"
+            "    }\n"
+            "    for (let i = 0; i < 10000; i++) {\n"
+            "        let head = new Node(i, null);\n"
+            "        head = new Node(i, head);\n"
+            "    }\n"
+            "}", &result);
+    return check("max_bytes_fits", ran && result.status == DEL_VM_STATUS_COMPLETED
+            && result.stats.heap_bytes <= 65536);
+}
+
+// Saves source compiled to a .delc file, lets corrupt change its instructions, and returns
+// whether the file still loads
+static bool loads_after(const char *source, void (*corrupt)(uint64_t *instructions))
+{
+    char *filename = "host_test.delc";
+    FILE *ferr = fopen("/dev/null", "w");
+    DelCompiler compiler;
+    del_compiler_init(&compiler, ferr);
+    DelProgram program = del_compile_text(compiler, (char *) source);
+    if (!program) {
+        del_compiler_free(compiler);
+        fclose(ferr);
+        return false;
+    }
+    bool loaded = del_program_save(program, filename, stderr);
+    del_program_free(program);
+    FILE *fp = fopen(filename, "r+b");
+    if (loaded && fp != NULL) {
+        // The header starts with the magic number, version, byte order, opcode count and file
+        // length, followed by the instructions' offset and count
+        uint64_t section[2];
+        fseek(fp, 24, SEEK_SET);
+        loaded = fread(section, sizeof(section), 1, fp) == 1;
+        uint64_t *instructions = calloc(section[1] + 1, sizeof(*instructions));
+        fseek(fp, section[0], SEEK_SET);
+        loaded = loaded && fread(instructions, sizeof(*instructions), section[1], fp) == section[1];
+        if (corrupt != NULL) {
+            corrupt(instructions);
+        }
+        fseek(fp, section[0], SEEK_SET);
+        loaded = loaded
+            && fwrite(instructions, sizeof(*instructions), section[1], fp) == section[1];
+        free(instructions);
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    program = loaded ? del_program_load(compiler, filename) : 0;
+    loaded = program;
+    if (program) {
+        del_program_free(program);
+    }
+    del_compiler_free(compiler);
+    fclose(ferr);
+    remove(filename);
+    return loaded;
+}
+
+// The entry point is PUSH <return address>, PUSH_SCOPE, JMP main, and main starts with a NEW
+static const char *corrupted_source =
+        "class Node { value: int; next: Node; }\n"
+        "function value(node: Node): int { return node.value; }\n"
+        "function main() { let node = new Node(1, null); println(value(node)); }";
+
+static void corrupt_opcode(uint64_t *instructions)
+{
+    instructions[0] = 1000;
+}
+
+static void corrupt_jump(uint64_t *instructions)
+{
+    if (instructions[3] == JMP) {
+        instructions[4] = 1; // The middle of the PUSH
+    }
+}
+
+static void corrupt_class_id(uint64_t *instructions)
+{
+    if (instructions[3] == JMP && instructions[instructions[4]] == NEW) {
+        instructions[instructions[4] + 1] = 1000;
+    }
+}
+
+static bool test_delc_operands(void)
+{
+    return check("delc_operands", loads_after(corrupted_source, NULL)
+            && !loads_after(corrupted_source, corrupt_opcode)
+            && !loads_after(corrupted_source, corrupt_jump)
+            && !loads_after(corrupted_source, corrupt_class_id));
+}
+
+int main(void)
+{
+    bool passed = true;
+    passed = test_large_heap_bytes() && passed;
+    passed = test_max_bytes_large() && passed;
+    passed = test_max_bytes_small() && passed;
+    passed = test_max_bytes_fits() && passed;
+    passed = test_delc_operands() && passed;
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -4,6 +4,7 @@
 #include "ast.h"
 #include "printers.h"
 #include "typecheck.h"
+#include "parallel.h"
 
 #define find_open_loc(i, table, length, symbol)\
     for (i = symbol % length; table[i].name != 0; i = i == length - 1 ? 0 : i + 1)
@@ -26,12 +27,12 @@ static bool typecheck_funcall(struct Globals *globals, struct TypeCheckerContext
 static Type typecheck_constructor(struct Globals *globals, struct TypeCheckerContext *context,
         struct Constructor *constructor);
 static Type typecheck_get_local(struct Globals *globals, struct TypeCheckerContext *context,
-        struct Definition *get_local);
+        struct Value *val);
 static Type typecheck_get_property(struct Globals *globals, struct TypeCheckerContext *context,
         struct GetProperty *get);
 static Type typecheck_get_index(struct Globals *globals, struct TypeCheckerContext *context,
         struct GetProperty *get);
-static bool typecheck_type(struct Globals *globals, struct TypeCheckerContext *context, Type type);
+static bool typecheck_type(struct Globals *globals, struct TypeCheckerContext *context, Type *type);
 
 #define table_lookup(table, length, symbol)\
     uint64_t i = symbol % length;\
@@ -48,6 +49,7 @@ struct Class *lookup_class(struct ClassTable *ct, Symbol symbol)
     if (ct->size == 0) {
         return NULL;
     }
+    symbol &= ~TYPE_STRUCT;
     table_lookup(ct->table, ct->size, symbol);
 }
 
@@ -76,6 +78,8 @@ static void enter_scope(struct Globals *globals, struct Scope **current, bool is
         scope->objcount = 0;
     }
     scope->definitions = linkedlist_new(globals->allocator);
+    scope->bucket_capacity = 0;
+    scope->buckets = NULL;
     scope->parent = *current;
     *current = scope;
 }
@@ -85,8 +89,55 @@ static void exit_scope(struct Scope **current)
     *current = (*current)->parent;
 }
 
+/* Searching a short list is quicker than hashing, so smaller scopes don't get a table */
+#define SCOPE_HASH_MIN 8
+
+static inline size_t bucket_index(Symbol name, size_t capacity)
+{
+    return ((name * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & (capacity - 1);
+}
+
+static void insert_bucket(struct Scope *scope, struct Definition *def)
+{
+    size_t i = bucket_index(def->name, scope->bucket_capacity);
+    while (scope->buckets[i] != NULL) {
+        i = (i + 1) & (scope->bucket_capacity - 1);
+    }
+    scope->buckets[i] = def;
+}
+
+static void index_definition(struct Globals *globals, struct Scope *scope,
+        struct Definition *def)
+{
+    size_t length = scope->definitions->length;
+    if (length <= SCOPE_HASH_MIN) {
+        return;
+    } else if (2 * length <= scope->bucket_capacity) {
+        insert_bucket(scope, def);
+        return;
+    }
+    // Old tables just stay in the allocator, which frees them along with everything else
+    scope->bucket_capacity = scope->bucket_capacity == 0 ? 4 * SCOPE_HASH_MIN
+        : 2 * scope->bucket_capacity;
+    scope->buckets = allocator_malloc(globals->allocator,
+            scope->bucket_capacity * sizeof(*(scope->buckets)));
+    struct Definition *indexed = NULL;
+    linkedlist_vforeach(indexed, scope->definitions) {
+        insert_bucket(scope, indexed);
+    }
+}
+
 static struct Definition *lookup_current_scope_var(struct Scope *scope, Symbol name)
 {
+    if (scope->buckets != NULL) {
+        size_t i = bucket_index(name, scope->bucket_capacity);
+        for (; scope->buckets[i] != NULL; i = (i + 1) & (scope->bucket_capacity - 1)) {
+            if (scope->buckets[i]->name == name) {
+                return scope->buckets[i];
+            }
+        }
+        return NULL;
+    }
     linkedlist_foreach(lnode, scope->definitions->head) {
         struct Definition *def = lnode->value;
         if (def->name == name) {
@@ -115,6 +166,12 @@ static bool is_in_loop(struct Scope *scope)
     return false;
 }
 
+/* Number of locals / fields / stack values a value of the given type takes up */
+size_t type_slots(struct ClassTable *ct, Type type)
+{
+    return is_struct(type) ? lookup_class(ct, type)->slot_count : 1;
+}
+
 static bool add_var(struct Globals *globals, struct TypeCheckerContext *context,
         struct Definition *def)
 {
@@ -124,14 +181,22 @@ static bool add_var(struct Globals *globals, struct TypeCheckerContext *context,
                 lookup_symbol(globals, def->name));
         return false;
     }
+    struct FunDef *fundef = context->enclosing_func;
     if (is_object(def->type)) {
         def->scope_offset = context->scope->objcount;
         context->scope->objcount++;
+        if (context->scope->objcount > fundef->max_objcount) {
+            fundef->max_objcount = context->scope->objcount;
+        }
     } else {
         def->scope_offset = context->scope->varcount;
-        context->scope->varcount++;
+        context->scope->varcount += type_slots(context->cls_table, def->type);
+        if (context->scope->varcount > fundef->max_varcount) {
+            fundef->max_varcount = context->scope->varcount;
+        }
     }
     linkedlist_append(context->scope->definitions, def);
+    index_definition(globals, context->scope, def);
     return true;
 }
 
@@ -364,6 +429,11 @@ static Type typecheck_new_array(struct Globals *globals, struct TypeCheckerConte
         fprintf(globals->ferr, "Error: Array expects 1 argument but got %" PRIu64 "\n", constructor_arg_count);
         return TYPE_UNDEFINED;
     }
+    Type *type_ptr = constructor->types->head->value;
+    Type type = array_of(*type_ptr);
+    if (!typecheck_type(globals, context, &type)) {
+        return TYPE_UNDEFINED;
+    }
     struct Value *arg = funcall->args->head->value;
     Type arg_type = typecheck_value(globals, context, arg);
     if (arg_type == TYPE_UNDEFINED) {
@@ -373,8 +443,7 @@ static Type typecheck_new_array(struct Globals *globals, struct TypeCheckerConte
                 lookup_symbol(globals, arg_type));
         return TYPE_UNDEFINED;
     }
-    Type *type_ptr = constructor->types->head->value;
-    return array_of(*type_ptr);
+    return type;
 }
 
 static bool oneof(Type t, Type t0, Type t1, Type t2)
@@ -388,7 +457,7 @@ static Type typecheck_cast(struct Globals *globals, struct TypeCheckerContext *c
     Type type = typecheck_value(globals, context, cast->value);
     if (type == TYPE_UNDEFINED) {
         return TYPE_UNDEFINED;
-    } else if (!typecheck_type(globals, context, cast->type)) {
+    } else if (!typecheck_type(globals, context, &(cast->type))) {
         return TYPE_UNDEFINED;
     } else if (type == cast->type) {
         char *type_str = lookup_symbol(globals, type);
@@ -490,7 +559,7 @@ static Type typecheck_value(struct Globals *globals, struct TypeCheckerContext *
             }
         }
         case VTYPE_GET_LOCAL:
-            val->type = typecheck_get_local(globals, context, val->get_local);
+            val->type = typecheck_get_local(globals, context, val);
             return val->type;
         case VTYPE_GET_PROPERTY:
             val->type = typecheck_get_property(globals, context, val->get_property);
@@ -523,17 +592,18 @@ static Type typecheck_value(struct Globals *globals, struct TypeCheckerContext *
     return TYPE_UNDEFINED; // Doing this to silence compiler warning, should never happen
 }
 
+/* Points the value at the variable's definition, so later passes can tell which uses refer to
+ * the same variable */
 static Type typecheck_get_local(struct Globals *globals, struct TypeCheckerContext *context,
-        struct Definition *get_local)
+        struct Value *val)
 {
-    struct Definition *def = lookup_var(context->scope, get_local->name);
+    struct Definition *def = lookup_var(context->scope, val->get_local->name);
     if (def == NULL) {
         fprintf(globals->ferr, "Error: Symbol '%s' is used before it is declared\n",
-                lookup_symbol(globals, get_local->name));
+                lookup_symbol(globals, val->get_local->name));
         return TYPE_UNDEFINED;
     }
-    get_local->type = def->type;
-    get_local->scope_offset = def->scope_offset;
+    val->get_local = def;
     return def->type;
 }
 
@@ -620,7 +690,7 @@ static Type typecheck_get_index(struct Globals *globals, struct TypeCheckerConte
                 lookup_symbol(globals, index_type));
         return TYPE_UNDEFINED;
     }
-    return type_of_array(array_type);
+    return widen_type(type_of_array(array_type));
 }
 
 static bool typecheck_setter(struct Globals *globals, struct TypeCheckerContext *context,
@@ -642,6 +712,14 @@ static bool typecheck_set_property(struct Globals *globals, struct TypeCheckerCo
         struct SetProperty *set)
 {
     Type type_get = typecheck_get_property(globals, context, set->access);
+    struct Value *accessor = set->access->accessor;
+    // A struct returned from a function or constructor doesn't live anywhere to be set
+    if (is_struct(accessor->type) && accessor->vtype != VTYPE_GET_LOCAL
+            && accessor->vtype != VTYPE_GET_PROPERTY && accessor->vtype != VTYPE_INDEX) {
+        fprintf(globals->ferr, "Error: cannot set property '%s' of a temporary struct\n",
+                lookup_symbol(globals, set->access->property));
+        return false;
+    }
     return typecheck_setter(globals, context, set, type_get);
 }
 
@@ -849,6 +927,9 @@ static bool typecheck_print(struct Globals *globals, struct TypeCheckerContext *
         Type val_type = typecheck_value(globals, context, val);
         if (val_type == TYPE_UNDEFINED) {
             return false;
+        } else if (is_array(val_type) && is_struct(type_of_array(val_type))) {
+            fprintf(globals->ferr, "Error: cannot print an array of structs\n");
+            return false;
         }
     }
     return true;
@@ -875,11 +956,12 @@ static Type typecheck_constructor(struct Globals *globals, struct TypeCheckerCon
         fprintf(globals->ferr, "Error: no class named %s\n", lookup_symbol(globals, funname));
         return TYPE_UNDEFINED;
     }
+    Type type = cls->is_struct ? (cls->name | TYPE_STRUCT) : cls->name;
 
     uint64_t class_def_count       = cls->definitions  == NULL ? 0 : cls->definitions->length;
     uint64_t constructor_arg_count = funcall->args == NULL ? 0 : funcall->args->length;
     if (class_def_count == 0 && constructor_arg_count == 0) {
-        return cls->name;
+        return type;
     } else if (class_def_count != constructor_arg_count) {
         fprintf(globals->ferr, "Error: %s expects %" PRIu64 " arguments but got %" PRIu64 "\n",
                 lookup_symbol(globals, cls->name),
@@ -909,7 +991,7 @@ static Type typecheck_constructor(struct Globals *globals, struct TypeCheckerCon
         vals = vals->next;
         defs = defs->next;
     }
-    return cls->name;
+    return type;
 }
 
 static bool typecheck_definitions(struct Globals *globals, struct TypeCheckerContext *context,
@@ -917,7 +999,7 @@ static bool typecheck_definitions(struct Globals *globals, struct TypeCheckerCon
 {
     linkedlist_foreach(lnode, defs->head) {
         struct Definition *def = lnode->value;
-        if (!typecheck_type(globals, context, def->type)) {
+        if (!typecheck_type(globals, context, &(def->type))) {
             return false;
         }
     }
@@ -928,7 +1010,7 @@ static bool typecheck_definitions(struct Globals *globals, struct TypeCheckerCon
 static bool typecheck_let(struct Globals *globals, struct TypeCheckerContext *context,
         Definitions *let)
 {
-    return scope_vars(globals, context, let) && typecheck_definitions(globals, context, let);
+    return typecheck_definitions(globals, context, let) && scope_vars(globals, context, let);
 }
 
 static bool typecheck_statement(struct Globals *globals, struct TypeCheckerContext *context,
@@ -1037,19 +1119,34 @@ static bool typecheck_entrypoint(struct Globals *globals, struct TypeCheckerCont
 }
 
 // Woah meta
-static bool typecheck_type(struct Globals *globals, struct TypeCheckerContext *context, Type type)
+// The parser can't tell structs from classes, so this also marks struct types as structs
+static bool typecheck_type(struct Globals *globals, struct TypeCheckerContext *context, Type *type)
 {
-    if (is_array(type)) {
-        type = type_of_array(type);
+    Type base = *type;
+    if (is_array(base)) {
+        base = type_of_array(base);
+    } else if (is_array_only_type(base)) {
+        fprintf(globals->ferr, "Error: type '%s' may only be used for array elements\n",
+                lookup_symbol(globals, base));
+        return false;
     }
-    if (is_object(type)) {
-        struct Class *cls = lookup_class(context->cls_table, type);
+    if (is_object(base) || is_struct(base)) {
+        struct Class *cls = lookup_class(context->cls_table, base);
         if (cls == NULL) {
             fprintf(globals->ferr, "Error: unknown type '%s'\n",
-                    lookup_symbol(globals, type));
+                    lookup_symbol(globals, base));
             return false;
+        } else if (cls->is_struct && (*type & TYPE_STRUCT) == 0) {
+            // Only written the first time, since function bodies are checked on several threads
+            // and read the types of each other's arguments
+            *type |= TYPE_STRUCT;
         }
     }
+    if (is_soa(*type) && !is_struct(type_of_array(*type))) {
+        fprintf(globals->ferr, "Error: only arrays of structs can be soa, not arrays of '%s'\n",
+                lookup_symbol(globals, base));
+        return false;
+    }
     return true;
 }
 
@@ -1066,9 +1163,9 @@ static bool typecheck_fundef(struct Globals *globals, struct TypeCheckerContext
     enter_scope(globals, &scope, true, false);
     context->enclosing_func = fundef;
     context->scope = scope;
-    bool ret = scope_vars(globals, context, fundef->args) 
-        && typecheck_definitions(globals, context, fundef->args)
-        && typecheck_type(globals, context, fundef->rettype)
+    bool ret = typecheck_definitions(globals, context, fundef->args)
+        && scope_vars(globals, context, fundef->args)
+        && typecheck_type(globals, context, &(fundef->rettype))
         && typecheck_statements(globals, context, fundef->stmts);
     if (!ret) {
         exit_scope(&scope);
@@ -1104,11 +1201,20 @@ static bool typecheck_class(struct Globals *globals, struct TypeCheckerContext *
         fprintf(globals->ferr, "Error: class '%s' declare with no fields\n",
                 lookup_symbol(globals, cls->name));
         return false;
+    } else if (cls->is_struct && !linkedlist_is_empty(cls->methods)) {
+        fprintf(globals->ferr, "Error: struct '%s' cannot have methods\n",
+                lookup_symbol(globals, cls->name));
+        return false;
     }
     size_t i = 0;
     linkedlist_foreach(lnode, cls->definitions->head) {
         struct Definition *def = lnode->value;
-        if (!typecheck_type(globals, context, def->type)) {
+        if (!typecheck_type(globals, context, &(def->type))) {
+            return false;
+        } else if (cls->is_struct && (is_object(def->type) || is_struct(def->type))) {
+            fprintf(globals->ferr, "Error: field '%s' of struct '%s' must be a primitive\n",
+                    lookup_symbol(globals, def->name),
+                    lookup_symbol(globals, cls->name));
             return false;
         }
         size_t j = 0;
@@ -1165,7 +1271,102 @@ static bool typecheck_tld(struct Globals *globals, struct TypeCheckerContext *co
     return false;
 }
 
-static bool typecheck_tlds(struct Globals *globals, struct TypeCheckerContext *context,
+/* Gives each field its slot in its object. Struct fields are flattened into one slot per field
+ * of the struct, so structs have to be laid out before any class that uses them */
+static void layout_class(struct TypeCheckerContext *context, struct Class *cls)
+{
+    size_t slot = 0;
+    linkedlist_foreach(lnode, cls->definitions->head) {
+        struct Definition *def = lnode->value;
+        def->scope_offset = slot;
+        slot += type_slots(context->cls_table, def->type);
+    }
+    cls->slot_count = slot;
+    // The class table has its own copy of the class
+    lookup_class(context->cls_table, cls->name)->slot_count = slot;
+}
+
+/* A struct can't be told apart from a class until every class is known, so the types in every
+ * declaration are resolved before any function body gets checked */
+static bool typecheck_declarations(struct Globals *globals, struct TypeCheckerContext *context,
+        TopLevelDecls *tlds)
+{
+    linkedlist_foreach(lnode, tlds->head) {
+        struct TopLevelDecl *tld = lnode->value;
+        if (tld->type == TLD_TYPE_CLASS) {
+            if (!typecheck_definitions(globals, context, tld->cls->definitions)) {
+                return false;
+            }
+        } else if (!tld->fundef->is_foreign) {
+            struct FunDef *fundef = tld->fundef;
+            if (!typecheck_definitions(globals, context, fundef->args)
+                    || !typecheck_type(globals, context, &(fundef->rettype))) {
+                return false;
+            }
+            // So does the function table
+            lookup_fun(context->fun_table, fundef->name)->rettype = fundef->rettype;
+        }
+    }
+    for (int structs = 1; structs >= 0; structs--) {
+        linkedlist_foreach(lnode, tlds->head) {
+            struct TopLevelDecl *tld = lnode->value;
+            if (tld->type == TLD_TYPE_CLASS && tld->cls->is_struct == structs) {
+                layout_class(context, tld->cls);
+            }
+        }
+    }
+    return true;
+}
+
+/* Once the declarations are known, every function body can be checked without looking at any
+ * other, so they're checked in chunks on several threads. Each worker allocates out of its own
+ * allocator and writes its errors to a buffer of its own, so that only the error from the first
+ * tld that fails is printed, as if they'd been checked one at a time. */
+struct TypecheckWorker {
+    struct Globals globals;
+    char *errors;
+    size_t error_length;
+};
+
+struct TypecheckChunk {
+    bool has_entrypoint;
+    char *error; // From the tld that failed, if one did
+};
+
+struct TypecheckJob {
+    struct TypeCheckerContext *context;
+    size_t tld_count;
+    struct TopLevelDecl **tlds;
+    size_t chunk_count;
+    struct TypecheckChunk *chunks;
+    struct TypecheckWorker *workers;
+};
+
+static bool typecheck_chunk(void *data, size_t worker_index, size_t chunk_index)
+{
+    struct TypecheckJob *job = data;
+    struct TypecheckWorker *worker = &(job->workers[worker_index]);
+    struct TypecheckChunk *chunk = &(job->chunks[chunk_index]);
+    struct TypeCheckerContext context = *(job->context);
+    context.has_entrypoint = false;
+    fflush(worker->globals.ferr);
+    size_t error_start = worker->error_length;
+    size_t end = chunk_start(chunk_index + 1, job->chunk_count, job->tld_count);
+    for (size_t i = chunk_start(chunk_index, job->chunk_count, job->tld_count); i < end; i++) {
+        if (!typecheck_tld(&(worker->globals), &context, job->tlds[i])) {
+            fflush(worker->globals.ferr);
+            size_t length = worker->error_length - error_start;
+            chunk->error = malloc(length + 1);
+            memcpy(chunk->error, worker->errors + error_start, length);
+            chunk->error[length] = '\0';
+            return false;
+        }
+    }
+    chunk->has_entrypoint = context.has_entrypoint;
+    return true;
+}
+
+static bool typecheck_tlds_serially(struct Globals *globals, struct TypeCheckerContext *context,
         TopLevelDecls *tlds)
 {
     linkedlist_foreach(lnode, tlds->head) {
@@ -1176,6 +1377,92 @@ static bool typecheck_tlds(struct Globals *globals, struct TypeCheckerContext *c
     return true;
 }
 
+static void free_workers(struct Globals *globals, struct TypecheckWorker *workers, size_t count)
+{
+    for (size_t w = 0; w < count; w++) {
+        if (workers[w].globals.ferr != NULL) {
+            fclose(workers[w].globals.ferr);
+        }
+        free(workers[w].errors);
+        allocator_merge(globals->allocator, workers[w].globals.allocator);
+    }
+    free(workers);
+}
+
+static bool typecheck_tlds_parallel(struct Globals *globals, struct TypeCheckerContext *context,
+        TopLevelDecls *tlds, size_t worker_count)
+{
+    struct TypecheckJob job;
+    job.context = context;
+    job.tld_count = tlds->length;
+    job.tlds = malloc(job.tld_count * sizeof(*(job.tlds)));
+    size_t i = 0;
+    linkedlist_foreach(lnode, tlds->head) {
+        job.tlds[i++] = lnode->value;
+    }
+    job.chunk_count = parallel_chunks(worker_count, job.tld_count);
+    job.chunks = calloc(job.chunk_count, sizeof(*(job.chunks)));
+    job.workers = calloc(worker_count, sizeof(*(job.workers)));
+    for (size_t w = 0; w < worker_count; w++) {
+        struct TypecheckWorker *worker = &(job.workers[w]);
+        worker->globals = *globals;
+        worker->globals.allocator = allocator_new();
+        worker->globals.ferr = open_memstream(&(worker->errors), &(worker->error_length));
+        if (worker->globals.ferr == NULL) {
+            // Workers need somewhere to hold their errors, so do without them
+            free_workers(globals, job.workers, w + 1);
+            free(job.chunks);
+            free(job.tlds);
+            return typecheck_tlds_serially(globals, context, tlds);
+        }
+    }
+    bool is_success = parallel_run(worker_count, job.chunk_count, typecheck_chunk, &job);
+    free_workers(globals, job.workers, worker_count);
+    bool has_printed_error = false;
+    for (size_t c = 0; c < job.chunk_count; c++) {
+        context->has_entrypoint = context->has_entrypoint || job.chunks[c].has_entrypoint;
+        if (job.chunks[c].error != NULL && !has_printed_error) {
+            fputs(job.chunks[c].error, globals->ferr);
+            has_printed_error = true;
+        }
+        free(job.chunks[c].error);
+    }
+    free(job.chunks);
+    free(job.tlds);
+    return is_success;
+}
+
+/* When function bodies are only checked once they're called, the classes and main's signature
+ * still get checked up front */
+static bool typecheck_tlds_lazily(struct Globals *globals, struct TypeCheckerContext *context,
+        TopLevelDecls *tlds)
+{
+    linkedlist_foreach(lnode, tlds->head) {
+        struct TopLevelDecl *tld = lnode->value;
+        if (tld->type == TLD_TYPE_CLASS) {
+            if (!typecheck_class(globals, context, tld->cls)) {
+                return false;
+            }
+        } else if (!tld->fundef->is_foreign && !typecheck_entrypoint(globals, context, tld->fundef)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool typecheck_tlds(struct Globals *globals, struct TypeCheckerContext *context,
+        TopLevelDecls *tlds)
+{
+    if (globals->compile_mode == COMPILE_LAZY_TYPECHECK) {
+        return typecheck_tlds_lazily(globals, context, tlds);
+    }
+    size_t workers = parallel_workers(globals->function_count);
+    if (workers > 1) {
+        return typecheck_tlds_parallel(globals, context, tlds, workers);
+    }
+    return typecheck_tlds_serially(globals, context, tlds);
+}
+
 static struct ClassTable *init_class_table(struct Globals *globals)
 {
     struct Class *clst = DEL_MALLOC(globals->class_count * sizeof(*clst));
@@ -1222,7 +1509,8 @@ bool typecheck(struct Globals *globals)
     if (!add_types(globals->ast, context->cls_table, context->fun_table)) {
         return false;
     } 
-    bool is_success = typecheck_tlds(globals, context, globals->ast);
+    bool is_success = typecheck_declarations(globals, context, globals->ast)
+        && typecheck_tlds(globals, context, globals->ast);
     if (is_success && !context->has_entrypoint) {
         fprintf(globals->ferr, "Error: program has no main function\n");
         return false;
@@ -1231,5 +1519,18 @@ bool typecheck(struct Globals *globals)
     return is_success;
 }
 
+/* Checks the body of a function that's compiled lazily, the first time it's called. Everything
+ * else was checked by typecheck. */
+bool typecheck_function(struct Globals *globals, struct FunDef *fundef)
+{
+    struct TypeCheckerContext context;
+    context.has_entrypoint = false;
+    context.enclosing_func = NULL;
+    context.fun_table = globals->cc->fundef_table;
+    context.cls_table = globals->cc->class_table;
+    context.scope = NULL;
+    return typecheck_fundef(globals, &context, fundef);
+}
+
 #undef find_open_loc
 
@@ -21,11 +21,17 @@ struct Scope {
     size_t varcount;
     size_t objcount;
     Definitions *definitions;
+    // Scopes with more than SCOPE_HASH_MIN definitions also index them by name, in an open
+    // addressed table that's at most half full
+    size_t bucket_capacity;
+    struct Definition **buckets;
     struct Scope *parent;
 };
 
 struct Class *lookup_class(struct ClassTable *ct, Symbol symbol);
 struct FunDef *lookup_fun(struct FunctionTable *ft, Symbol symbol);
+size_t type_slots(struct ClassTable *ct, Type type);
 bool typecheck(struct Globals *globals);
+bool typecheck_function(struct Globals *globals, struct FunDef *fundef);
 
 #endif
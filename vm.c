@@ -3,129 +3,12 @@
 #include "vm.h"
 #include "printers.h"
 #include "vector.h"
+#include "heap.h"
 #include "heap_ptr.h"
 #include "gc.h"
 #include "ffi.h"
 #include "del.h"
 
-// Walk the list of values that are alive, marking and putting into PointerRemaps
-//
-// old_loc has old location, new_loc = previous new_loc offset + count of old_loc pointer
-//
-// Basically we want to simulate adding them to the heap before we do it, we can update all of
-// the pointers when we actually start adding them to the new heap
-//
-// unmark once we've moved them into new heap
-
-static void print_object(struct Heap *heap, size_t location, size_t count, char **string_pool,
-        FILE *fout);
-
-// static void print_ptr(struct Heap *heap, HeapPointer ptr, char **string_pool)
-// {
-//     size_t location = get_location(ptr);
-//     size_t count = get_count(ptr);
-//     print_object(heap, location, count, string_pool);
-//     printf("\n");
-// }
-
-#if 0
-// #if DEBUG_RUNTIME
-// TODO: make this not recursive since that could easily exhaust C stack if we have a large
-// recursive datastructure like a linkedlist 
-static void gc_mark_children(struct GarbageCollector *gc, HeapPointer ptr, struct Heap *heap,
-        char **string_pool)
-// #else
-// static void gc_mark_children(struct GarbageCollector *gc, HeapPointer ptr, struct Heap *heap)
-// #endif
-{
-    if (ptr == 0 || gc_is_marked(ptr)) {
-        return;
-    }
-    gc_remap(gc, ptr);
-    gc_mark(&ptr);
-    size_t location = get_location(ptr);
-    size_t count = get_count(ptr);
-    // Loop through elements in heap object, mark inner objects
-    if (is_array_ptr(ptr)) {
-        if (is_array_of_objects(ptr)) {
-            printf("marking child array: \n");
-            for (size_t i = location; i < count + location; i++) {
-                DelValue value = vector_get(heap->vector, i);
-                gc_mark_children(gc, value.offset, heap, string_pool);
-            }
-        }
-    } else {
-        printf("marking child object: \n");
-        print_object(heap, location, count, string_pool);
-        printf("\n");
-        uint16_t types[4] = {0};
-        uint16_t type_index = 0;
-        for (size_t i = 0; i < count; i++) {
-            DelValue value = vector_get(heap->vector, i + location);
-            if (i % 5 == 0) {
-                memcpy(types, value.types, 8);
-                type_index = 0;
-            } else {
-                Type type = types[type_index];
-                if (is_object(type)) {
-                    printf("recursing...\n");
-                    gc_mark_children(gc, value.offset, heap, string_pool);
-                }
-                type_index++;
-            }
-        }
-    }
-}
-
-// Copy all marked objects into new heap and update pointers to new locations
-static void gc_move(struct GarbageCollector *gc, struct Stack *stack, struct StackFrames *sfs,
-        struct Heap *heap, char **string_pool)
-{
-    printf("stack:\n");
-    for (size_t i = 0; i < stack->offset; i++) {
-        gc_remap_ptr(gc, &stack->values[i].offset);
-        // gc_remap_children(&gc, ptr, heap);
-        // gc_mark_children(&gc, ptr, heap, string_pool);
-    }
-    printf("locals:\n");
-    for (size_t i = 0; i < sfs->index; i++) {
-        gc_remap_ptr(gc, &sfs->values[i].offset);
-        // gc_mark_children(&gc, ptr, heap, string_pool);
-    }
-}
-
-static void gc_collect(struct Heap *heap, struct Stack *stack, struct StackFrames *sfs,
-        char **string_pool)
-{
-    struct Vector *new_heap = vector_new(HEAP_INIT, HEAP_MAX);
-    struct GarbageCollector gc;
-    gc_init(&gc);
-    printf("stack:\n");
-    for (size_t i = 0; i < stack->offset; i++) {
-        HeapPointer ptr = stack->values[i].offset;
-        gc_mark_children(&gc, ptr, heap, string_pool);
-    }
-    printf("locals:\n");
-    for (size_t i = 0; i < sfs->index; i++) {
-        HeapPointer ptr = sfs->values[i].offset;
-        gc_mark_children(&gc, ptr, heap, string_pool);
-    }
-    printf("remap:\n");
-    print_remap(&gc);
-    // heap->gc_threshold = GC_GROWTH_FACTOR * new_heap->capacity;
-    // heap->vector = new_heap;
-    vector_free(new_heap); // this is just to make valgrind happy until I do stuff
-    gc_free(&gc);
-    printf("========================\n");
-    return;
-}
-#endif
-
-// 
-// static void gc_sweep()
-// {
-// }
-
 // NOTE: push does not check for overflow
 // Any call of push that is not preceded by an equal or greater number of pops
 // should check for overflow
@@ -165,6 +48,11 @@ static inline DelValue pop(struct Stack *stack)
     return stack->values[--stack->offset];
 }
 
+static inline DelValue peek(struct Stack *stack)
+{
+    return stack->values[stack->offset - 1];
+}
+
 #define dup(stack_ptr) do {\
     val1 = pop(stack_ptr);\
     push(stack_ptr, val1);\
@@ -181,6 +69,17 @@ static inline void swap(struct Stack *stack)
     push(stack, val2);
 }
 
+/* Pops the return address from under a struct of the given number of slots */
+static NOINLINE size_t pop_ret_struct(struct VirtualMachine *vm, size_t slots)
+{
+    struct Stack *stack = &(vm->stack);
+    DelValue *ret = &(stack->values[stack->offset - slots - 1]);
+    size_t ip = ret->offset;
+    memmove(ret, ret + 1, slots * sizeof(*ret));
+    stack->offset--;
+    return ip;
+}
+
 // Exchanges values on the stack at index1 and index2
 static inline void switch_op(struct Stack *stack)
 {
@@ -205,58 +104,266 @@ static inline void switch_op(struct Stack *stack)
     errno = 0; \
 } while (0)
 
-/* Pops values from the stack and pushes them onto the heap */
-// TODO: Rewrite this + compiler so that push_heap allocates but doesn't set anything
-static inline bool push_heap(size_t count, size_t metadata, struct Heap *heap, struct Stack *stack,
-        struct Stack *stack_obj, struct StackFrames *sfs_obj, char **string_pool, FILE *ferr)
+/* Allocations that fail for lack of memory stop the VM with DEL_VM_STATUS_OUT_OF_MEMORY */
+static bool out_of_memory(struct Heap *heap, FILE *ferr)
+{
+    fprintf(ferr, "Fatal runtime error: out of memory\n");
+    heap->limits.out_of_memory = true;
+    return false;
+}
+
+static bool over_capacity(struct Heap *heap, size_t requested, size_t capacity, FILE *ferr)
+{
+    fprintf(ferr, "Fatal runtime error: requested %lu bytes but VM only has a capacity of %lu bytes\n",
+            IN_BYTES(requested),
+            IN_BYTES(capacity));
+    heap->limits.out_of_memory = true;
+    return false;
+}
+
+/* Lets the host know when an allocation is about to take the heap past its soft limit. This
+ * is only checked on the slow path, right after collecting or growing. */
+static void check_soft_limit(struct Heap *heap, size_t slots)
+{
+    struct HeapLimits *limits = &(heap->limits);
+    if (limits->soft_limit == 0) {
+        return;
+    }
+    size_t usage = heap_usage(heap) + slots;
+    if (usage <= limits->soft_limit) {
+        limits->over_soft_limit = false;
+    } else if (!limits->over_soft_limit) {
+        limits->over_soft_limit = true;
+        if (limits->soft_limit_callback != NULL) {
+            limits->soft_limit_callback(limits->soft_limit_context, IN_BYTES(usage));
+        }
+    }
+}
+
+#if !GC_NONMOVING
+/* Make sure there's room on the heap for an allocation. When the heap reaches its gc threshold
+ * we collect first, and then grow the heap if the live data plus the new allocation doesn't
+ * leave enough headroom. Anything that's live must be on the object stack or in an object local
+ * when this is called. */
+static bool heap_reserve(struct Heap *heap, size_t slots, struct Stack *stack_obj,
+        struct StackFrames *sfs_obj, struct StackFrames *frame_objs, struct ClassLayout *layouts,
+        FILE *ferr)
+{
+    if (expected(heap->length + slots <= heap->gc_threshold)) {
+        return true;
+    }
+#if !GCOFF
+    if (!gc_collect(heap, stack_obj, sfs_obj, frame_objs, layouts)) {
+        return out_of_memory(heap, ferr);
+    }
+#endif
+    size_t new_usage = heap->length + slots;
+    if (new_usage + heap->large.slots > heap->max_capacity) {
+        return over_capacity(heap, new_usage + heap->large.slots, heap->max_capacity, ferr);
+    }
+    size_t threshold = heap_headroom(heap, new_usage);
+    if (threshold > heap->max_capacity - heap->large.slots) {
+        threshold = heap->max_capacity - heap->large.slots;
+    }
+    if (threshold > heap->capacity && !heap_grow(heap, threshold)) {
+        return out_of_memory(heap, ferr);
+    }
+    if (threshold > heap->gc_threshold) {
+        heap->gc_threshold = threshold;
+        heap_fit_large_threshold(heap);
+    }
+    check_soft_limit(heap, slots);
+    return true;
+}
+#endif
+
+/* Same as heap_reserve, but for the large object space. Large objects are never copied, so
+ * there's nothing to grow: we only decide whether it's time to collect. */
+static bool large_reserve(struct Heap *heap, size_t slots, struct Stack *stack_obj,
+        struct StackFrames *sfs_obj, struct StackFrames *frame_objs, struct ClassLayout *layouts,
+        FILE *ferr)
+{
+    struct LargeObjectSpace *large = &(heap->large);
+    if (expected(large->slots + slots <= large->gc_threshold)) {
+        return true;
+    }
+#if !GCOFF
+    if (!gc_collect(heap, stack_obj, sfs_obj, frame_objs, layouts)) {
+        return out_of_memory(heap, ferr);
+    }
+#endif
+    if (slots > heap->max_capacity - heap_usage(heap)) {
+        return over_capacity(heap, slots, heap->max_capacity - heap_usage(heap), ferr);
+    }
+    size_t threshold = heap_headroom(heap, large->slots + slots);
+    if (threshold > heap->max_capacity - heap->length) {
+        threshold = heap->max_capacity - heap->length;
+    }
+    if (threshold > large->gc_threshold) {
+        large->gc_threshold = threshold;
+        heap_fit_gc_threshold(heap);
+    }
+    check_soft_limit(heap, slots);
+    return true;
+}
+
+#if GC_NONMOVING
+/* Non-moving counterpart of heap_reserve and heap_alloc: pops a cell off of the free list for
+ * its size. Once a size class runs out of cells it gets a new block, and we collect first if
+ * that would take the heap past its gc threshold. */
+static bool heap_alloc_slots(struct Heap *heap, size_t slots, struct Stack *stack_obj,
+        struct StackFrames *sfs_obj, struct StackFrames *frame_objs, struct ClassLayout *layouts,
+        size_t *location, FILE *ferr)
 {
-    size_t ptr = heap->vector->length;
+    if (unexpected(slots > SIZE_CLASS_SLOTS_MAX)) {
+        // Bigger objects and arrays go in the large object space, so this shouldn't happen
+        fprintf(ferr, "Fatal runtime error: object requires %lu bytes which exceeds maximum size of %lu"
+                " bytes\n", IN_BYTES(slots), IN_BYTES((size_t)SIZE_CLASS_SLOTS_MAX));
+        return false;
+    } else if (expected(heap_pop_cell(heap, slots, location))) {
+        heap->stats->allocated_slots += slots;
+        return true;
+    }
+    if (!heap_has_free_block(heap) && heap->length + BLOCK_SLOTS > heap->gc_threshold) {
+#if !GCOFF
+        if (!gc_collect(heap, stack_obj, sfs_obj, frame_objs, layouts)) {
+            return out_of_memory(heap, ferr);
+        }
+        // Fragmentation means the heap can't shrink down to what's live, so the headroom goes
+        // on top of everything that's already been handed out
+        size_t live = heap->stats->live_slots;
+        size_t headroom = heap_headroom(heap, live) - live;
+        heap->gc_threshold = heap->length + (headroom < BLOCK_SLOTS ? BLOCK_SLOTS : headroom);
+        if (heap->gc_threshold > heap->max_capacity - heap->large.slots) {
+            heap->gc_threshold = heap->max_capacity - heap->large.slots;
+        }
+        heap_fit_large_threshold(heap);
+        if (heap_pop_cell(heap, slots, location)) {
+            heap->stats->allocated_slots += slots;
+            check_soft_limit(heap, 0);
+            return true;
+        }
+#endif
+    }
+    if (!heap_has_free_block(heap) && heap_usage(heap) + BLOCK_SLOTS > heap->max_capacity) {
+        return over_capacity(heap, heap_usage(heap) + BLOCK_SLOTS, heap->max_capacity, ferr);
+    } else if (!heap_new_block(heap, slots)) {
+        return out_of_memory(heap, ferr);
+    }
+    heap_fit_large_threshold(heap);
+    heap->stats->allocated_slots += slots;
+    check_soft_limit(heap, 0);
+    return heap_pop_cell(heap, slots, location);
+}
+#else
+/* Reserves room for an allocation and bump allocates it */
+static inline bool heap_alloc_slots(struct Heap *heap, size_t slots, struct Stack *stack_obj,
+        struct StackFrames *sfs_obj, struct StackFrames *frame_objs, struct ClassLayout *layouts,
+        size_t *location, FILE *ferr)
+{
+    if (!heap_reserve(heap, slots, stack_obj, sfs_obj, frame_objs, layouts, ferr)) {
+        return false;
+    }
+    heap->stats->allocated_slots += slots;
+    *location = heap_alloc(heap, slots);
+    return true;
+}
+#endif
+
+#if GC_NONMOVING
+/* Objects too big for any size class go in the large object space, like big arrays */
+static bool new_large_object(size_t class_id, size_t count, struct Heap *heap,
+        struct Stack *stack_obj, struct StackFrames *sfs_obj, struct StackFrames *frame_objs,
+        struct ClassLayout *layouts, FILE *ferr)
+{
+    size_t index;
+    if (!large_reserve(heap, count, stack_obj, sfs_obj, frame_objs, layouts, ferr)) {
+        return false;
+    } else if (!large_alloc(&(heap->large), count, count, &index)) {
+        return out_of_memory(heap, ferr);
+    }
+    heap->stats->allocated_slots += count;
+    heap->stats->objects_allocated[class_id]++;
+    HeapPointer ptr = index;
+    set_large_bit(&ptr);
+    heap_values(heap, ptr)[0].offset = class_id;
+    push_offset(stack_obj, ptr);
+    return true;
+}
+#endif
+
+/* Allocates an object and pushes a pointer to it onto the stack. Memory from the heap is
+ * always zeroed, so the only thing to fill in is the header; the compiler emits a store for
+ * each field right after this */
+static inline bool new_object(size_t class_id, struct Heap *heap, struct Stack *stack_obj,
+        struct StackFrames *sfs_obj, struct StackFrames *frame_objs, struct ClassLayout *layouts,
+        FILE *ferr)
+{
+    size_t count = OBJECT_HEADER_SLOTS + layouts[class_id].field_count;
+    HeapPointer ptr = 0;
+    size_t location = 0;
     if (!set_count(&ptr, count)) {
         fprintf(ferr, "Fatal runtime error: object requires %lu bytes which exceeds maximum size of %lu"
                 " bytes\n", IN_BYTES(count), IN_BYTES(COUNT_MAX));
         return false;
     }
-    set_metadata(&ptr, metadata);
-    size_t new_usage = heap->vector->length + count;
-    // printf("new usage: %lu\n", new_usage);
-    if (new_usage > heap->vector->max_capacity) {
-        fprintf(ferr, "Fatal runtime error: requested %lu bytes but VM only has a capacity of %lu bytes\n",
-                IN_BYTES(new_usage), 
-                IN_BYTES(heap->vector->max_capacity));
+#if GC_NONMOVING
+    if (count > SIZE_CLASS_SLOTS_MAX) {
+        return new_large_object(class_id, count, heap, stack_obj, sfs_obj, frame_objs, layouts,
+                ferr);
+    }
+#endif
+    if (!heap_alloc_slots(heap, count, stack_obj, sfs_obj, frame_objs, layouts, &location,
+                ferr)) {
         return false;
-    } else if (heap->vector->length == heap->vector->capacity && heap->vector->length > 0) {
-        // Pulled from vector.c logic
-        // Only want to GC when we are on the verge of needing to grow array
-        // gc_collect(heap, stack, sfs);
-    }
-    // vector_grow(&(heap->vector), count);
-    uint16_t types[4] = {0};
-    uint16_t type_index = 0;
-    DelValue value;
-    for (size_t i = 0; i < count; i++) {
-        if (i % 5 == 0) {
-            value = pop(stack);
-            memcpy(types, value.types, 8);
-            type_index = 0;
-        } else {
-            Type type = types[type_index];
-            value = is_object_or_null(type) ? pop(stack_obj) : pop(stack);
-            type_index++;
-        }
-        vector_append(&(heap->vector), value);
     }
-    push_offset(stack_obj, ptr);
-    // if (new_usage > 20) {
-    // gc_collect(heap, stack_obj, sfs_obj, string_pool);
-    // }
+    heap->stats->objects_allocated[class_id]++;
+    heap->values[location].offset = class_id;
+    push_offset(stack_obj, ptr | location);
 // #if DEBUG_RUNTIME
 //     print_heap(heap);
 // #endif
     return true;
 }
 
-// static inline bool push_array(struct Heap *heap, struct Stack *stack)//, struct StackFrames *sfs)
+/* Allocates a zeroed array of count elements of type array_type */
+static inline bool alloc_array(struct Heap *heap, size_t count, Type array_type,
+        struct Stack *stack_obj, struct StackFrames *sfs_obj, struct StackFrames *frame_objs,
+        struct ClassLayout *layouts, HeapPointer *ptr, FILE *ferr)
+{
+    *ptr = 0;
+    // Narrow elements are packed, the count is always the number of elements
+    enum ArrayWidth width = array_width(array_type);
+    size_t slots = array_slots(count, width);
+    // The heap hands out zeroed memory, so this is all it takes to allocate an array
+    if (is_large(count, slots)) {
+        size_t index;
+        if (!large_reserve(heap, slots, stack_obj, sfs_obj, frame_objs, layouts, ferr)) {
+            return false;
+        } else if (!large_alloc(&(heap->large), count, slots, &index)) {
+            return out_of_memory(heap, ferr);
+        }
+        heap->stats->allocated_slots += slots;
+        *ptr = index;
+        set_large_bit(ptr);
+    } else {
+        size_t location = 0;
+        if (!heap_alloc_slots(heap, slots, stack_obj, sfs_obj, frame_objs, layouts, &location,
+                    ferr)) {
+            return false;
+        }
+        set_count_no_check(ptr, count);
+        *ptr |= location;
+    }
+    // Store metadata / count in bits before location
+    set_array_width(ptr, width);
+    set_array_bit(ptr);
+    if (is_object(array_type)) set_array_obj_bit(ptr);
+    return true;
+}
+
 static inline bool push_array(struct Heap *heap, struct Stack *stack, struct Stack *stack_obj,
+        struct StackFrames *sfs_obj, struct StackFrames *frame_objs, struct ClassLayout *layouts,
         FILE *ferr)
 {
     size_t array_type = pop(stack).offset;
@@ -265,29 +372,11 @@ static inline bool push_array(struct Heap *heap, struct Stack *stack, struct Sta
         fprintf(ferr, "Fatal runtime error: index of array less than 1\n");
         return false;
     }
-    size_t ptr = heap->vector->length;
-    size_t count = (size_t) dirty_count;
-    if (!set_count(&ptr, count)) {
-        fprintf(ferr, "Fatal runtime error: object requires %lu bytes which exceeds maximum size of %lu"
-                " bytes\n", IN_BYTES(count), IN_BYTES(COUNT_MAX));
+    HeapPointer ptr;
+    if (!alloc_array(heap, (size_t) dirty_count, array_type, stack_obj, sfs_obj, frame_objs,
+                layouts, &ptr, ferr)) {
         return false;
     }
-    size_t new_usage = heap->vector->length + count;
-    if (new_usage > heap->vector->max_capacity) {
-        fprintf(ferr, "Fatal runtime error: out of memory\n");
-        fprintf(ferr, "Requested %lu bytes but VM only has a capacity of %lu bytes\n",
-                IN_BYTES(new_usage), 
-                IN_BYTES(heap->vector->max_capacity));
-        return false;
-    } else if (heap->vector->length == heap->vector->capacity && heap->vector->length > 0) {
-        // Pulled from vector.c logic
-        // Only want to GC when we are on the verge of needing to grow array
-        // gc_collect(heap, stack, sfs);
-    }
-    vector_grow(&(heap->vector), count);
-    // Store metadata / count in bits before location
-    set_array_bit(&ptr);
-    if (is_object(array_type)) set_array_obj_bit(&ptr);
     push_offset(stack_obj, ptr);
 // #if DEBUG_RUNTIME
 //     print_heap(heap);
@@ -295,54 +384,257 @@ static inline bool push_array(struct Heap *heap, struct Stack *stack, struct Sta
     return true;
 }
 
+/* Copies an array literal out of the constant section. Its elements were already packed by the
+ * compiler, so they can go straight into the new array */
+static NOINLINE bool new_array_from_const(struct Heap *heap, struct ConstArray *const_array,
+        struct Stack *stack_obj, struct StackFrames *sfs_obj, struct StackFrames *frame_objs,
+        struct ClassLayout *layouts, FILE *ferr)
+{
+    HeapPointer ptr;
+    if (!alloc_array(heap, const_array->count, const_array->type, stack_obj, sfs_obj,
+                frame_objs, layouts, &ptr, ferr)) {
+        return false;
+    }
+    memcpy(heap_values(heap, ptr), const_array->values, IN_BYTES(const_array->slots));
+    push_offset(stack_obj, ptr);
+    return true;
+}
+
+/* Fields of an object, which is either on the heap or in a frame */
+static inline DelValue *object_values(struct Heap *heap, struct StackFrames *frame_objs,
+        HeapPointer ptr)
+{
+    if (is_frame_ptr(ptr)) {
+        return &(frame_objs->values[get_location(ptr)]);
+    }
+#if GC_NONMOVING
+    // Big objects are in the large object space
+    return heap_values(heap, ptr);
+#else
+    return &(heap->values[get_location(ptr)]);
+#endif
+}
+
 /* Get value from the heap and push it onto the stack */
 // Technically we now need GET_HEAP_OBJ if the element we're pushing back
 // onto the stack is an object
-static inline bool get_heap(struct Heap *heap, size_t index, size_t ptr, struct Stack *stack)
+static inline bool get_heap(struct Heap *heap, struct StackFrames *frame_objs, size_t index,
+        size_t ptr, struct Stack *stack)
 {
-    size_t location = get_location(ptr);
     if (ptr == 0) {
         return false;
     }
-    push(stack, vector_get(heap->vector, location + index));
+    push(stack, object_values(heap, frame_objs, ptr)[index]);
     return true;
 }
 
 // Do we now need SET_HEAP_OBJ, similar to GET_HEAP_OBJ?
-static inline void set_heap(struct Heap *heap, size_t index, size_t ptr, DelValue value)
+static inline void set_heap(struct Heap *heap, struct StackFrames *frame_objs, size_t index,
+        size_t ptr, DelValue value)
 {
-    size_t location = get_location(ptr);
-    vector_set(heap->vector, location + index, value);
+    object_values(heap, frame_objs, ptr)[index] = value;
 }
 
-static inline bool get_array(int64_t index, size_t ptr, struct Heap *heap, struct Stack *stack,
-        FILE *ferr)
+static inline bool check_index(int64_t index, size_t ptr, struct Heap *heap, FILE *ferr)
 {
-    size_t location = get_location(ptr);
-    size_t count = get_count(ptr);
     if (ptr == 0) {
         fprintf(ferr, "Error: null pointer exception\n");
         return false;
-    } else if (index < 0 || index >= (int64_t)count) {
+    } else if (index < 0 || index >= (int64_t)heap_count(heap, ptr)) {
         fprintf(ferr, "Error: array index out of bounds exception\n");
         return false;
     }
-    push(stack, vector_get(heap->vector, location + index));
+    return true;
+}
+
+static inline bool get_array(int64_t index, size_t ptr, struct Heap *heap, struct Stack *stack,
+        FILE *ferr)
+{
+    if (!check_index(index, ptr, heap, ferr)) {
+        return false;
+    }
+    push(stack, heap_values(heap, ptr)[index]);
     return true;
 }
 
 static inline bool set_array(int64_t index, size_t ptr, struct Heap *heap, struct Stack *stack)
 {
-    size_t location = get_location(ptr);
-    size_t count = get_count(ptr);
-    if (index < 0 || index >= (int64_t)count) {
+    if (index < 0 || index >= (int64_t)heap_count(heap, ptr)) {
         return false;
     }
     DelValue value = pop(stack);
-    vector_set(heap->vector, location + index, value);
+    heap_values(heap, ptr)[index] = value;
     return true;
 }
 
+static inline char *get_packed(struct Heap *heap, size_t ptr)
+{
+    return (char *)heap_values(heap, ptr);
+}
+
+/* Accessors for arrays whose elements are packed more tightly than one DelValue per element.
+ * Values are widened when read and narrowed when written. */
+#define packed_array_accessors(name, ctype, field)\
+static inline bool get_array_##name(int64_t index, size_t ptr, struct Heap *heap,\
+        struct Stack *stack, FILE *ferr)\
+{\
+    if (!check_index(index, ptr, heap, ferr)) {\
+        return false;\
+    }\
+    ctype elem;\
+    memcpy(&elem, get_packed(heap, ptr) + index * sizeof(ctype), sizeof(ctype));\
+    DelValue value = { .field = elem };\
+    push(stack, value);\
+    return true;\
+}\
+\
+static inline bool set_array_##name(int64_t index, size_t ptr, struct Heap *heap,\
+        struct Stack *stack)\
+{\
+    if (index < 0 || index >= (int64_t)heap_count(heap, ptr)) {\
+        return false;\
+    }\
+    ctype elem = (ctype) pop(stack).field;\
+    memcpy(get_packed(heap, ptr) + index * sizeof(ctype), &elem, sizeof(ctype));\
+    return true;\
+}
+
+packed_array_accessors(byte, char, byte)
+packed_array_accessors(int32, int32_t, integer)
+packed_array_accessors(float32, float, floating)
+
+#undef packed_array_accessors
+
+static inline bool get_array_bool(int64_t index, size_t ptr, struct Heap *heap,
+        struct Stack *stack, FILE *ferr)
+{
+    if (!check_index(index, ptr, heap, ferr)) {
+        return false;
+    }
+    uint64_t word = heap_values(heap, ptr)[index / 64].offset;
+    push_integer(stack, (word >> (index % 64)) & 1);
+    return true;
+}
+
+static inline bool set_array_bool(int64_t index, size_t ptr, struct Heap *heap,
+        struct Stack *stack)
+{
+    if (index < 0 || index >= (int64_t)heap_count(heap, ptr)) {
+        return false;
+    }
+    size_t *word = &(heap_values(heap, ptr)[index / 64].offset);
+    uint64_t mask = UINT64_C(1) << (index % 64);
+    if (pop(stack).integer) {
+        *word |= mask;
+    } else {
+        *word &= ~mask;
+    }
+    return true;
+}
+
+/* Arrays of structs store stride slots per element, one for each field. Normally the elements
+ * are laid out one after another, so field k of element i is slot i * stride + k. A soa array
+ * gives each field a column of its own instead, so field k of element i is slot k * length + i.
+ * Either way this finds the first field of the element, and the distance between its fields. */
+static inline bool struct_element(int64_t index, size_t ptr, struct Heap *heap, size_t stride,
+        bool is_soa, DelValue **values, size_t *step, FILE *ferr)
+{
+    if (ptr == 0) {
+        fprintf(ferr, "Error: null pointer exception\n");
+        return false;
+    }
+    size_t length = heap_count(heap, ptr) / stride;
+    if (index < 0 || index >= (int64_t)length) {
+        fprintf(ferr, "Error: array index out of bounds exception\n");
+        return false;
+    }
+    if (is_soa) {
+        *values = &(heap_values(heap, ptr)[index]);
+        *step = length;
+    } else {
+        *values = &(heap_values(heap, ptr)[index * stride]);
+        *step = 1;
+    }
+    return true;
+}
+
+/* Pushes count fields of an element, starting from field first. Operands are the stride, first
+ * field and field count. */
+static NOINLINE bool get_array_struct(struct VirtualMachine *vm, struct Heap *heap,
+        DelValue *operands, bool is_soa)
+{
+    struct Stack *stack = &(vm->stack);
+    struct Stack *stack_obj = &(vm->stack_obj);
+    FILE *ferr = vm->ferr;
+    int64_t index = pop(stack).integer;
+    size_t ptr = pop(stack_obj).offset;
+    size_t first = operands[1].offset;
+    size_t count = operands[2].offset;
+    DelValue *values = NULL;
+    size_t step = 0;
+    if (!struct_element(index, ptr, heap, operands[0].offset, is_soa, &values, &step, ferr)) {
+        return false;
+    } else if (stack->offset + count >= STACK_MAX - 1) {
+        fprintf(ferr, "Error: stack overflow (calculation too large)\n");
+        return false;
+    }
+    for (size_t k = first; k < first + count; k++) {
+        push(stack, values[k * step]);
+    }
+    return true;
+}
+
+/* Pops count fields of an element (the last field on top), starting from field first */
+static NOINLINE bool set_array_struct(struct VirtualMachine *vm, struct Heap *heap,
+        DelValue *operands, bool is_soa)
+{
+    struct Stack *stack = &(vm->stack);
+    struct Stack *stack_obj = &(vm->stack_obj);
+    FILE *ferr = vm->ferr;
+    int64_t index = pop(stack).integer;
+    size_t ptr = pop(stack_obj).offset;
+    size_t first = operands[1].offset;
+    size_t count = operands[2].offset;
+    DelValue *values = NULL;
+    size_t step = 0;
+    if (!struct_element(index, ptr, heap, operands[0].offset, is_soa, &values, &step, ferr)) {
+        return false;
+    }
+    for (size_t k = first + count; k > first; k--) {
+        values[(k - 1) * step] = pop(stack);
+    }
+    return true;
+}
+
+/* Reads element i of an array of primitives, widened to a full DelValue */
+static DelValue array_element(struct Heap *heap, size_t ptr, Type type, size_t i)
+{
+    char *packed = get_packed(heap, ptr);
+    DelValue value = { .integer = 0 };
+    int32_t i32;
+    float f32;
+    switch (type) {
+        case TYPE_BOOL:
+            value.integer = (heap_values(heap, ptr)[i / 64].offset >> (i % 64)) & 1;
+            break;
+        case TYPE_BYTE:
+            value.byte = packed[i];
+            break;
+        case TYPE_INT32:
+            memcpy(&i32, packed + i * sizeof(i32), sizeof(i32));
+            value.integer = i32;
+            break;
+        case TYPE_FLOAT32:
+            memcpy(&f32, packed + i * sizeof(f32), sizeof(f32));
+            value.floating = f32;
+            break;
+        default:
+            value = heap_values(heap, ptr)[i];
+            break;
+    }
+    return value;
+}
+
 static inline void stack_frame_enter(struct StackFrames *sfs)
 {
     sfs->frame_offsets[sfs->frame_offsets_index++] = sfs->index;
@@ -354,11 +646,60 @@ static inline void stack_frame_exit(struct StackFrames *sfs)
     sfs->index = sfs->frame_offsets[sfs->frame_offsets_index];
 }
 
+/* Object locals are gc roots, so clear them on the way out. Otherwise a local that's defined but
+ * not yet set in a later scope would hold on to a stale pointer */
+static inline void stack_frame_exit_obj(struct StackFrames *sfs)
+{
+    size_t index = sfs->index;
+    stack_frame_exit(sfs);
+    memset(&(sfs->values[sfs->index]), 0, (index - sfs->index) * sizeof(DelValue));
+}
+
 static inline size_t stack_frame_offset(struct StackFrames *sfs)
 {
     return sfs->frame_offsets[sfs->frame_offsets_index-1];
 }
 
+/* Same as new_object, but for objects that escape analysis found never outlive the current
+ * function. The object goes at a fixed offset in the function's frame, so it costs nothing to
+ * allocate and goes away on POP_SCOPE. Frames get reused, so unlike the heap the fields have
+ * to be cleared: the collector may look at them before they're all set. */
+static inline bool new_in_frame(size_t class_id, size_t frame_offset,
+        struct StackFrames *frame_objs, struct Stack *stack_obj, struct ClassLayout *layouts,
+        FILE *ferr)
+{
+    size_t count = OBJECT_HEADER_SLOTS + layouts[class_id].field_count;
+    size_t location = stack_frame_offset(frame_objs) + frame_offset;
+    HeapPointer ptr = 0;
+    if (unexpected(location + count > FRAME_OBJECTS_MAX)) {
+        fprintf(ferr, "Error: stack overflow\n");
+        return false;
+    } else if (!set_count(&ptr, count)) {
+        fprintf(ferr, "Fatal runtime error: object requires %lu bytes which exceeds maximum size of %lu"
+                " bytes\n", IN_BYTES(count), IN_BYTES(COUNT_MAX));
+        return false;
+    }
+    if (location + count > frame_objs->index) {
+        frame_objs->index = location + count;
+    }
+    DelValue *values = &(frame_objs->values[location]);
+    values[0].offset = class_id;
+    memset(&values[OBJECT_HEADER_SLOTS], 0, IN_BYTES(count - OBJECT_HEADER_SLOTS));
+    ptr |= location;
+    set_frame_bit(&ptr);
+    push_offset(stack_obj, ptr);
+    return true;
+}
+
+/* Grow the current frame so that it covers the local at scope_offset */
+static inline void define_local(struct StackFrames *sfs, size_t scope_offset)
+{
+    size_t index = stack_frame_offset(sfs) + scope_offset + 1;
+    if (index > sfs->index) {
+        sfs->index = index;
+    }
+}
+
 static inline DelValue get_local(struct StackFrames *sfs, size_t scope_offset)
 {
     size_t sf_offset = stack_frame_offset(sfs);
@@ -382,7 +723,7 @@ static inline void set_local(struct Stack *stack, struct StackFrames *sfs, size_
 //     }
 // }
 
-static void print_primitive(Type type, DelValue dval, char **string_pool, FILE *fout)
+static void print_primitive(Type type, DelValue dval, struct PooledString *string_pool, FILE *fout)
 {
     switch (type) {
         case TYPE_NULL:
@@ -405,7 +746,7 @@ static void print_primitive(Type type, DelValue dval, char **string_pool, FILE *
             }
             break;
         case TYPE_STRING:
-            fprintf(fout, "%s", string_pool[dval.offset]);
+            fwrite(string_pool[dval.offset].string, 1, string_pool[dval.offset].length, fout);
             break;
         default:
             assert(false);
@@ -421,7 +762,7 @@ static void print_addr(size_t location, FILE *fout)
     }
 }
 
-static void pprint_primitive(Type type, DelValue dval, char **string_pool, FILE *fout)
+static void pprint_primitive(Type type, DelValue dval, struct PooledString *string_pool, FILE *fout)
 {
     if (type == TYPE_STRING) {
         fprintf(fout, "\"");
@@ -436,39 +777,47 @@ static void pprint_primitive(Type type, DelValue dval, char **string_pool, FILE
     }
 }
 
-static void print_object(struct Heap *heap, size_t location, size_t count, char **string_pool,
-        FILE *fout)
+static void print_object(struct Heap *heap, HeapPointer ptr, struct ClassLayout *layouts,
+        struct PooledString *string_pool, FILE *fout)
 {
-    if (count == 0 && location == 0) {
+    if (ptr == 0) {
         fprintf(fout, "null");
         return;
     }
-    uint16_t types[4] = {0};
-    uint16_t type_index = 0;
+    DelValue *values = heap_values(heap, ptr);
+    struct ClassLayout *layout = &layouts[values[0].offset];
     fprintf(fout, "{ ");
-    for (size_t i = 0; i < count; i++) {
-        DelValue value = vector_get(heap->vector, location + i);
-        if (i % 5 == 0) {
-            memcpy(types, value.types, 8);
-            type_index = 0;
+    for (size_t i = 0; i < layout->field_count; i++) {
+        DelValue value = values[OBJECT_HEADER_SLOTS + i];
+        if (layout_is_ptr(layout, i)) {
+            print_addr(get_location(value.offset), fout);
         } else {
-            Type type = types[type_index];
-            if (is_object_or_null(type)) {
-                print_addr(get_location(value.offset), fout);
-            } else {
-                pprint_primitive(type, value, string_pool, fout);
-            }
-            type_index++;
-            if (i != count - 1) fprintf(fout, ", ");
+            pprint_primitive(layout->types[i], value, string_pool, fout);
         }
+        if (i != layout->field_count - 1) fprintf(fout, ", ");
+    }
+    fprintf(fout, " }");
+}
+
+/* Pops a struct. Its fields are on the stack in order, same as in an object. */
+static void print_struct(struct Stack *stack, struct ClassLayout *layout, struct PooledString *string_pool,
+        FILE *fout)
+{
+    stack->offset -= layout->field_count;
+    DelValue *values = &(stack->values[stack->offset]);
+    fprintf(fout, "{ ");
+    for (size_t i = 0; i < layout->field_count; i++) {
+        pprint_primitive(layout->types[i], values[i], string_pool, fout);
+        if (i != layout->field_count - 1) fprintf(fout, ", ");
     }
     fprintf(fout, " }");
 }
 
 static void print(struct Heap *heap, struct Stack *stack, struct Stack *stack_obj,
-        char **string_pool, FILE *fout)
+        struct ClassLayout *layouts, struct PooledString *string_pool, FILE *fout)
 {
-    size_t ptr, location, count;
+    size_t ptr, count;
+    DelValue *values;
     DelValue dtype = pop(stack);
     Type type = dtype.type;
     if (!is_object_or_null(type)) {
@@ -477,32 +826,30 @@ static void print(struct Heap *heap, struct Stack *stack, struct Stack *stack_ob
         return;
     }
     ptr = pop(stack_obj).offset;
-    location = get_location(ptr);
-    count = get_count(ptr);
+    values = heap_values(heap, ptr);
+    count = heap_count(heap, ptr);
     if (is_array(type) && type_of_array(type) == TYPE_BYTE) {
-        for (size_t i = location; i < count + location; i++) {
-            fputc(vector_get(heap->vector, i).byte, fout);
-        }
+        fwrite(get_packed(heap, ptr), 1, count, fout);
     } else if (is_array(type)) {
         Type arr_type = type_of_array(type);
         if (!is_object(arr_type)) {
             fprintf(fout, "{ ");
-            for (size_t i = location; i < count + location; i++) {
-                pprint_primitive(arr_type, vector_get(heap->vector, i), string_pool, fout);
-                if (i != count + location - 1) fprintf(fout, ", ");
+            for (size_t i = 0; i < count; i++) {
+                DelValue value = array_element(heap, ptr, arr_type, i);
+                pprint_primitive(widen_type(arr_type), value, string_pool, fout);
+                if (i != count - 1) fprintf(fout, ", ");
             }
             fprintf(fout, " }");
         } else {
             fprintf(fout, "{ ");
-            for (uint64_t i = location; i < count + location; i++) {
-                ptr = vector_get(heap->vector, i).offset;
-                print_addr(get_location(ptr), fout);
-                if (i != count + location - 1) fprintf(fout, ", ");
+            for (uint64_t i = 0; i < count; i++) {
+                print_addr(get_location(values[i].offset), fout);
+                if (i != count - 1) fprintf(fout, ", ");
             }
             fprintf(fout, " }");
         }
     } else {
-        print_object(heap, location, count, string_pool, fout);
+        print_object(heap, ptr, layouts, string_pool, fout);
     }
 }
 
@@ -567,8 +914,8 @@ static void print(struct Heap *heap, struct Stack *stack, struct Stack *stack_ob
 // }
 
 // Assumes that vm is stack allocated / zeroed out
-void vm_init(struct VirtualMachine *vm, FILE *fout, FILE *ferr, DelValue *instructions,
-        char **string_pool)
+void vm_init(struct VirtualMachine *vm, FILE *fout, FILE *ferr, struct Program *program,
+        const struct DelVMSettings *settings)
 {
     vm->fout = fout;
     vm->ferr = ferr;
@@ -579,10 +926,59 @@ void vm_init(struct VirtualMachine *vm, FILE *fout, FILE *ferr, DelValue *instru
     vm->sfs.frame_offsets = calloc(STACK_MAX, sizeof(*(vm->sfs.frame_offsets)));
     vm->sfs_obj.values = calloc(STACK_MAX, sizeof(*(vm->sfs.values)));
     vm->sfs_obj.frame_offsets = calloc(STACK_MAX, sizeof(*(vm->sfs.frame_offsets)));
-    vm->heap.vector = vector_new(HEAP_INIT, HEAP_MAX);
-    vm->heap.gc_threshold = GC_GROWTH_FACTOR * vm->heap.vector->capacity;
-    vm->instructions = instructions;
-    vm->string_pool = string_pool;
+    vm->frame_objs.values = calloc(FRAME_OBJECTS_MAX, sizeof(*(vm->frame_objs.values)));
+    vm->frame_objs.frame_offsets = calloc(STACK_MAX, sizeof(*(vm->frame_objs.frame_offsets)));
+    size_t max_capacity = settings->heap_max_bytes / IN_BYTES(1);
+    size_t capacity = settings->heap_init_bytes / IN_BYTES(1);
+    capacity = capacity == 0 ? 1 : capacity;
+    // A VM that can't get its heap stops before running anything
+    if (max_capacity == 0) {
+        fprintf(ferr, "Fatal runtime error: heap_max_bytes must be at least %d bytes\n",
+                IN_BYTES(1));
+        vm->status = DEL_VM_STATUS_OUT_OF_MEMORY;
+    } else if (!heap_init(&(vm->heap), capacity < max_capacity ? capacity : max_capacity,
+                max_capacity)) {
+        fprintf(ferr, "Fatal runtime error: out of memory\n");
+        vm->status = DEL_VM_STATUS_OUT_OF_MEMORY;
+    }
+    vm->heap.limits.soft_limit = settings->heap_soft_limit_bytes / IN_BYTES(1);
+    vm->heap.limits.soft_limit_callback = settings->soft_limit_callback;
+    vm->heap.limits.soft_limit_context = settings->soft_limit_context;
+    memset(&(vm->stats), 0, sizeof(vm->stats));
+    vm->stats.class_count = program->class_count;
+    vm->stats.objects_allocated = calloc(program->class_count + 1, sizeof(uint64_t));
+    vm->stats.objects_live = calloc(program->class_count + 1, sizeof(uint64_t));
+    vm->heap.stats = &(vm->stats);
+    vm->instructions = program->instructions->values;
+    vm->string_pool = program->string_pool;
+    vm->layouts = program->layouts;
+    vm->const_arrays = program->const_arrays;
+    vm->function_count = program->function_count;
+    vm->functions = program->functions;
+    vm->profile.enabled = settings->profile_allocations;
+    vm->lazy_program = program->compiler != NULL ? program : NULL;
+}
+
+/* Compiling a function, from this vm or another one running the same program, can add to or move
+ * the program's instructions, strings and constants */
+static void reload_program(struct VirtualMachine *vm)
+{
+    struct Program *program = vm->lazy_program;
+    vm->instructions = program->instructions->values;
+    vm->string_pool = program->string_pool;
+    vm->const_arrays = program->const_arrays;
+    vm->function_count = program->function_count;
+    vm->functions = program->functions;
+}
+
+/* Compiles the body of a function whose stub was just reached */
+static NOINLINE bool compile_function(struct VirtualMachine *vm, size_t function)
+{
+    if (!compile_lazily(vm->lazy_program, function)) {
+        return false;
+    }
+    reload_program(vm);
+    return true;
 }
 
 void vm_free(struct VirtualMachine *vm)
@@ -593,7 +989,138 @@ void vm_free(struct VirtualMachine *vm)
     free(vm->sfs.frame_offsets);
     free(vm->sfs_obj.values);
     free(vm->sfs_obj.frame_offsets);
-    vector_free(vm->heap.vector);
+    free(vm->frame_objs.values);
+    free(vm->frame_objs.frame_offsets);
+    heap_free(&(vm->heap));
+    free(vm->stats.objects_allocated);
+    free(vm->stats.objects_live);
+    free(vm->profile.sites);
+}
+
+void vm_stats(struct VirtualMachine *vm, struct DelVMStats *stats)
+{
+    struct Heap *heap = &(vm->heap);
+    stats->bytes_allocated = IN_BYTES(vm->stats.allocated_slots);
+    stats->heap_bytes = IN_BYTES(heap->length + heap->large.slots);
+    stats->live_bytes = IN_BYTES(vm->stats.live_slots);
+    stats->collections = vm->stats.collections;
+    stats->total_pause_ns = vm->stats.total_pause_ns;
+    stats->max_pause_ns = vm->stats.max_pause_ns;
+    memcpy(stats->pause_histogram, vm->stats.pause_histogram, sizeof(stats->pause_histogram));
+    stats->class_count = vm->stats.class_count;
+    stats->objects_allocated = vm->stats.objects_allocated;
+    stats->objects_live = vm->stats.objects_live;
+}
+
+static size_t site_index(size_t ip, size_t capacity)
+{
+    return (ip * UINT64_C(0x9E3779B97F4A7C15)) & (capacity - 1);
+}
+
+static bool profile_grow(struct AllocationProfile *profile)
+{
+    size_t capacity = profile->capacity == 0 ? 64 : 2 * profile->capacity;
+    struct AllocationSite *sites = malloc(capacity * sizeof(*sites));
+    if (sites == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        sites[i].ip = SIZE_MAX;
+    }
+    for (size_t i = 0; i < profile->capacity; i++) {
+        struct AllocationSite *old = &(profile->sites[i]);
+        if (old->ip == SIZE_MAX) {
+            continue;
+        }
+        size_t j = site_index(old->ip, capacity);
+        while (sites[j].ip != SIZE_MAX) {
+            j = (j + 1) & (capacity - 1);
+        }
+        sites[j] = *old;
+    }
+    free(profile->sites);
+    profile->sites = sites;
+    profile->capacity = capacity;
+    return true;
+}
+
+/* Adds an allocation of the given size to the instruction at ip's running totals. The table is
+ * kept at most half full. */
+static void profile_record(struct AllocationProfile *profile, size_t ip, size_t slots)
+{
+    if (2 * (profile->length + 1) > profile->capacity && !profile_grow(profile)) {
+        return;
+    }
+    size_t i = site_index(ip, profile->capacity);
+    while (profile->sites[i].ip != ip) {
+        if (profile->sites[i].ip == SIZE_MAX) {
+            profile->sites[i].ip = ip;
+            profile->sites[i].count = 0;
+            profile->sites[i].slots = 0;
+            profile->length++;
+            break;
+        }
+        i = (i + 1) & (profile->capacity - 1);
+    }
+    profile->sites[i].count++;
+    profile->sites[i].slots += slots;
+}
+
+static int compare_sites(const void *a, const void *b)
+{
+    const struct AllocationSite *site1 = a;
+    const struct AllocationSite *site2 = b;
+    if (site1->slots != site2->slots) {
+        return site1->slots < site2->slots ? 1 : -1;
+    }
+    return site1->ip < site2->ip ? -1 : site1->ip > site2->ip;
+}
+
+/* The function whose code the instruction at ip is in, or NULL if it's in the startup code
+ * before the first function */
+static struct FunctionLocation *find_function(struct VirtualMachine *vm, size_t ip)
+{
+    size_t low = 0;
+    size_t high = vm->function_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (vm->functions[mid].location <= ip) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low == 0 ? NULL : &(vm->functions[low - 1]);
+}
+
+void vm_print_allocation_profile(struct VirtualMachine *vm, FILE *out)
+{
+    struct AllocationProfile *profile = &(vm->profile);
+    if (!profile->enabled) {
+        fprintf(out, "Allocation profiling is off\n");
+        return;
+    }
+    struct AllocationSite *sites = malloc((profile->length + 1) * sizeof(*sites));
+    if (sites == NULL) {
+        fprintf(out, "Not enough memory to print the allocation profile\n");
+        return;
+    }
+    size_t length = 0;
+    for (size_t i = 0; i < profile->capacity; i++) {
+        if (profile->sites[i].ip != SIZE_MAX) {
+            sites[length++] = profile->sites[i];
+        }
+    }
+    qsort(sites, length, sizeof(*sites), compare_sites);
+    fprintf(out, "%14s %12s  %s\n", "bytes", "allocations", "site");
+    for (size_t i = 0; i < length; i++) {
+        struct FunctionLocation *function = find_function(vm, sites[i].ip);
+        fprintf(out, "%14" PRIu64 " %12" PRIu64 "  %s+%zu (%zu)\n",
+                IN_BYTES(sites[i].slots), sites[i].count,
+                function == NULL ? "<start>" : function->name,
+                sites[i].ip - (function == NULL ? 0 : function->location), sites[i].ip);
+    }
+    free(sites);
 }
 
 #if DEBUG_RUNTIME
@@ -651,16 +1178,42 @@ void vm_free(struct VirtualMachine *vm)
     }\
 } while(0)
 
+// Instructions handled out of line work on the vm's own stacks. Passing them the loop's copies
+// instead would keep those out of registers everywhere else in the loop.
+#define store_stacks() do {\
+    vm->stack = stack;\
+    vm->stack_obj = stack_obj;\
+} while(0)
+
+#define load_stacks() do {\
+    stack = vm->stack;\
+    stack_obj = vm->stack_obj;\
+} while(0)
+
+// Charges whatever was allocated since allocated_before was read to the instruction at site
+#define profile_allocation(site, allocated_before) do {\
+    if (unexpected(vm->profile.enabled)) {\
+        profile_record(&(vm->profile), site, heap.stats->allocated_slots - (allocated_before));\
+    }\
+} while(0)
+
 static inline bool is_stack_overflow(struct StackFrames *sfs) {
     return sfs->index >= STACK_MAX - 1 || sfs->frame_offsets_index >= STACK_MAX - 1;
 }
 
 uint64_t vm_execute(struct VirtualMachine *vm)
 {
+    if (vm->status == DEL_VM_STATUS_OUT_OF_MEMORY) {
+        return vm->ret;
+    }
+    if (vm->lazy_program != NULL) {
+        reload_program(vm);
+    }
     // Define local variables for VM fields, for convenience (and maybe efficiency)
     enum DelVirtualMachineStatus status = vm->status;
     struct StackFrames sfs = vm->sfs;
     struct StackFrames sfs_obj = vm->sfs_obj;
+    struct StackFrames frame_objs = vm->frame_objs;
     struct Stack stack = vm->stack;
     struct Stack stack_obj = vm->stack_obj;
     struct Heap heap = vm->heap;
@@ -670,9 +1223,10 @@ uint64_t vm_execute(struct VirtualMachine *vm)
     DelValue val2 = vm->val2;
     size_t iterations = vm->iterations;
     DelValue *instructions = vm->instructions;
-    char **string_pool = vm->string_pool;
-    size_t count;
-    size_t metadata;
+    struct PooledString *string_pool = vm->string_pool;
+    struct ClassLayout *layouts = vm->layouts;
+    struct ConstArray *const_arrays = vm->const_arrays;
+    size_t allocated = 0; // For profile_allocation
 #include "threading.h"
     while (1) {
         switch (instructions[ip].opcode) {
@@ -692,35 +1246,57 @@ uint64_t vm_execute(struct VirtualMachine *vm)
 //                 print_stack(&stack_obj, true);
 // #endif
                 vm_break;
-            vm_case(PUSH_HEAP):
-                ip++;
-                count = instructions[ip].offset;
+            vm_case(NEW):
                 ip++;
-                metadata = instructions[ip].offset;
                 check_push(&stack_obj);
-                if (!push_heap(count, metadata, &heap, &stack, &stack_obj, &sfs_obj, string_pool,
-                            vm->ferr)) {
+                allocated = heap.stats->allocated_slots;
+                if (!new_object(instructions[ip].offset, &heap, &stack_obj, &sfs_obj, &frame_objs,
+                            layouts, vm->ferr)) {
                     status = DEL_VM_STATUS_ERROR;
                     goto exit_loop;
                 }
+                profile_allocation(ip - 1, allocated);
+                vm_break;
+            vm_case(NEW_IN_FRAME):
+                check_push(&stack_obj);
+                if (!new_in_frame(instructions[ip + 1].offset, instructions[ip + 2].offset,
+                            &frame_objs, &stack_obj, layouts, vm->ferr)) {
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                ip += 2;
                 vm_break;
             vm_case(PUSH_ARRAY):
                 check_push(&stack_obj);
-                if (!push_array(&heap, &stack, &stack_obj, vm->ferr)) {
+                allocated = heap.stats->allocated_slots;
+                if (!push_array(&heap, &stack, &stack_obj, &sfs_obj, &frame_objs, layouts,
+                            vm->ferr)) {
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                profile_allocation(ip, allocated);
+                vm_break;
+            vm_case(NEW_ARRAY_FROM_CONST):
+                check_push(&stack_obj);
+                allocated = heap.stats->allocated_slots;
+                if (!new_array_from_const(&heap, &const_arrays[instructions[ip + 1].offset],
+                            &stack_obj, &sfs_obj, &frame_objs, layouts, vm->ferr)) {
                     status = DEL_VM_STATUS_ERROR;
                     goto exit_loop;
                 }
+                profile_allocation(ip, allocated);
+                ip++;
                 vm_break;
             vm_case(LEN_ARRAY):
                 val1 = pop(&stack_obj);
-                int64_t length = (int64_t) get_count(val1.offset);
+                int64_t length = (int64_t) heap_count(&heap, val1.offset);
                 check_push(&stack);
                 push_integer(&stack, length);
                 vm_break;
             vm_case(GET_HEAP):
                 ip++;
                 val1 = pop(&stack_obj);
-                if (!get_heap(&heap, instructions[ip].offset, val1.offset, &stack)) {
+                if (!get_heap(&heap, &frame_objs, instructions[ip].offset, val1.offset, &stack)) {
                     fprintf(vm->ferr, "Error: null pointer exception\n");
                     status = DEL_VM_STATUS_ERROR;
                     goto exit_loop;
@@ -729,7 +1305,7 @@ uint64_t vm_execute(struct VirtualMachine *vm)
             vm_case(GET_HEAP_OBJ):
                 ip++;
                 val1 = pop(&stack_obj);
-                if (!get_heap(&heap, instructions[ip].offset, val1.offset, &stack_obj)) {
+                if (!get_heap(&heap, &frame_objs, instructions[ip].offset, val1.offset, &stack_obj)) {
                     fprintf(vm->ferr, "Error: null pointer exception\n");
                     status = DEL_VM_STATUS_ERROR;
                     goto exit_loop;
@@ -739,13 +1315,23 @@ uint64_t vm_execute(struct VirtualMachine *vm)
                 ip++;
                 val1 = pop(&stack_obj);
                 val2 = pop(&stack);
-                set_heap(&heap, instructions[ip].offset, val1.offset, val2);
+                set_heap(&heap, &frame_objs, instructions[ip].offset, val1.offset, val2);
                 vm_break;
             vm_case(SET_HEAP_OBJ):
                 ip++;
                 val1 = pop(&stack_obj);
                 val2 = pop(&stack_obj);
-                set_heap(&heap, instructions[ip].offset, val1.offset, val2);
+                set_heap(&heap, &frame_objs, instructions[ip].offset, val1.offset, val2);
+                vm_break;
+            vm_case(INIT_FIELD):
+                ip++;
+                val1 = pop(&stack);
+                set_heap(&heap, &frame_objs, instructions[ip].offset, peek(&stack_obj).offset, val1);
+                vm_break;
+            vm_case(INIT_FIELD_OBJ):
+                ip++;
+                val1 = pop(&stack_obj);
+                set_heap(&heap, &frame_objs, instructions[ip].offset, peek(&stack_obj).offset, val1);
                 vm_break;
             vm_case(GET_ARRAY):
                 val1 = pop(&stack);
@@ -781,6 +1367,110 @@ uint64_t vm_execute(struct VirtualMachine *vm)
                     goto exit_loop;
                 }
                 vm_break;
+            vm_case(GET_ARRAY_BYTE):
+                val1 = pop(&stack);
+                val2 = pop(&stack_obj);
+                if (!get_array_byte(val1.integer, val2.offset, &heap, &stack, vm->ferr)) {
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                vm_break;
+            vm_case(SET_ARRAY_BYTE):
+                val1 = pop(&stack);
+                val2 = pop(&stack_obj);
+                if (!set_array_byte(val1.integer, val2.offset, &heap, &stack)) {
+                    fprintf(vm->ferr, "Error: array index out of bounds exception\n");
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                vm_break;
+            vm_case(GET_ARRAY_BOOL):
+                val1 = pop(&stack);
+                val2 = pop(&stack_obj);
+                if (!get_array_bool(val1.integer, val2.offset, &heap, &stack, vm->ferr)) {
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                vm_break;
+            vm_case(SET_ARRAY_BOOL):
+                val1 = pop(&stack);
+                val2 = pop(&stack_obj);
+                if (!set_array_bool(val1.integer, val2.offset, &heap, &stack)) {
+                    fprintf(vm->ferr, "Error: array index out of bounds exception\n");
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                vm_break;
+            vm_case(GET_ARRAY_INT32):
+                val1 = pop(&stack);
+                val2 = pop(&stack_obj);
+                if (!get_array_int32(val1.integer, val2.offset, &heap, &stack, vm->ferr)) {
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                vm_break;
+            vm_case(SET_ARRAY_INT32):
+                val1 = pop(&stack);
+                val2 = pop(&stack_obj);
+                if (!set_array_int32(val1.integer, val2.offset, &heap, &stack)) {
+                    fprintf(vm->ferr, "Error: array index out of bounds exception\n");
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                vm_break;
+            vm_case(GET_ARRAY_FLOAT32):
+                val1 = pop(&stack);
+                val2 = pop(&stack_obj);
+                if (!get_array_float32(val1.integer, val2.offset, &heap, &stack, vm->ferr)) {
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                vm_break;
+            vm_case(SET_ARRAY_FLOAT32):
+                val1 = pop(&stack);
+                val2 = pop(&stack_obj);
+                if (!set_array_float32(val1.integer, val2.offset, &heap, &stack)) {
+                    fprintf(vm->ferr, "Error: array index out of bounds exception\n");
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                vm_break;
+            vm_case(GET_ARRAY_STRUCT):
+                store_stacks();
+                if (!get_array_struct(vm, &heap, &instructions[ip + 1], false)) {
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                load_stacks();
+                ip += 3;
+                vm_break;
+            vm_case(SET_ARRAY_STRUCT):
+                store_stacks();
+                if (!set_array_struct(vm, &heap, &instructions[ip + 1], false)) {
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                load_stacks();
+                ip += 3;
+                vm_break;
+            vm_case(GET_ARRAY_SOA):
+                store_stacks();
+                if (!get_array_struct(vm, &heap, &instructions[ip + 1], true)) {
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                load_stacks();
+                ip += 3;
+                vm_break;
+            vm_case(SET_ARRAY_SOA):
+                store_stacks();
+                if (!set_array_struct(vm, &heap, &instructions[ip + 1], true)) {
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                load_stacks();
+                ip += 3;
+                vm_break;
             vm_case(DUP):
                 dup(&stack);
                 vm_break;
@@ -851,10 +1541,12 @@ uint64_t vm_execute(struct VirtualMachine *vm)
                 vm_break;
             vm_case(DEFINE):
                 // TODO: Figure out how to make this compile-time only
-                sfs.index++;
+                ip++;
+                define_local(&sfs, instructions[ip].offset);
                 vm_break;
             vm_case(DEFINE_OBJ):
-                sfs_obj.index++;
+                ip++;
+                define_local(&sfs_obj, instructions[ip].offset);
                 vm_break;
             vm_case(GET_LOCAL):
                 ip++;
@@ -888,6 +1580,12 @@ uint64_t vm_execute(struct VirtualMachine *vm)
                 ip = pop(&stack).offset;
                 ip--;
                 vm_break;
+            vm_case(RET_STRUCT):
+                vm->stack = stack;
+                ip = pop_ret_struct(vm, instructions[ip + 1].offset);
+                stack = vm->stack;
+                ip--;
+                vm_break;
             vm_case(POP):
                 pop(&stack);
                 vm_break;
@@ -911,23 +1609,23 @@ uint64_t vm_execute(struct VirtualMachine *vm)
                 vm_break;
             vm_case(CAST_BYTE_ARRAY):
                 val1 = pop(&stack);
-                char *str = string_pool[val1.offset];
-                int str_len = strlen(str);
+                char *str = string_pool[val1.offset].string;
+                size_t str_len = string_pool[val1.offset].length;
                 // Create byte array
                 push_integer(&stack, str_len);
                 check_push(&stack);
                 push_offset(&stack, TYPE_BYTE);
                 check_push(&stack_obj);
-                if (!push_array(&heap, &stack, &stack_obj, vm->ferr)) {
+                allocated = heap.stats->allocated_slots;
+                if (!push_array(&heap, &stack, &stack_obj, &sfs_obj, &frame_objs, layouts,
+                            vm->ferr)) {
                     status = DEL_VM_STATUS_ERROR;
                     goto exit_loop;
                 }
+                profile_allocation(ip, allocated);
                 val2 = pop(&stack_obj);
                 // Populate byte array
-                size_t location = get_location(val2.offset);
-                for (int i = 0; i < str_len; i++) {
-                    heap.vector->values[location + i].byte = str[i];
-                }
+                memcpy(get_packed(&heap, val2.offset), str, str_len);
                 // Note: No null termination for byte arrays
                 push(&stack_obj, val2);
                 vm_break;
@@ -948,6 +1646,17 @@ uint64_t vm_execute(struct VirtualMachine *vm)
                 push_integer(&stack, dval.integer);
                 free(dvals);
                 vm_break;
+            vm_case(COMPILE):
+                if (!compile_function(vm, instructions[ip + 1].offset)) {
+                    status = DEL_VM_STATUS_ERROR;
+                    goto exit_loop;
+                }
+                instructions = vm->instructions;
+                string_pool = vm->string_pool;
+                const_arrays = vm->const_arrays;
+                // The stub is now a jump to the function's body
+                ip--;
+                vm_break;
             vm_case(SWAP):
                 swap(&stack);
                 vm_break;
@@ -962,10 +1671,12 @@ uint64_t vm_execute(struct VirtualMachine *vm)
                 }
                 stack_frame_enter(&sfs);
                 stack_frame_enter(&sfs_obj);
+                stack_frame_enter(&frame_objs);
                 vm_break;
             vm_case(POP_SCOPE):
                 stack_frame_exit(&sfs);
-                stack_frame_exit(&sfs_obj);
+                stack_frame_exit_obj(&sfs_obj);
+                stack_frame_exit(&frame_objs);
                 vm_break;
             vm_case(READ):
                 assert(false);
@@ -975,9 +1686,13 @@ uint64_t vm_execute(struct VirtualMachine *vm)
                 // }
                 vm_break;
             vm_case(PRINT): {
-                print(&heap, &stack, &stack_obj, string_pool, vm->fout);
+                print(&heap, &stack, &stack_obj, layouts, string_pool, vm->fout);
                 vm_break;
             }
+            vm_case(PRINT_STRUCT):
+                ip++;
+                print_struct(&stack, &layouts[instructions[ip].offset], string_pool, vm->fout);
+                vm_break;
             vm_case(FLOAT_ADD): eval_binary_op_f(&stack, val1, val2, +);  vm_break;
             vm_case(FLOAT_SUB): eval_binary_op_f(&stack, val1, val2, -);  vm_break;
             vm_case(FLOAT_MUL): eval_binary_op_f(&stack, val1, val2, *);  vm_break;
@@ -1011,10 +1726,14 @@ exit_loop:
     print_frames(&sfs_obj, true);
     print_heap(&heap);
 #endif
+    if (status == DEL_VM_STATUS_ERROR && heap.limits.out_of_memory) {
+        status = DEL_VM_STATUS_OUT_OF_MEMORY;
+    }
     // Update state of VM before exiting
     vm->status = status;
     vm->sfs = sfs;
     vm->sfs_obj = sfs_obj;
+    vm->frame_objs = frame_objs;
     vm->stack = stack;
     vm->stack_obj = stack_obj;
     vm->heap = heap;
@@ -1025,6 +1744,7 @@ exit_loop:
     vm->iterations = iterations;
     vm->instructions = instructions;
     vm->string_pool = string_pool;
+    vm->const_arrays = const_arrays;
     fflush(vm->fout);
     fflush(vm->ferr);
     return ret;
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "del.h"
+#include "heap.h"
 
 // Struct of arrays storing stack frames
 struct StackFrames {
@@ -18,26 +19,38 @@ struct Stack {
     DelValue *values;
 };
 
-/* A value on the heap is just a slice of bytes */
-struct Heap {
-    size_t gc_threshold;
-    struct Vector *vector;
-};
-
 typedef struct {
     Type type;
     DelValue value;
 } HeapValue;
 
+/* Allocations made by the instruction at ip, see DelVMSettings.profile_allocations */
+struct AllocationSite {
+    size_t ip; // SIZE_MAX if the entry is empty
+    uint64_t count;
+    uint64_t slots;
+};
+
+/* Open addressed hash table of allocation sites, keyed by ip */
+struct AllocationProfile {
+    bool enabled;
+    size_t length;
+    size_t capacity;
+    struct AllocationSite *sites;
+};
+
 struct VirtualMachine {
     FILE *fout;
     FILE *ferr;
     enum DelVirtualMachineStatus status;
     struct StackFrames sfs;
     struct StackFrames sfs_obj;
+    struct StackFrames frame_objs; // Objects that escape analysis put in a function's frame
     struct Stack stack;
     struct Stack stack_obj;
     struct Heap heap;
+    struct HeapStats stats;
+    struct AllocationProfile profile;
     size_t ip;
     // size_t scope_offset;
     uint64_t ret;
@@ -45,13 +58,21 @@ struct VirtualMachine {
     DelValue val2;
     size_t iterations;
     DelValue *instructions;
-    char **string_pool;
+    struct PooledString *string_pool;
+    struct ClassLayout *layouts;
+    struct ConstArray *const_arrays;
+    size_t function_count;
+    struct FunctionLocation *functions;
+    // Set if the program compiles its functions as they're first called
+    struct Program *lazy_program;
 };
 
-void vm_init(struct VirtualMachine *vm, FILE *fin, FILE *ferr, DelValue *instructions,
-        char **string_pool);
+void vm_init(struct VirtualMachine *vm, FILE *fout, FILE *ferr, struct Program *program,
+        const struct DelVMSettings *settings);
 void vm_free(struct VirtualMachine *vm);
 uint64_t vm_execute(struct VirtualMachine *vm);
+void vm_stats(struct VirtualMachine *vm, struct DelVMStats *stats);
+void vm_print_allocation_profile(struct VirtualMachine *vm, FILE *out);
 
 #endif
 